@@ -0,0 +1,119 @@
+/* wire_bench.cpp
+ * Google Benchmark for the packet parser: framing a stream of packets the
+ * way the server's read buffer holds them, and decoding META, chunk and
+ * chat payloads.  Build with -DMESHWAVE_BENCHMARKS=ON.
+ */
+
+extern "C" {
+#include "wire.h"
+#include "hash.h"
+}
+
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <vector>
+
+/* Append one v2 packet to buf */
+static void put_packet(std::vector<uint8_t> &buf, uint8_t type, uint16_t flags,
+                       const uint8_t *payload, uint32_t len)
+{
+    PktHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type        = type;
+    hdr.flags       = flags;
+    hdr.stream_id   = 7;
+    hdr.payload_len = len;
+
+    size_t at = buf.size();
+    buf.resize(at + WIRE_HDR_V2 + len);
+    wire_encode(PROTO_V2, &hdr, buf.data() + at);
+    if (len) memcpy(buf.data() + at + WIRE_HDR_V2, payload, len);
+}
+
+/* A read buffer of chunks of range(0) bytes, framed packet by packet */
+static void BM_FrameStream(benchmark::State &state)
+{
+    const uint32_t       len = (uint32_t)state.range(0);
+    std::vector<uint8_t> payload(len, 0xA5), buf;
+    while (buf.size() < (4u << 20))
+        put_packet(buf, MSG_FILE_CHUNK, PKT_FLAG_CRC, payload.data(), len);
+
+    int64_t packets = 0;
+    for (auto _ : state) {
+        size_t off = 0;
+        for (;;) {
+            PktHeader hdr;
+            long n = wire_frame(PROTO_V2, buf.data() + off, buf.size() - off, &hdr);
+            if (n <= 0) break;
+            benchmark::DoNotOptimize(hdr);
+            off += (size_t)n;
+            packets++;
+        }
+        benchmark::DoNotOptimize(off);
+    }
+    state.SetItemsProcessed(packets);
+    state.SetBytesProcessed(packets * (int64_t)(WIRE_HDR_V2 + len));
+}
+BENCHMARK(BM_FrameStream)->Arg(64)->Arg(4096)->Arg(64 * 1024)->Arg(1 << 20);
+
+static void BM_ParseMeta(benchmark::State &state)
+{
+    uint8_t payload[256];
+    size_t  n = 0;
+    memcpy(payload, "receiver\0holiday-photos.tar\0", 28);
+    n = 28;
+    memset(payload + n, 0x11, 16 + 7 + HASH_DIGEST_LEN);   /* sizes, direct, digest */
+    n += 16 + 7 + HASH_DIGEST_LEN;
+
+    PktHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type        = MSG_FILE_META;
+    hdr.flags       = PKT_FLAG_DIRECT | PKT_FLAG_DIGEST;
+    hdr.payload_len = (uint32_t)n;
+
+    for (auto _ : state) {
+        WireMeta m;
+        benchmark::DoNotOptimize(wire_parse_meta(&hdr, payload, &m));
+        benchmark::DoNotOptimize(m);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * (int64_t)n);
+}
+BENCHMARK(BM_ParseMeta);
+
+static void BM_ParseChunk(benchmark::State &state)
+{
+    std::vector<uint8_t> payload(XFER_CRC_LEN + (size_t)state.range(0), 0x5A);
+    for (auto _ : state) {
+        WireChunk c;
+        benchmark::DoNotOptimize(wire_parse_chunk(PKT_FLAG_CRC, payload.data(),
+                                                  (uint32_t)payload.size(), &c));
+        benchmark::DoNotOptimize(c);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * (int64_t)payload.size());
+}
+BENCHMARK(BM_ParseChunk)->Arg(64 * 1024)->Arg(1 << 20);
+
+static void BM_ParseChat(benchmark::State &state)
+{
+    static const char payload[] = "someone\0see you in the lobby in five";
+    PktHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type        = MSG_CHAT;
+    hdr.payload_len = sizeof(payload) - 1;
+
+    for (auto _ : state) {
+        const char *name, *text;
+        uint32_t    len;
+        benchmark::DoNotOptimize(wire_parse_chat(&hdr, (const uint8_t *)payload,
+                                                 &name, &text, &len));
+        benchmark::DoNotOptimize(text);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * (int64_t)hdr.payload_len);
+}
+BENCHMARK(BM_ParseChat);
+
+BENCHMARK_MAIN();
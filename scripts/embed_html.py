@@ -1,8 +1,24 @@
 #!/usr/bin/env python3
-"""embed_html.py — Convert an HTML file into a C header with a string literal."""
+"""embed_html.py — Convert an HTML file into a C header with a string literal,
+gzip and (when the brotli module is installed) brotli copies, and an ETag."""
 
 import sys
-import os
+import gzip
+import hashlib
+
+try:
+    import brotli
+except ImportError:
+    brotli = None
+
+def write_bytes(f, name, data):
+    f.write(f"static const unsigned char {name}[] = {{\n")
+    for i in range(0, len(data), 16):
+        f.write("    " + ",".join(f"0x{b:02x}" for b in data[i:i + 16]) + ",\n")
+    if not data:
+        f.write("    0\n")
+    f.write("};\n")
+    f.write(f"#define {name.upper()}_LEN {len(data)}\n\n")
 
 def main():
     if len(sys.argv) != 3:
@@ -14,20 +30,37 @@ def main():
     with open(src, 'r', encoding='utf-8') as f:
         html = f.read()
 
+    lines = html.splitlines()
+    raw = "".join(line + "\n" for line in lines).encode('utf-8')   # as embedded
+    gz  = gzip.compress(raw, compresslevel=9, mtime=0)
+    br  = brotli.compress(raw, quality=11) if brotli else b''
+    tag = hashlib.sha256(raw).hexdigest()[:16]
+
     with open(dst, 'w', encoding='utf-8') as f:
         f.write("/* web_bundle.h — auto-generated, do not edit */\n")
         f.write("#ifndef WEB_BUNDLE_H\n")
         f.write("#define WEB_BUNDLE_H\n\n")
         f.write("static const char index_html[] =\n")
 
-        for line in html.splitlines():
+        for line in lines:
             escaped = line.replace('\\', '\\\\').replace('"', '\\"')
             f.write(f'    "{escaped}\\n"\n')
 
-        f.write(";\n\n")
+        f.write(";\n")
+        f.write("#define INDEX_HTML_LEN (sizeof(index_html) - 1)\n\n")
+
+        # Each encoding is its own representation, so each gets its own tag
+        f.write(f'#define INDEX_HTML_ETAG    "\\"{tag}\\""\n')
+        f.write(f'#define INDEX_HTML_GZ_ETAG "\\"{tag}-gz\\""\n')
+        f.write(f'#define INDEX_HTML_BR_ETAG "\\"{tag}-br\\""\n\n')
+
+        write_bytes(f, "index_html_gz", gz)
+        write_bytes(f, "index_html_br", br)   # _LEN 0: built without brotli
+
         f.write("#endif /* WEB_BUNDLE_H */\n")
 
-    print(f"[embed] {src} -> {dst} ({len(html)} bytes)")
+    print(f"[embed] {src} -> {dst} ({len(raw)} bytes, gzip {len(gz)}"
+          + (f", brotli {len(br)}" if br else "") + ")")
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,667 @@
+/* bench.cpp
+ * --bench: the relay runs in this process, two clients run as child
+ * processes on loopback (client.c holds one connection per process), and
+ * the workload goes through the clients' REST API like the dashboard's
+ * does.  Event streams on the receiver time completions and chat.
+ */
+
+extern "C" {
+#include "server.h"
+#include "msgstore.h"
+#include "ratelimit.h"
+#include "util.h"
+}
+#include "bench.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_SENDER    "bench-a"
+#define BENCH_RECEIVER  "bench-b"
+
+/* ── Loopback HTTP ──────────────────────────────────────── */
+
+struct BenchConn {
+    int fd   = -1;
+    int port = 0;
+};
+
+static int bench_dial(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Status code of one response, its body in *out; -1 if the peer closed */
+static int bench_read_response(int fd, std::string *out)
+{
+    std::string buf;
+    char        tmp[4096];
+    size_t      hdr_end;
+    while ((hdr_end = buf.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) return -1;
+        buf.append(tmp, (size_t)n);
+    }
+    int code = 0;
+    if (sscanf(buf.c_str(), "HTTP/1.%*d %d", &code) != 1) return -1;
+
+    size_t      clen = 0;
+    std::string hdrs = buf.substr(0, hdr_end);
+    std::transform(hdrs.begin(), hdrs.end(), hdrs.begin(), ::tolower);
+    size_t cl = hdrs.find("\r\ncontent-length:");
+    if (cl != std::string::npos)
+        clen = strtoul(hdrs.c_str() + cl + 17, NULL, 10);
+
+    std::string body = buf.substr(hdr_end + 4);
+    while (body.size() < clen) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) return -1;
+        body.append(tmp, (size_t)n);
+    }
+    if (out) *out = body;
+    return code;
+}
+
+/* One request over a keep-alive connection, redialled once if the client
+ * closed it; returns the status code, or -1 */
+static int bench_call(BenchConn &c, const char *method, const char *path,
+                      const std::string &body, std::string *out)
+{
+    char hdr[512];
+    int  n = snprintf(hdr, sizeof(hdr),
+                      "%s %s HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+                      method, path, body.size());
+    std::string req = std::string(hdr, (size_t)n) + body;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (c.fd < 0 && (c.fd = bench_dial(c.port)) < 0) return -1;
+        if (util_send_all(c.fd, req.data(), (int)req.size()) == 0) {
+            int code = bench_read_response(c.fd, out);
+            if (code > 0) return code;
+        }
+        close(c.fd);
+        c.fd = -1;
+    }
+    return -1;
+}
+
+/* ── Receiver event streams ─────────────────────────────── */
+
+struct BenchSub {
+    int         fd       = -1;
+    bool        hdr_done = false;
+    std::string buf;
+};
+
+struct BenchDone {
+    std::string name;
+    long long   us;
+    bool        ok;
+};
+
+static std::vector<BenchSub>  bench_subs;
+static pthread_t              bench_reader;
+static volatile int           bench_reading = 0;
+static pthread_mutex_t        bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<BenchDone> bench_done;       /* file events, first stream only */
+static std::vector<long long> bench_chat_lat;   /* send to arrival, every stream */
+
+static void bench_on_event(size_t idx, const std::string &ev, long long now)
+{
+    if (ev.compare(0, 7, "event: ") != 0) return;     /* ping comment */
+    size_t      nl   = ev.find('\n');
+    std::string name = ev.substr(7, nl == std::string::npos ? std::string::npos : nl - 7);
+    const char *data = strstr(ev.c_str(), "data: ");
+    if (!data) return;
+
+    if (name == "chat") {
+        const char *t = strstr(data, "\"text\":\"bench ");
+        int       seq;
+        long long sent_us;
+        if (t && sscanf(t + 14, "%d %lld", &seq, &sent_us) == 2) {
+            pthread_mutex_lock(&bench_lock);
+            bench_chat_lat.push_back(now - sent_us);
+            pthread_mutex_unlock(&bench_lock);
+        }
+    } else if (idx == 0 && (name == "file_complete" || name == "file_error")) {
+        const char *f = strstr(data, "\"filename\":\"");
+        if (!f) return;
+        f += 12;
+        const char *e = strchr(f, '"');
+        if (!e) return;
+        pthread_mutex_lock(&bench_lock);
+        bench_done.push_back({ std::string(f, (size_t)(e - f)), now, name == "file_complete" });
+        pthread_mutex_unlock(&bench_lock);
+    }
+}
+
+static void *bench_read_loop(void *arg)
+{
+    (void)arg;
+    std::vector<struct pollfd> pfds(bench_subs.size());
+    for (size_t i = 0; i < bench_subs.size(); i++)
+        pfds[i] = { bench_subs[i].fd, POLLIN, 0 };
+
+    char tmp[16384];
+    while (bench_reading) {
+        if (poll(pfds.data(), pfds.size(), 100) <= 0) continue;
+        long long now = util_time_us();
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t n = recv(pfds[i].fd, tmp, sizeof(tmp), 0);
+            if (n <= 0) {
+                pfds[i].fd = -1;        /* poll skips it from now on */
+                continue;
+            }
+            BenchSub &s = bench_subs[i];
+            s.buf.append(tmp, (size_t)n);
+            if (!s.hdr_done) {
+                size_t h = s.buf.find("\r\n\r\n");
+                if (h == std::string::npos) continue;
+                s.buf.erase(0, h + 4);
+                s.hdr_done = true;
+            }
+            size_t e;
+            while ((e = s.buf.find("\n\n")) != std::string::npos) {
+                bench_on_event(i, s.buf.substr(0, e), now);
+                s.buf.erase(0, e + 2);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int bench_subscribe(int port, int count)
+{
+    static const char req[] = "GET /api/events HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    for (int i = 0; i < count; i++) {
+        BenchSub s;
+        if ((s.fd = bench_dial(port)) < 0 ||
+            util_send_all(s.fd, req, (int)sizeof(req) - 1) < 0) {
+            util_log(LOG_ERROR, "bench: cannot open event stream %d: %s", i, strerror(errno));
+            if (s.fd >= 0) close(s.fd);
+            return -1;
+        }
+        bench_subs.push_back(s);
+    }
+    bench_reading = 1;
+    pthread_create(&bench_reader, NULL, bench_read_loop, NULL);
+    return 0;
+}
+
+/* ── Clients ────────────────────────────────────────────── */
+
+/* Flags that only concern this process, or that bench_run sets itself;
+ * everything else (window, streams, limits, ...) goes to the clients */
+static const struct { const char *flag; int has_value; } bench_own_flags[] = {
+    { "--bench", 0 },      { "--bench-sizes", 1 }, { "--bench-parallel", 1 },
+    { "--bench-direct", 0 }, { "--bench-chat", 1 }, { "--bench-chat-rate", 1 },
+    { "--bench-sse", 1 },  { "--bench-out", 1 },   { "--server", 1 },
+    { "--client", 1 },     { "--name", 1 },        { "--port", 1 },
+    { "--no-browser", 0 }, { "--log-file", 1 },    { "--log-json", 0 },
+    { "--queue-max", 1 },  { "--slow-peer", 1 },  { "--data-port", 1 },
+    { "--federate", 0 },   { "--history", 1 },    { "--no-history", 0 },
+};
+
+static std::vector<std::string> bench_client_flags(int argc, char *argv[])
+{
+    std::vector<std::string> fwd;
+    for (int i = 1; i < argc; i++) {
+        int skip = -1;
+        for (const auto &f : bench_own_flags)
+            if (strcmp(argv[i], f.flag) == 0) skip = f.has_value;
+        if (skip < 0) fwd.push_back(argv[i]);
+        else          i += skip;
+    }
+    return fwd;
+}
+
+static pid_t bench_spawn(const char *self, const std::string &dir, const char *name,
+                         int port, const std::vector<std::string> &fwd)
+{
+    std::vector<std::string> args = {
+        self, "--client", "127.0.0.1", "--name", name, "--port", std::to_string(port),
+        "--no-browser", "--log-file", "meshwave.log"
+    };
+    args.insert(args.end(), fwd.begin(), fwd.end());
+    std::vector<char *> cargv;
+    for (auto &a : args) cargv.push_back(&a[0]);
+    cargv.push_back(NULL);
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(dir.c_str()) == 0)
+            execv(self, cargv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Both clients connected under their names and answering HTTP */
+static int bench_wait_ready(BenchConn &a, BenchConn &b, const pid_t pids[2])
+{
+    long deadline = util_time_ms() + BENCH_READY_MS;
+    while (util_time_ms() < deadline) {
+        for (int i = 0; i < 2; i++) {
+            if (waitpid(pids[i], NULL, WNOHANG) == pids[i]) {
+                util_log(LOG_ERROR, "bench: client %s exited during startup",
+                         i ? BENCH_RECEIVER : BENCH_SENDER);
+                return -1;
+            }
+        }
+        Peer peers[8];
+        int  n = server_get_peers(peers, 8), named = 0;
+        for (int i = 0; i < n; i++)
+            if (strcmp(peers[i].name, BENCH_SENDER) == 0 ||
+                strcmp(peers[i].name, BENCH_RECEIVER) == 0)
+                named++;
+        if (named == 2 &&
+            bench_call(a, "GET", "/api/status", "", NULL) == 200 &&
+            bench_call(b, "GET", "/api/status", "", NULL) == 200)
+            return 0;
+        usleep(50 * 1000);
+    }
+    util_log(LOG_ERROR, "bench: clients did not connect within %d ms (is port %d free?)",
+             BENCH_READY_MS, DATA_PORT);
+    return -1;
+}
+
+/* ── Measurements ───────────────────────────────────────── */
+
+typedef std::vector<std::pair<double, unsigned long long>> BenchBuckets;
+
+/* Cumulative buckets of one histogram on a /metrics page */
+static BenchBuckets bench_buckets(const std::string &page, const char *hist)
+{
+    BenchBuckets out;
+    std::string  key = std::string(hist) + "_bucket{le=\"";
+    for (size_t p = page.find(key); p != std::string::npos; p = page.find(key, p + 1)) {
+        const char *s  = page.c_str() + p + key.size();
+        char       *e;
+        double      le = strtod(s, &e);      /* "+Inf" parses as infinity */
+        const char *c  = strstr(e, "} ");
+        if (c) out.push_back({ le, strtoull(c + 2, NULL, 10) });
+    }
+    return out;
+}
+
+/* Upper bound in microseconds of the bucket holding quantile q of what
+ * was observed between two scrapes; -1 if nothing was */
+static long long bench_hist_quantile(const BenchBuckets &before, const BenchBuckets &after,
+                                     double q)
+{
+    if (after.empty()) return -1;
+    auto delta = [&](size_t i) {
+        return after[i].second - (i < before.size() ? before[i].second : 0);
+    };
+    unsigned long long total = delta(after.size() - 1);
+    if (total == 0) return -1;
+    for (size_t i = 0; i < after.size(); i++) {
+        if ((double)delta(i) >= q * (double)total)
+            return after[i].first > 1e9 ? LLONG_MAX : (long long)(after[i].first * 1e6 + 0.5);
+    }
+    return -1;
+}
+
+static long long bench_percentile(std::vector<long long> v, double q)
+{
+    if (v.empty()) return -1;
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(q * (double)(v.size() - 1) + 0.5)];
+}
+
+static std::string bench_num(long long v)
+{
+    return v < 0 || v == LLONG_MAX ? "null" : std::to_string(v);
+}
+
+/* Distinct pseudo-random bytes per file, so neither dedup nor deflate
+ * can shortcut the transfer */
+static int bench_make_file(const std::string &path, uint64_t size, uint64_t seed)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    std::vector<uint64_t> block(128 * 1024);
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (uint64_t done = 0; done < size; ) {
+        for (auto &w : block) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            w = x;
+        }
+        size_t n = (size_t)std::min<uint64_t>(size - done, block.size() * 8);
+        if (write(fd, block.data(), n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static void bench_empty_dir(const std::string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            unlink((dir + "/" + e->d_name).c_str());
+    closedir(d);
+}
+
+static int bench_rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st; (void)flag; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/* ── Workloads ──────────────────────────────────────────── */
+
+/* cfg->parallel files of `size` bytes sent together from the sender to
+ * the receiver; appends one JSON object to `json` */
+static int bench_bulk(BenchConn &a, const std::string &dir, uint64_t size,
+                      const BenchConfig *cfg, std::string &json)
+{
+    std::vector<std::string> names;
+    for (int k = 0; k < cfg->parallel; k++) {
+        char name[64];
+        snprintf(name, sizeof(name), "bench-%llu-%d.bin", (unsigned long long)size, k);
+        if (bench_make_file(dir + "/files/" + name, size, size + (uint64_t)k) < 0) {
+            util_log(LOG_ERROR, "bench: cannot write %s: %s", name, strerror(errno));
+            return -1;
+        }
+        names.push_back(name);
+    }
+
+    std::string page;
+    bench_call(a, "GET", "/metrics", "", &page);
+    BenchBuckets rtt0 = bench_buckets(page, "meshwave_ack_rtt_seconds");
+
+    pthread_mutex_lock(&bench_lock);
+    bench_done.clear();
+    pthread_mutex_unlock(&bench_lock);
+
+    long long t0 = util_time_us();
+    for (const auto &name : names) {
+        std::string body = "{\"path\":\"" + dir + "/files/" + name + "\",\"to\":\"" BENCH_RECEIVER
+                           "\",\"direct\":" + (cfg->direct ? "true" : "false") + "}";
+        if (bench_call(a, "POST", "/api/file/send", body, NULL) != 200) {
+            util_log(LOG_ERROR, "bench: sender refused %s", name.c_str());
+            return -1;
+        }
+    }
+
+    /* Generous: a minute plus 4 MB/s */
+    long long deadline = t0 + 60 * 1000000LL + (long long)(size * names.size() / 4);
+    std::vector<long long> took;
+    int failed = 0;
+    while (took.size() + failed < names.size() && util_time_us() < deadline) {
+        usleep(2000);
+        pthread_mutex_lock(&bench_lock);
+        took.clear();
+        failed = 0;
+        for (const auto &d : bench_done) {
+            if (std::find(names.begin(), names.end(), d.name) == names.end()) continue;
+            if (d.ok) took.push_back(d.us - t0);
+            else      failed++;
+        }
+        pthread_mutex_unlock(&bench_lock);
+    }
+    if (took.size() + failed < names.size()) {
+        util_log(LOG_ERROR, "bench: %zu of %zu transfers of %llu bytes unfinished",
+                 names.size() - took.size() - failed, names.size(), (unsigned long long)size);
+        return -1;
+    }
+
+    bench_call(a, "GET", "/metrics", "", &page);
+    BenchBuckets rtt1 = bench_buckets(page, "meshwave_ack_rtt_seconds");
+
+    long long last = took.empty() ? 0 : *std::max_element(took.begin(), took.end());
+    double    mibs = last > 0 ? (double)(size * took.size()) / (1024.0 * 1024) / (last / 1e6) : 0;
+    char      buf[256];
+    snprintf(buf, sizeof(buf), "{\"size\":%llu,\"transfers\":%zu,\"failed\":%d,"
+             "\"seconds\":%.3f,\"mib_per_s\":%.1f,",
+             (unsigned long long)size, names.size(), failed, last / 1e6, mibs);
+    json += buf;
+    long long p50 = bench_percentile(took, 0.50), p99 = bench_percentile(took, 0.99);
+    json += "\"transfer_ms\":{\"p50\":" + bench_num(p50 < 0 ? p50 : p50 / 1000) +
+            ",\"p99\":" + bench_num(p99 < 0 ? p99 : p99 / 1000) + "},";
+    json += "\"ack_rtt_us\":{\"p50\":" + bench_num(bench_hist_quantile(rtt0, rtt1, 0.50)) +
+            ",\"p99\":" + bench_num(bench_hist_quantile(rtt0, rtt1, 0.99)) + "}}";
+
+    bench_empty_dir(dir + "/files");
+    bench_empty_dir(dir + "/" BENCH_RECEIVER "/downloads");
+    return 0;
+}
+
+/* Chunks the relay has shed on its way to the receiver so far */
+static unsigned long long bench_shed_count(void)
+{
+    Peer               peers[8];
+    int                n    = server_get_peers(peers, 8);
+    unsigned long long shed = 0;
+    for (int i = 0; i < n; i++)
+        if (strcmp(peers[i].name, BENCH_RECEIVER) == 0) shed += peers[i].dropped_pkts;
+    return shed;
+}
+
+/* A bulk round through a relay whose receiver queue is far below what the
+ * senders keep in flight, so it sheds chunks the whole way through.  Runs
+ * last: the relay keeps the small limit afterwards. */
+static int bench_shed(BenchConn &a, const std::string &dir, uint64_t size,
+                      const BenchConfig *cfg, std::string &json)
+{
+    unsigned long long shed0 = bench_shed_count();
+    server_set_queue_limit(BENCH_SHED_QUEUE, SLOW_PEER_DROP);
+
+    std::string round;
+    if (bench_bulk(a, dir, size, cfg, round) < 0) return -1;
+    round.pop_back();       /* reopen the object */
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), ",\"queue_max\":%d,\"shed_chunks\":%llu}",
+             BENCH_SHED_QUEUE, bench_shed_count() - shed0);
+    json += round + buf;
+    return 0;
+}
+
+/* Chat from the sender at cfg->chat_rate, timed from the send call to
+ * arrival on every one of the receiver's event streams */
+static void bench_chat(BenchConn &a, const BenchConfig *cfg, std::string &json)
+{
+    pthread_mutex_lock(&bench_lock);
+    bench_chat_lat.clear();
+    pthread_mutex_unlock(&bench_lock);
+
+    int       sent = 0;
+    long long t0   = util_time_us();
+    for (int i = 0; i < cfg->chat_msgs; i++) {
+        if (cfg->chat_rate > 0) {
+            long long wait = t0 + (long long)i * 1000000 / cfg->chat_rate - util_time_us();
+            if (wait > 0) usleep((useconds_t)wait);
+        }
+        char body[128];
+        snprintf(body, sizeof(body), "{\"to\":\"" BENCH_RECEIVER "\",\"text\":\"bench %d %lld\"}",
+                 i, util_time_us());
+        if (bench_call(a, "POST", "/api/chat", body, NULL) == 200) sent++;
+    }
+    long long t1 = util_time_us();
+
+    size_t                 want = (size_t)sent * bench_subs.size();
+    std::vector<long long> lat;
+    do {
+        usleep(2000);
+        pthread_mutex_lock(&bench_lock);
+        lat = bench_chat_lat;
+        pthread_mutex_unlock(&bench_lock);
+    } while (lat.size() < want && util_time_us() < t1 + BENCH_DRAIN_MS * 1000LL);
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"sent\":%d,\"subscribers\":%zu,\"delivered\":%zu,"
+             "\"seconds\":%.3f,\"msgs_per_s\":%.0f,",
+             sent, bench_subs.size(), lat.size(), (t1 - t0) / 1e6,
+             t1 > t0 ? sent / ((t1 - t0) / 1e6) : 0.0);
+    json += buf;
+    json += "\"latency_us\":{\"p50\":" + bench_num(bench_percentile(lat, 0.50)) +
+            ",\"p99\":" + bench_num(bench_percentile(lat, 0.99)) +
+            ",\"max\":" + bench_num(bench_percentile(lat, 1.0)) + "}}";
+}
+
+/* ── Entry ──────────────────────────────────────────────── */
+
+static int bench_workloads(const BenchConfig *cfg, const std::string &dir,
+                           const std::vector<uint64_t> &sizes, BenchConn &a, BenchConn &b,
+                           const pid_t pids[2], std::string &json)
+{
+    if (bench_wait_ready(a, b, pids) < 0) return -1;
+    if (bench_subscribe(b.port, cfg->sse_subs > 0 ? cfg->sse_subs : 1) < 0) return -1;
+    usleep(100 * 1000);     /* let the streams register before anything is sent */
+
+    json += "\"bulk\":[";
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (i) json += ",";
+        util_log(LOG_INFO, "bench: %d x %llu bytes", cfg->parallel, (unsigned long long)sizes[i]);
+        if (bench_bulk(a, dir, sizes[i], cfg, json) < 0) return -1;
+    }
+    json += "],\"chat\":";
+    util_log(LOG_INFO, "bench: %d chat messages", cfg->chat_msgs);
+    bench_chat(a, cfg, json);
+
+    if (cfg->direct) return 0;
+    uint64_t size = *std::max_element(sizes.begin(), sizes.end());
+    json += ",\"shed\":";
+    util_log(LOG_INFO, "bench: %d x %llu bytes through a %d byte relay queue",
+             cfg->parallel, (unsigned long long)size, BENCH_SHED_QUEUE);
+    return bench_shed(a, dir, size, cfg, json);
+}
+
+int bench_run(const BenchConfig *cfg, int argc, char *argv[])
+{
+    std::vector<uint64_t> sizes;
+    std::string           list = cfg->sizes ? cfg->sizes : BENCH_SIZES;
+    for (size_t p = 0; p <= list.size(); ) {
+        size_t   e = list.find(',', p);
+        if (e == std::string::npos) e = list.size();
+        uint64_t v = 0;
+        if (rate_parse(list.substr(p, e - p).c_str(), &v) < 0 || v == 0) {
+            util_log(LOG_ERROR, "bench: bad size list \"%s\"", list.c_str());
+            return 1;
+        }
+        sizes.push_back(v);
+        p = e + 1;
+    }
+    if (cfg->parallel < 1) {
+        util_log(LOG_ERROR, "bench: --bench-parallel must be at least 1");
+        return 1;
+    }
+
+    char self[PATH_MAX];
+#ifdef __linux__
+    snprintf(self, sizeof(self), "/proc/self/exe");
+#else
+    if (!realpath(argv[0], self)) snprintf(self, sizeof(self), "%s", argv[0]);
+#endif
+    char tmpl[] = "/tmp/meshwave-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        util_log(LOG_ERROR, "bench: mkdtemp: %s", strerror(errno));
+        return 1;
+    }
+    std::string dir = tmpl;
+    mkdir((dir + "/files").c_str(), 0755);
+
+    server_set_history((dir + "/" MSGSTORE_FILE).c_str());
+    server_start("bench");
+
+    std::vector<std::string> fwd = bench_client_flags(argc, argv);
+    BenchConn a, b;
+    a.port = cfg->http_port + 1;
+    b.port = cfg->http_port + 2;
+    pid_t pids[2] = {
+        bench_spawn(self, dir + "/" BENCH_SENDER,   BENCH_SENDER,   a.port, fwd),
+        bench_spawn(self, dir + "/" BENCH_RECEIVER, BENCH_RECEIVER, b.port, fwd),
+    };
+
+    std::string args;
+    for (const auto &f : fwd) args += (args.empty() ? "" : " ") + f;
+    std::string json = "{\"config\":{\"sizes\":[";
+    for (size_t i = 0; i < sizes.size(); i++)
+        json += (i ? "," : "") + std::to_string(sizes[i]);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "],\"parallel\":%d,\"direct\":%s,\"chat_messages\":%d,"
+             "\"chat_rate\":%d,\"sse_subscribers\":%d,\"client_args\":",
+             cfg->parallel, cfg->direct ? "true" : "false", cfg->chat_msgs,
+             cfg->chat_rate, cfg->sse_subs > 0 ? cfg->sse_subs : 1);
+    json += buf;
+    json += "\"" + args + "\"},";
+
+    int rc = pids[0] > 0 && pids[1] > 0
+        ? bench_workloads(cfg, dir, sizes, a, b, pids, json) : -1;
+    json += "}\n";
+
+    if (bench_reading) {
+        bench_reading = 0;
+        pthread_join(bench_reader, NULL);
+    }
+    for (auto &s : bench_subs) close(s.fd);
+    bench_subs.clear();
+    if (a.fd >= 0) close(a.fd);
+    if (b.fd >= 0) close(b.fd);
+    for (pid_t pid : pids) {
+        if (pid <= 0) continue;
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    server_stop();
+
+    if (rc < 0) {
+        util_log(LOG_ERROR, "bench: failed; client logs kept under %s", dir.c_str());
+        return 1;
+    }
+    nftw(dir.c_str(), bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+
+    FILE *f = cfg->out ? fopen(cfg->out, "w") : stdout;
+    if (!f) {
+        util_log(LOG_ERROR, "bench: cannot write %s: %s", cfg->out, strerror(errno));
+        return 1;
+    }
+    fputs(json.c_str(), f);
+    if (f != stdout) fclose(f);
+    return 0;
+}
@@ -0,0 +1,42 @@
+/* bench.h
+ * --bench: run the relay in this process and two loopback clients beside
+ * it, push a fixed workload through them and report throughput and
+ * latency as JSON, so builds can be compared run against run.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#define BENCH_SIZES      "1M,64M"   /* file sizes sent, one round each */
+#define BENCH_PARALLEL   4          /* transfers started together per round */
+#define BENCH_CHAT_MSGS  1000
+#define BENCH_CHAT_RATE  500        /* messages per second, 0: unpaced */
+#define BENCH_SSE_SUBS   4          /* event streams open on the receiver */
+#define BENCH_READY_MS   10000      /* clients have this long to connect */
+#define BENCH_DRAIN_MS   5000       /* chat still arriving after the last send */
+#define BENCH_SHED_QUEUE (2 * 1024 * 1024)  /* relay queue limit for the shed round */
+
+typedef struct {
+    const char *sizes;      /* comma list, K/M/G suffixes as for --limit */
+    int         parallel;
+    int         direct;     /* send peer to peer instead of through the relay */
+    int         chat_msgs;
+    int         chat_rate;
+    int         sse_subs;
+    const char *out;        /* JSON report path, NULL: stdout */
+    int         http_port;  /* the clients listen on the two ports above it */
+} BenchConfig;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Transfer options in argv are passed on to the clients.  Returns the
+ * process exit code. */
+int bench_run(const BenchConfig *cfg, int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H */
@@ -0,0 +1,122 @@
+/* bufpool.c
+ * One free list per size class under its own lock.  The two small classes
+ * grow a slab of POOL_SLAB_COUNT buffers at a time and keep every buffer
+ * they ever made; the chunk classes malloc one buffer at a time and free
+ * it again past their idle limit, which bounds what the pool holds.
+ */
+
+#include "bufpool.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct {
+    uint32_t        cap;
+    int             idle_max;   /* 0: slab class, never freed */
+    pthread_mutex_t lock;
+    PoolBuf        *free;
+    int             idle;
+} PoolClass;
+
+static PoolClass pool_classes[POOL_CLASSES] = {
+    { POOL_SMALL, 0,  PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { POOL_MSG,   0,  PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { POOL_CHUNK, 64, PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { POOL_BULK,  16, PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { POOL_MAX,   4,  PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+};
+
+/* Slab entries keep the header's pointer alignment */
+#define POOL_STRIDE(cap) (sizeof(PoolBuf) + (((size_t)(cap) + 7) & ~(size_t)7))
+
+static PoolBuf *pool_new(uint32_t cap, int cls)
+{
+    PoolBuf *b = (PoolBuf *)malloc(sizeof(PoolBuf) + cap);
+    if (!b) return NULL;
+    b->cap = cap;
+    b->cls = cls;
+    metrics_add(MET_POOL_ALLOCATED, 1);
+    return b;
+}
+
+/* Called with the class lock held and its free list empty */
+static void pool_grow_slab(PoolClass *pc, int cls)
+{
+    char *slab = (char *)malloc(POOL_STRIDE(pc->cap) * POOL_SLAB_COUNT);
+    if (!slab) return;
+    for (int i = 0; i < POOL_SLAB_COUNT; i++) {
+        PoolBuf *b = (PoolBuf *)(slab + (size_t)i * POOL_STRIDE(pc->cap));
+        b->cap  = pc->cap;
+        b->cls  = cls;
+        b->next = pc->free;
+        pc->free = b;
+    }
+    pc->idle += POOL_SLAB_COUNT;
+    metrics_add(MET_POOL_ALLOCATED, POOL_SLAB_COUNT);
+}
+
+PoolBuf *pool_get(uint32_t cap)
+{
+    int cls = 0;
+    while (cls < POOL_CLASSES && pool_classes[cls].cap < cap) cls++;
+
+    PoolBuf *b = NULL;
+    if (cls == POOL_CLASSES) {
+        b = pool_new(cap, -1);
+    } else {
+        PoolClass *pc = &pool_classes[cls];
+        pthread_mutex_lock(&pc->lock);
+        if (!pc->free && pc->idle_max == 0)
+            pool_grow_slab(pc, cls);
+        if ((b = pc->free) != NULL) {
+            pc->free = b->next;
+            pc->idle--;
+        }
+        pthread_mutex_unlock(&pc->lock);
+        if (b) metrics_add(MET_POOL_REUSED, 1);
+        else   b = pool_new(pc->cap, cls);
+    }
+    if (!b) return NULL;
+
+    b->refs = 1;
+    b->len  = 0;
+    b->next = NULL;
+    return b;
+}
+
+void pool_ref(PoolBuf *b)
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void pool_put(PoolBuf *b)
+{
+    if (!b || __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (b->cls < 0) {
+        free(b);
+        return;
+    }
+
+    PoolClass *pc = &pool_classes[b->cls];
+    pthread_mutex_lock(&pc->lock);
+    if (pc->idle_max == 0 || pc->idle < pc->idle_max) {
+        b->next  = pc->free;
+        pc->free = b;
+        pc->idle++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&pc->lock);
+    free(b);
+}
+
+void *pool_alloc(uint32_t cap)
+{
+    PoolBuf *b = pool_get(cap);
+    return b ? b->data : NULL;
+}
+
+void pool_free(void *data)
+{
+    if (data) pool_put((PoolBuf *)((char *)data - offsetof(PoolBuf, data)));
+}
@@ -0,0 +1,53 @@
+/* bufpool.h
+ * Refcounted packet and chunk buffers in fixed size classes, shared by the
+ * server, client and transfer engine.  A released buffer goes back on its
+ * class's free list, so the steady-state hot paths never reach malloc.
+ * The small classes are carved from slabs.  Buffers may change threads.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Class capacities: control packets, chat, then the three chunk sizes
+ * with room for a header and CRC */
+#define POOL_SMALL       256
+#define POOL_MSG         (MAX_MSG + 512)
+#define POOL_CHUNK       (CHUNK_SIZE + 256)
+#define POOL_BULK        (CHUNK_SIZE_BULK + 256)
+#define POOL_MAX         (MAX_PAYLOAD + 64)
+#define POOL_CLASSES     5
+#define POOL_SLAB_COUNT  64     /* small-class buffers per slab */
+
+typedef struct PoolBuf {
+    int             refs;
+    uint32_t        len;        /* bytes filled, for the caller's use */
+    uint32_t        cap;        /* bytes usable in data[] */
+    int             cls;        /* size class, -1 for an oversized one-off */
+    struct PoolBuf *next;       /* free list link while idle */
+    char            data[];
+} PoolBuf;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A buffer of at least `cap` bytes with refs 1 and len 0, or NULL */
+PoolBuf *pool_get(uint32_t cap);
+void     pool_ref(PoolBuf *b);
+void     pool_put(PoolBuf *b);      /* NULL is ignored */
+
+/* malloc/free shaped wrappers for scratch buffers that are only ever held
+ * by one owner: pool_alloc returns data[], pool_free takes it back */
+void    *pool_alloc(uint32_t cap);
+void     pool_free(void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUFPOOL_H */
@@ -1,178 +1,654 @@
 /* client.c
  * TCP client: connect to chosen server, send chat and files, receive events.
- * Incoming packets are pushed to a ring buffer that the HTTP layer drains.
+ * Incoming packets become events in a lock-free queue the HTTP layer drains.
  */
 
 #include "client.h"
+#include "discovery.h"
 #include "transfer.h"
+#include "compress.h"
+#include "evqueue.h"
+#include "bufpool.h"
+#include "wire.h"
+#include "metrics.h"
 #include "util.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <fcntl.h>
 #include <errno.h>
 
 static int            sock_fd     = -1;
 static volatile int   connected   = 0;
 static pthread_t      recv_thread;
 static char           username[MAX_NAME];
+static int            proto_version = PROTO_V1;
+
+/* Every META ACK says what this receiver can take */
+#define META_ACK_FLAGS (PKT_FLAG_META | PKT_FLAG_CRC | PKT_FLAG_CDC | \
+                        (comp_available() ? PKT_FLAG_DEFLATE : 0))
+
+/* ── Event queue ───────────────────────────────────────── */
+
+/* One queued event: the fixed fields, then "from\0text\0room\0" */
+typedef struct {
+    uint8_t  type;
+    uint8_t  state;
+    uint16_t from_len;     /* with the NULs */
+    uint32_t text_len;
+    uint16_t room_len;
+    int16_t  slot;         /* progress slot it claimed, -1 for none */
+    int32_t  xfer_id;
+    uint32_t done;
+    uint32_t total;
+    int64_t  timestamp;
+    uint64_t bytes_per_sec;
+    int64_t  eta_s;
+    int64_t  queued_us;
+    char     strs[];
+} EventRec;
+
+/* Where a transfer's progress waits to be merged, one word so it changes
+ * atomically: the transfer's id, its latest count, and whether a progress
+ * record that claimed the slot is still in the queue.  Transfers probe for
+ * a slot from a home picked by id, so concurrent ones don't share. */
+#define SLOT_QUEUED 0x80000000u
+#define SLOT_COUNT  0x7fffffffu
+
+typedef struct {
+    _Atomic uint64_t word;     /* xfer_id << 32 | SLOT_QUEUED | done */
+} ProgressSlot;
+
+static EvQueue       *events;
+static pthread_once_t events_once = PTHREAD_ONCE_INIT;
+static ProgressSlot   progress[EVENT_COALESCE];
+static atomic_int     events_dropped;
+static int            ev_held = 0;     /* consumer: record handed out, not yet popped */
+
+static uint64_t slot_word(int xfer_id, uint32_t done, uint32_t queued)
+{
+    return (uint64_t)(uint32_t)xfer_id << 32 | queued | (done & SLOT_COUNT);
+}
+
+/* Fold done into the queued record for xfer_id, returning -1, or claim a
+ * free slot for a new record and return its index.  If every slot is
+ * waiting on another transfer the record goes out unmerged (-2). */
+static int progress_merge(int xfer_id, uint32_t done)
+{
+    unsigned home = (uint32_t)xfer_id * 2654435761u % EVENT_COALESCE;
+    for (int claim = 0; claim < 2; claim++) {
+        for (int n = 0; n < EVENT_COALESCE; n++) {
+            ProgressSlot *s = &progress[(home + n) % EVENT_COALESCE];
+            uint64_t cur = atomic_load(&s->word);
+            int      own = (uint32_t)(cur >> 32) == (uint32_t)xfer_id;
+            if (cur & SLOT_QUEUED) {
+                if (!own) continue;
+                if (atomic_compare_exchange_strong(&s->word, &cur, slot_word(xfer_id, done, SLOT_QUEUED)))
+                    return -1;
+                n--;    /* the consumer took it meanwhile: look again */
+                continue;
+            }
+            /* First pass only looks for our own record; the second claims */
+            if (claim &&
+                atomic_compare_exchange_strong(&s->word, &cur, slot_word(xfer_id, done, SLOT_QUEUED)))
+                return (int)((home + n) % EVENT_COALESCE);
+        }
+    }
+    return -2;
+}
+
+/* Free a slot the record for xfer_id claimed, reading the count merged
+ * into it.  Returns 0 if a state change already detached it. */
+static int progress_release(int slot, int xfer_id, uint32_t *done)
+{
+    ProgressSlot *s = &progress[slot];
+    uint64_t cur = atomic_load(&s->word);
+    do {
+        if (!(cur & SLOT_QUEUED) || (uint32_t)(cur >> 32) != (uint32_t)xfer_id) return 0;
+    } while (!atomic_compare_exchange_weak(&s->word, &cur, cur & ~(uint64_t)SLOT_QUEUED));
+    if (done) *done = (uint32_t)(cur & SLOT_COUNT);
+    return 1;
+}
+
+/* A state change goes out as its own record; later progress must queue
+ * behind it rather than merge into a record ahead of it. */
+static void progress_detach(int xfer_id)
+{
+    for (int i = 0; i < EVENT_COALESCE; i++) {
+        uint64_t cur = atomic_load(&progress[i].word);
+        while ((cur & SLOT_QUEUED) && (uint32_t)(cur >> 32) == (uint32_t)xfer_id &&
+               !atomic_compare_exchange_weak(&progress[i].word, &cur, cur & ~(uint64_t)SLOT_QUEUED))
+            ;
+    }
+}
 
-static ChatEvent      event_queue[EVENT_QUEUE_SIZE];
-static int            eq_head = 0;
-static int            eq_tail = 0;
-static pthread_mutex_t eq_lock = PTHREAD_MUTEX_INITIALIZER;
+static void events_init(void)
+{
+    events = evq_create(EVENT_QUEUE_BYTES);
+    if (!events) util_log(LOG_ERROR, "client: cannot allocate the event queue");
+}
 
-static void event_push(const ChatEvent *ev)
+static EvQueue *event_queue(void)
 {
-    pthread_mutex_lock(&eq_lock);
-    event_queue[eq_head] = *ev;
-    eq_head = (eq_head + 1) % EVENT_QUEUE_SIZE;
-    if (eq_head == eq_tail)
-        eq_tail = (eq_tail + 1) % EVENT_QUEUE_SIZE;
-    pthread_mutex_unlock(&eq_lock);
+    pthread_once(&events_once, events_init);
+    return events;
+}
+
+/* Progress may use half the ring; chat and final states get the rest.
+ * sent_ms: the time the event happened, 0 for now. */
+static void event_push(EventType type, const char *from, const char *text, const char *room,
+                       int64_t sent_ms, int xfer_id, uint32_t done, uint32_t total, XferState state,
+                       uint64_t bytes_per_sec, int64_t eta_s)
+{
+    EvQueue *q = event_queue();
+    if (!q) return;
+
+    /* Only plain progress merges; PAUSED and resumed reports always get
+     * a record of their own. */
+    int slot = -1;
+    if (type == EVT_FILE_PROGRESS) {
+        if (state == XFER_ACTIVE) {
+            slot = progress_merge(xfer_id, done);
+            if (slot == -1) return;     /* the queued record will pick up this count */
+            if (slot == -2) slot = -1;
+        } else {
+            progress_detach(xfer_id);
+        }
+    }
+
+    size_t   from_len = strlen(from) + 1;
+    size_t   text_len = strlen(text) + 1;
+    if (from_len > MAX_NAME) from_len = MAX_NAME;
+    size_t   room_len = strlen(room) + 1;
+    if (text_len > MAX_MSG)  text_len = MAX_MSG;
+    if (room_len > MAX_NAME) room_len = MAX_NAME;
+    uint32_t len  = (uint32_t)(sizeof(EventRec) + from_len + text_len + room_len);
+    uint32_t fill = type == EVT_FILE_PROGRESS ? evq_capacity(q) / 2 : evq_capacity(q);
+
+    EventRec *r = (EventRec *)evq_reserve(q, len, fill);
+    if (!r) {
+        if (slot >= 0) progress_release(slot, xfer_id, NULL);
+        metrics_add(MET_EVENTS_DROPPED, 1);
+        if (atomic_fetch_add(&events_dropped, 1) % 1000 == 0)
+            util_log(LOG_WARN, "client: event queue full, dropping events");
+        return;
+    }
+    r->type      = (uint8_t)type;
+    r->state     = (uint8_t)state;
+    r->from_len  = (uint16_t)from_len;
+    r->text_len  = (uint32_t)text_len;
+    r->room_len  = (uint16_t)room_len;
+    r->slot      = (int16_t)slot;
+    r->xfer_id   = xfer_id;
+    r->done      = done;
+    r->total     = total;
+    r->timestamp = sent_ms ? sent_ms : util_time_ms();
+    r->bytes_per_sec = bytes_per_sec;
+    r->eta_s     = eta_s;
+    r->queued_us = util_time_us();
+    memcpy(r->strs, from, from_len - 1);
+    r->strs[from_len - 1] = '\0';
+    memcpy(r->strs + from_len, text, text_len - 1);
+    r->strs[from_len + text_len - 1] = '\0';
+    memcpy(r->strs + from_len + text_len, room, room_len - 1);
+    r->strs[from_len + text_len + room_len - 1] = '\0';
+    evq_commit(q, r);
+}
+
+void client_on_transfer(const XferProgress *p)
+{
+    EventType type = p->state == XFER_DONE  ? EVT_FILE_COMPLETE
+                   : p->state == XFER_ERROR ? EVT_FILE_ERROR
+                   :                          EVT_FILE_PROGRESS;
+    event_push(type, p->peer, p->filename, "", 0, p->xfer_id, p->done_chunks, p->total_chunks,
+               p->state, p->bytes_per_sec, p->eta_s);
 }
 
 int client_poll_event(ChatEvent *out)
 {
-    int got = 0;
-    pthread_mutex_lock(&eq_lock);
-    if (eq_tail != eq_head) {
-        *out = event_queue[eq_tail];
-        eq_tail = (eq_tail + 1) % EVENT_QUEUE_SIZE;
-        got = 1;
+    EvQueue *q = event_queue();
+    if (!q) return 0;
+    if (ev_held) {
+        evq_pop(q);
+        ev_held = 0;
+    }
+
+    uint32_t len;
+    const EventRec *r = (const EventRec *)evq_peek(q, &len);
+    if (!r) return 0;
+    ev_held = 1;
+
+    memset(out, 0, sizeof(*out));
+    out->type         = (EventType)r->type;
+    out->from         = r->strs;
+    out->text         = r->strs + r->from_len;
+    out->room         = r->strs + r->from_len + r->text_len;
+    out->timestamp    = (long)r->timestamp;
+    out->xfer_id      = r->xfer_id;
+    out->done_chunks  = r->done;
+    out->total_chunks = r->total;
+    out->xfer_state   = (XferState)r->state;
+    out->bytes_per_sec = r->bytes_per_sec;
+    out->eta_s        = r->eta_s;
+    out->queued_us    = r->queued_us;
+
+    /* Take the newest count; later progress queues a record of its own */
+    if (r->slot >= 0) {
+        uint32_t latest;
+        if (progress_release(r->slot, r->xfer_id, &latest) && latest > out->done_chunks)
+            out->done_chunks = latest;
     }
-    pthread_mutex_unlock(&eq_lock);
-    return got;
+    return 1;
 }
 
-static int send_all(int fd, const void *buf, int len)
+int client_wait_event(int timeout_ms)
 {
-    const char *p = (const char *)buf;
-    while (len > 0) {
-        ssize_t n = send(fd, p, len, 0);
-        if (n <= 0) return -1;
-        p   += n;
-        len -= (int)n;
+    EvQueue *q = event_queue();
+    if (!q) return 0;
+    if (ev_held) {
+        evq_pop(q);
+        ev_held = 0;
     }
-    return 0;
+    return evq_wait(q, timeout_ms);
+}
+
+int client_event_fd(void)
+{
+    EvQueue *q = event_queue();
+    return q ? evq_fd(q) : -1;
+}
+
+/* Header and payload go out in one locked write so packets from the
+ * recv thread (ACKs) and sender threads (chunks) never interleave. */
+static int send_packet_on(int fd, int version, uint8_t type, uint32_t stream_id,
+                          uint32_t seq, uint16_t flags, const void *payload, int len)
+{
+    PktHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type      = type;
+    hdr.flags     = flags;
+    hdr.stream_id = stream_id;
+    hdr.seq       = seq;
+    return wire_send(fd, version, &hdr, payload, (uint32_t)len);
+}
+
+static int send_packet(uint8_t type, uint32_t stream_id, uint32_t seq,
+                       uint16_t flags, const void *payload, int len)
+{
+    return send_packet_on(sock_fd, proto_version, type, stream_id, seq, flags, payload, len);
+}
+
+/* Store a chunk and answer it on the connection it came in on.  Returns
+ * the transfer's state afterwards. */
+static XferState handle_chunk(int fd, const PktHeader *hdr, const char *payload)
+{
+    int rc = transfer_recv_chunk((int)hdr->stream_id, hdr->seq, hdr->flags,
+                                 (const uint8_t *)payload, (int)hdr->payload_len);
+
+    send_packet_on(fd, PROTO_V2, rc == 0 ? MSG_FILE_ACK : MSG_FILE_NACK,
+                   hdr->stream_id, hdr->seq, 0, NULL, 0);
+
+    Transfer *t = transfer_find((int)hdr->stream_id);
+    return t ? t->state : XFER_ERROR;
+}
+
+/* ── Direct transfers ──────────────────────────────────── */
+
+typedef struct {
+    uint32_t xfer_id;
+    int      streams;      /* connections the sender will accept */
+    struct sockaddr_in addr;
+} DirectDial;
+
+static int dial_with_timeout(const struct sockaddr_in *addr, int timeout_ms)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int fl = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+
+    int rc = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    if (rc < 0 && errno == EINPROGRESS) {
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        FD_SET(fd, &wfds);
+        struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (select(fd + 1, NULL, &wfds, NULL, &tv) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) == 0 && err == 0)
+            rc = 0;
+    }
+    if (rc < 0) { close(fd); return -1; }
+
+    fcntl(fd, F_SETFL, fl);
+    return fd;
+}
+
+/* Read one direct connection's chunks until the transfer settles or the
+ * sender hangs up */
+static void direct_read(int fd, uint32_t id)
+{
+    char *payload = (char *)pool_alloc(MAX_PAYLOAD);
+    PktHeader hdr;
+    int rc;
+    while (payload && (rc = wire_recv_header(fd, PROTO_V2, &hdr)) != WIRE_ERR_BAD) {
+        if (rc == WIRE_ERR_SIZE) {
+            if (wire_skip(fd, hdr.payload_len) < 0) break;
+            continue;
+        }
+        if (hdr.payload_len > 0 &&
+            recv(fd, payload, hdr.payload_len, MSG_WAITALL) != (ssize_t)hdr.payload_len)
+            break;
+        if (hdr.type != MSG_FILE_CHUNK || hdr.stream_id != id) continue;
+
+        XferState st = handle_chunk(fd, &hdr, payload);
+        if (st == XFER_DONE || st == XFER_ERROR) break;
+    }
+    pool_free(payload);
+}
+
+typedef struct {
+    int      fd;
+    uint32_t xfer_id;
+} DirectStream;
+
+static void *direct_stream_thread(void *arg)
+{
+    DirectStream *s = (DirectStream *)arg;
+    direct_read(s->fd, s->xfer_id);
+    return NULL;
+}
+
+/* Dial the sender's listener once per offered stream, naming each
+ * connection with a META ACK whose seq is its index.  On success the
+ * transfer's chunks arrive on those sockets and the relay only learns that
+ * we went direct (and over how many); on failure we accept the META over
+ * the relay and the chunks follow that way. */
+static void *direct_recv_thread(void *arg)
+{
+    DirectDial  *d  = (DirectDial *)arg;
+    uint32_t     id = d->xfer_id;
+    DirectStream streams[XFER_STREAMS_MAX];
+    pthread_t    tids[XFER_STREAMS_MAX];
+    int          n = 0;
+
+    while (n < d->streams) {
+        int fd = dial_with_timeout(&d->addr, XFER_DIRECT_CONNECT_MS);
+        if (fd < 0) break;
+        if (send_packet_on(fd, PROTO_V2, MSG_FILE_ACK, id, (uint32_t)n,
+                           PKT_FLAG_META, NULL, 0) < 0) {
+            close(fd);
+            break;
+        }
+        streams[n].fd      = fd;
+        streams[n].xfer_id = id;
+        n++;
+    }
+
+    if (n == 0) {
+        util_log(LOG_INFO, "client: direct connection for transfer %u failed, using relay", id);
+        send_packet(MSG_FILE_ACK, id, 0, META_ACK_FLAGS, NULL, 0);
+        free(d);
+        return NULL;
+    }
+
+    send_packet(MSG_FILE_ACK, id, (uint32_t)n, META_ACK_FLAGS | PKT_FLAG_DIRECT, NULL, 0);
+    Transfer *t = transfer_find((int)id);
+    if (t) {
+        t->direct  = 1;
+        t->streams = (uint8_t)n;
+    }
+    util_log(LOG_INFO, "client: receiving transfer %u directly over %d stream%s",
+             id, n, n == 1 ? "" : "s");
+
+    int spawned = 1;
+    for (; spawned < n; spawned++)
+        if (pthread_create(&tids[spawned], NULL, direct_stream_thread, &streams[spawned]) != 0)
+            break;
+    direct_read(streams[0].fd, id);
+
+    /* A stream that failed to start leaves its chunks unACKed; the sender
+     * retries them into silence and gives up, which closes the others */
+    for (int i = spawned; i < n; i++)
+        shutdown(streams[i].fd, SHUT_RDWR);
+    for (int i = 1; i < spawned; i++)
+        pthread_join(tids[i], NULL);
+    for (int i = 0; i < n; i++)
+        close(streams[i].fd);
+    free(d);
+    return NULL;
+}
+
+/* ── Answering META ────────────────────────────────────── */
+
+typedef struct MetaAnswer {
+    uint32_t   xfer_id;
+    int        ok;         /* transfer_recv_meta accepted it */
+    int        direct;     /* the sender offered a listener, in dial */
+    DirectDial dial;
+    struct MetaAnswer *next;
+} MetaAnswer;
+
+/* Deduplicated METAs waiting for their manifest (recv thread only) */
+static MetaAnswer *pending_meta = NULL;
+
+/* The resume bitmap goes first, so the sender never sends those chunks;
+ * then the direct dial, whose thread sends the reply once it knows the
+ * path, or a plain ACK/NACK over the relay.  Frees a. */
+static void meta_answer(MetaAnswer *a)
+{
+    Transfer *t = a->ok ? transfer_find((int)a->xfer_id) : NULL;
+    if (t && t->done_chunks > 0)
+        send_packet(MSG_FILE_HAVE, a->xfer_id, 0, 0,
+                    t->chunk_map, (int)((t->total_chunks + 7) / 8));
+
+    DirectDial *d = NULL;
+    if (a->ok && a->direct && (d = (DirectDial *)malloc(sizeof(DirectDial))) != NULL) {
+        *d = a->dial;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, direct_recv_thread, d) == 0) {
+            pthread_detach(tid);
+        } else {
+            free(d);
+            d = NULL;
+        }
+    }
+    if (!d)
+        send_packet(a->ok ? MSG_FILE_ACK : MSG_FILE_NACK, a->xfer_id, 0, META_ACK_FLAGS, NULL, 0);
+    free(a);
+}
+
+/* Copying known chunks can take a while for a big file; keep it off the
+ * recv thread */
+static void *dedup_answer_thread(void *arg)
+{
+    MetaAnswer *a = (MetaAnswer *)arg;
+    if (a->ok) transfer_dedup((int)a->xfer_id);
+    meta_answer(a);
+    return NULL;
+}
+
+static void manifest_in(const PktHeader *hdr, const char *payload)
+{
+    int r = transfer_recv_manifest((int)hdr->stream_id, hdr->seq,
+                                   (const uint8_t *)payload, hdr->payload_len);
+    if (r == 0) return;
+
+    MetaAnswer **pp = &pending_meta;
+    while (*pp && (*pp)->xfer_id != hdr->stream_id) pp = &(*pp)->next;
+    MetaAnswer *a = *pp;
+    if (!a) return;
+    *pp = a->next;
+
+    a->ok = r == 1;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dedup_answer_thread, a) == 0)
+        pthread_detach(tid);
+    else
+        meta_answer(a);
 }
 
 static void *recv_loop(void *arg)
 {
     (void)arg;
 
+    char *payload = (char *)pool_alloc(MAX_PAYLOAD);
+    if (!payload) { connected = 0; return NULL; }
+
     while (connected) {
         PktHeader hdr;
-        ssize_t n = recv(sock_fd, &hdr, sizeof(hdr), MSG_WAITALL);
-        if (n <= 0) {
+        int rc = wire_recv_header(sock_fd, proto_version, &hdr);
+        if (rc == WIRE_ERR_SIZE && wire_skip(sock_fd, hdr.payload_len) == 0) {
+            util_log(LOG_WARN, "client: skipped a %u-byte packet", hdr.payload_len);
+            continue;
+        }
+        if (rc < 0) {
             util_log(LOG_WARN, "client: server disconnected");
             connected = 0;
             break;
         }
 
-        char payload[CHUNK_SIZE + 256];
-        int max_payload = (int)sizeof(payload);
-        if (hdr.payload_len > 0 && hdr.payload_len <= max_payload) {
-            n = recv(sock_fd, payload, hdr.payload_len, MSG_WAITALL);
-            if (n <= 0) { connected = 0; break; }
-        } else if (hdr.payload_len > 0) {
-            continue;
-        } else {
-            continue;
+        if (hdr.payload_len > 0) {
+            ssize_t n = recv(sock_fd, payload, hdr.payload_len, MSG_WAITALL);
+            if (n != (ssize_t)hdr.payload_len) { connected = 0; break; }
         }
 
-        if (hdr.type == MSG_CHAT) {
-            const char *sep = memchr(payload, '\0', hdr.payload_len);
-            if (!sep) continue;
-
-            ChatEvent ev;
-            memset(&ev, 0, sizeof(ev));
-            ev.type = EVT_CHAT;
-            snprintf(ev.from, MAX_NAME, "%s", payload);
-            int msg_len = hdr.payload_len - (int)(sep - payload) - 1;
-            if (msg_len > 0 && msg_len < MAX_MSG)
-                memcpy(ev.text, sep + 1, msg_len);
-            ev.timestamp = util_time_ms();
-
-            event_push(&ev);
-            util_log(LOG_INFO, "client: chat from \"%s\": %s", ev.from, ev.text);
+        if (hdr.type == MSG_FILE_ACK || hdr.type == MSG_FILE_NACK) {
+            int ok = hdr.type == MSG_FILE_ACK;
+            if (hdr.flags & PKT_FLAG_META)
+                transfer_on_meta_reply((int)hdr.stream_id, ok, hdr.flags, (int)hdr.seq);
+            else
+                transfer_on_ack((int)hdr.stream_id, hdr.seq,
+                                ok ? 1 : (hdr.flags & PKT_FLAG_SHED) ? -1 : 0);
+            continue;
         }
-        else if (hdr.type == MSG_FILE_META) {
-            /* payload: "recipient\0filename\0total_chunks(4B)file_size(8B)" */
-            const char *sep1 = memchr(payload, '\0', hdr.payload_len);
-            if (!sep1) continue;
+        if (hdr.payload_len == 0)
+            continue;
 
-            const char *filename = sep1 + 1;
-            const char *sep2 = memchr(filename, '\0', hdr.payload_len - (int)(filename - payload));
-            if (!sep2) continue;
+        if (hdr.type == MSG_FILE_HAVE) {
+            transfer_on_have((int)hdr.stream_id, (const uint8_t *)payload, hdr.payload_len);
+            continue;
+        }
 
-            const char *bin = sep2 + 1;
-            uint32_t total_chunks = ntohl(*(uint32_t *)bin);
-            bin += 4;
+        if (hdr.type == MSG_CHAT) {
+            const char *name, *msg;
+            uint32_t    msg_len;
+            if (wire_parse_chat(&hdr, (const uint8_t *)payload, &name, &msg, &msg_len) < 0)
+                continue;
+
+            /* Room chat: "room\0sender\0message" */
+            char room[MAX_NAME] = "";
+            if (hdr.flags & PKT_FLAG_ROOM) {
+                const char *z = (const char *)memchr(msg, '\0', msg_len);
+                if (!z) continue;
+                snprintf(room, sizeof(room), "%s", name);
+                name     = msg;
+                msg_len -= (uint32_t)(z + 1 - msg);
+                msg      = z + 1;
+            }
 
-            uint64_t file_size = 0;
-            for (int i = 0; i < 8; i++)
-                file_size = (file_size << 8) | (uint8_t)bin[i];
+            char from[MAX_NAME], text[MAX_MSG];
+            snprintf(from, sizeof(from), "%s", name);
+            text[0] = '\0';
+            if (msg_len > 0 && msg_len < MAX_MSG) {
+                memcpy(text, msg, msg_len);
+                text[msg_len] = '\0';
+            }
 
-            int xfer_id = transfer_next_id();
-            transfer_recv_meta(xfer_id, "sender", filename, total_chunks, file_size, "./downloads");
+            /* Kept by the server while we were away: seq is when it was sent */
+            int64_t sent = (hdr.flags & PKT_FLAG_STORED) ? (int64_t)hdr.seq * 1000 : 0;
+            event_push(EVT_CHAT, from, text, room, sent, 0, 0, 0, XFER_IDLE, 0, 0);
+            util_log(LOG_INFO, "client: chat from \"%s\"%s%s: %s", from,
+                     room[0] ? " in " : "", room, text);
+        }
+        else if (hdr.type == MSG_FILE_META) {
+            WireMeta m;
+            if (wire_parse_meta(&hdr, (const uint8_t *)payload, &m) < 0) continue;
+
+            /* The sender's stream ID becomes our transfer ID */
+            int xfer_id = (int)hdr.stream_id;
+            int cdc     = (hdr.flags & PKT_FLAG_CDC) != 0;
+            rc = transfer_recv_meta(xfer_id, "sender", m.filename, m.total_chunks,
+                                    m.file_size, m.chunk_size, m.digest, cdc, "./downloads");
+
+            MetaAnswer *a = (MetaAnswer *)calloc(1, sizeof(MetaAnswer));
+            if (!a) {
+                send_packet(MSG_FILE_NACK, hdr.stream_id, 0, META_ACK_FLAGS, NULL, 0);
+                continue;
+            }
+            a->xfer_id = hdr.stream_id;
+            a->ok      = rc == 0;
+            if (rc == 0 && (hdr.flags & PKT_FLAG_DIRECT) && m.direct) {
+                DirectDial *d = &a->dial;
+                a->direct  = 1;
+                d->xfer_id = hdr.stream_id;
+                d->addr.sin_family = AF_INET;
+                memcpy(&d->addr.sin_addr.s_addr, m.direct, 4);
+                memcpy(&d->addr.sin_port, m.direct + 4, 2);
+                d->streams = m.streams < 1 ? 1 :
+                             m.streams < XFER_STREAMS_MAX ? m.streams : XFER_STREAMS_MAX;
+            }
 
-            /* Send ACK for meta */
-            PktHeader ack;
-            ack.type = MSG_FILE_ACK;
-            ack.seq  = 0;
-            ack.payload_len = 0;
-            send_all(sock_fd, &ack, sizeof(ack));
+            /* A deduplicated file is answered once its manifest is in and
+             * the chunks we already hold are copied into place */
+            if (rc == 0 && cdc) {
+                a->next      = pending_meta;
+                pending_meta = a;
+            } else {
+                meta_answer(a);
+            }
 
-            util_log(LOG_INFO, "client: incoming file \"%s\" (%u chunks)", filename, total_chunks);
+            util_log(LOG_INFO, "client: incoming file \"%s\" (%u chunks)", m.filename, m.total_chunks);
+        }
+        else if (hdr.type == MSG_FILE_MANIFEST) {
+            manifest_in(&hdr, payload);
         }
         else if (hdr.type == MSG_FILE_CHUNK) {
-            /* payload: xfer_id(4B) + chunk_data */
-            if (hdr.payload_len < 4) continue;
-
-            uint32_t xfer_id = ntohl(*(uint32_t *)payload);
-            const uint8_t *chunk_data = (const uint8_t *)(payload + 4);
-            int chunk_len = hdr.payload_len - 4;
-
-            int rc = transfer_recv_chunk((int)xfer_id, hdr.seq, chunk_data, chunk_len);
-
-            PktHeader ack;
-            ack.type = (rc == 0) ? MSG_FILE_ACK : MSG_FILE_NACK;
-            ack.seq  = hdr.seq;
-            ack.payload_len = 0;
-            send_all(sock_fd, &ack, sizeof(ack));
-
-            Transfer *t = transfer_find((int)xfer_id);
-            if (t) {
-                ChatEvent ev;
-                memset(&ev, 0, sizeof(ev));
-                ev.xfer_id = t->id;
-                ev.done_chunks = t->done_chunks;
-                ev.total_chunks = t->total_chunks;
-                ev.xfer_state = t->state;
-                snprintf(ev.filename, 256, "%s", t->filename);
-                snprintf(ev.from, MAX_NAME, "%s", t->peer);
-                ev.timestamp = util_time_ms();
-
-                if (t->state == XFER_DONE) {
-                    ev.type = EVT_FILE_COMPLETE;
-                } else if (t->state == XFER_ERROR) {
-                    ev.type = EVT_FILE_ERROR;
-                } else {
-                    ev.type = EVT_FILE_PROGRESS;
-                }
-                event_push(&ev);
-            }
+            handle_chunk(sock_fd, &hdr, payload);
         }
     }
 
+    pool_free(payload);
     return NULL;
 }
 
+/* A v2 server answers our HELLO with "server_name\0" + chosen version.
+ * Servers that predate v2 never answer; we stay on v1 after a timeout. */
+static int negotiate_version(void)
+{
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(sock_fd, &rfds);
+    struct timeval tv = { .tv_sec = 0, .tv_usec = PROTO_HELLO_TIMEOUT_MS * 1000 };
+    if (select(sock_fd + 1, &rfds, NULL, NULL, &tv) <= 0) return PROTO_V1;
+
+    PktHeader hdr;
+    if (wire_recv_header(sock_fd, PROTO_V1, &hdr) < 0) return PROTO_V1;
+
+    char buf[MAX_NAME + 2];
+    if (hdr.type != MSG_HELLO || hdr.payload_len > sizeof(buf)) return PROTO_V1;
+    if (hdr.payload_len > 0 &&
+        recv(sock_fd, buf, hdr.payload_len, MSG_WAITALL) != (ssize_t)hdr.payload_len)
+        return PROTO_V1;
+
+    const char *sep = memchr(buf, '\0', hdr.payload_len);
+    if (!sep || sep + 1 >= buf + hdr.payload_len) return PROTO_V1;
+
+    int v = (uint8_t)sep[1];
+    return v > PROTO_VERSION ? PROTO_VERSION : v < PROTO_V1 ? PROTO_V1 : v;
+}
+
 int client_connect(const char *ip, uint16_t port, const char *user)
 {
     if (connected) return -1;
@@ -197,35 +673,96 @@ int client_connect(const char *ip, uint16_t port, const char *user)
         close(sock_fd); sock_fd = -1;
         return -1;
     }
+    util_set_nodelay(sock_fd);
 
-    PktHeader hdr;
-    hdr.type        = MSG_HELLO;
-    hdr.seq         = 0;
-    hdr.payload_len = (uint16_t)strlen(username);
+    /* HELLO is always v1-framed: "username\0" + highest version we speak */
+    char hello[MAX_NAME + 1];
+    int  name_len = (int)strlen(username);
+    memcpy(hello, username, name_len + 1);
+    hello[name_len + 1] = PROTO_VERSION;
 
-    if (send_all(sock_fd, &hdr, sizeof(hdr)) < 0 ||
-        send_all(sock_fd, username, strlen(username)) < 0) {
+    proto_version = PROTO_V1;
+    if (send_packet(MSG_HELLO, 0, 0, 0, hello, name_len + 2) < 0) {
         util_log(LOG_ERROR, "client: hello send failed");
         close(sock_fd); sock_fd = -1;
         return -1;
     }
+    proto_version = negotiate_version();
 
     connected = 1;
-    util_log(LOG_INFO, "client: connected to %s:%d as \"%s\"", ip, port, username);
+    util_log(LOG_INFO, "client: connected to %s:%d as \"%s\" (protocol v%d)",
+             ip, port, username, proto_version);
 
     pthread_create(&recv_thread, NULL, recv_loop, NULL);
     return 0;
 }
 
+/* Wait for discovery to list servers, then take the least loaded, a relay
+ * moving AUTO_KBPS_PER_PEER counting as one more peer.  Servers within a
+ * peer of the best are told apart by how fast they accept a connection. */
+int client_connect_auto(const char *user)
+{
+    ServerInfo svs[MAX_PEERS];
+    int  n = 0;
+    long start = util_time_ms(), first = 0;
+    for (;;) {
+        n = discovery_get_servers(svs, MAX_PEERS);
+        long now = util_time_ms();
+        if (n > 0 && !first) first = now;
+        if ((first && now - first >= AUTO_GRACE_MS) || now - start >= AUTO_WAIT_MS) break;
+        usleep(10 * 1000);
+    }
+    if (n == 0) {
+        util_log(LOG_ERROR, "client: no server discovered to connect to");
+        return -1;
+    }
+
+    double score[MAX_PEERS], best_score = 1e18;
+    for (int i = 0; i < n; i++) {
+        score[i] = svs[i].load + (double)svs[i].relay_kbps / AUTO_KBPS_PER_PEER;
+        if (svs[i].version < PROTO_V2) score[i] += 1e9;     /* last resort */
+        if (score[i] < best_score) best_score = score[i];
+    }
+
+    int       best = -1;
+    long long best_rtt = 0;
+    for (int i = 0; i < n; i++) {
+        if (score[i] > best_score + 1) continue;
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port   = htons(svs[i].port);
+        if (inet_pton(AF_INET, svs[i].ip, &sa.sin_addr) != 1) continue;
+
+        long long t0 = util_time_us();
+        int fd = dial_with_timeout(&sa, AUTO_RTT_MS);
+        if (fd < 0) continue;
+        long long rtt = util_time_us() - t0;
+        close(fd);
+
+        util_log(LOG_DEBUG, "client: \"%s\" load %u, %u KiB/s, connect %lld us",
+                 svs[i].name, svs[i].load, svs[i].relay_kbps, rtt);
+        if (best < 0 || score[i] < score[best] - 0.5 ||
+            (score[i] <= score[best] + 0.5 && rtt < best_rtt)) {
+            best = i;
+            best_rtt = rtt;
+        }
+    }
+    if (best < 0) {
+        util_log(LOG_ERROR, "client: no discovered server accepted a connection");
+        return -1;
+    }
+
+    util_log(LOG_INFO, "client: picked server \"%s\" (%u peers)", svs[best].name, svs[best].load);
+    return client_connect(svs[best].ip, svs[best].port, user);
+}
+
 void client_disconnect(void)
 {
     if (!connected) return;
 
-    PktHeader hdr;
-    hdr.type        = MSG_BYE;
-    hdr.seq         = 0;
-    hdr.payload_len = 0;
-    send_all(sock_fd, &hdr, sizeof(hdr));
+    send_packet(MSG_BYE, 0, 0, 0, NULL, 0);
 
     connected = 0;
     pthread_join(recv_thread, NULL);
@@ -248,22 +785,34 @@ int client_send_chat(const char *to, const char *text)
     memcpy(payload, to, to_len + 1);
     memcpy(payload + to_len + 1, text, txt_len);
 
-    PktHeader hdr;
-    hdr.type        = MSG_CHAT;
-    hdr.seq         = 0;
-    hdr.payload_len = (uint16_t)total;
-
-    if (send_all(sock_fd, &hdr, sizeof(hdr)) < 0 ||
-        send_all(sock_fd, payload, total) < 0)
+    if (send_packet(MSG_CHAT, 0, 0, 0, payload, total) < 0)
         return -1;
 
     return 0;
 }
 
-int client_send_file(const char *filepath, const char *to)
+int client_join_room(const char *room, int join)
 {
     if (!connected) return -1;
-    return transfer_send_file(sock_fd, filepath, to);
+    if (proto_version < PROTO_V2) {
+        util_log(LOG_WARN, "client: server speaks protocol v1, rooms need v2");
+        return -1;
+    }
+
+    int len = (int)strlen(room);
+    if (len < 2 || len >= MAX_NAME || room[0] != ROOM_PREFIX) return -1;
+    return send_packet(join ? MSG_ROOM_JOIN : MSG_ROOM_LEAVE, 0, 0, 0, room, len) < 0 ? -1 : 0;
+}
+
+int client_send_file(const char *filepath, const char *to, int direct, int streams,
+                     int dedup, int compress)
+{
+    if (!connected) return -1;
+    if (proto_version < PROTO_V2) {
+        util_log(LOG_WARN, "client: server speaks protocol v1, file transfer needs v2");
+        return -1;
+    }
+    return transfer_send_file(sock_fd, filepath, to, direct, streams, dedup, compress);
 }
 
 int client_pause_transfer(int xfer_id)
@@ -6,8 +6,10 @@
 #define CLIENT_H
 
 #include "protocol.h"
+#include "transfer.h"
 
-#define EVENT_QUEUE_SIZE 256
+#define EVENT_QUEUE_BYTES   (256 * 1024)  /* ring of variable-length event records */
+#define EVENT_COALESCE      64            /* slots merging progress per transfer */
 
 typedef enum {
     EVT_CHAT,
@@ -16,17 +18,22 @@ typedef enum {
     EVT_FILE_ERROR
 } EventType;
 
+/* A queued event.  The strings point into the queue and stay valid until
+ * the next client_poll_event. */
 typedef struct {
-    EventType type;
-    char from[MAX_NAME];
-    char text[MAX_MSG];
-    long timestamp;
+    EventType   type;
+    const char *from;       /* chat sender, or the transfer's peer */
+    const char *text;       /* chat text, or the transfer's file name */
+    const char *room;       /* "#room" a chat was posted to, "" otherwise */
+    long        timestamp;
     /* file transfer fields */
-    int      xfer_id;
-    char     filename[256];
-    uint32_t done_chunks;
-    uint32_t total_chunks;
-    XferState xfer_state;
+    int         xfer_id;
+    uint32_t    done_chunks;
+    uint32_t    total_chunks;
+    XferState   xfer_state;
+    uint64_t    bytes_per_sec;
+    int64_t     eta_s;      /* -1: unknown */
+    long long   queued_us;  /* util_time_us() when it was queued */
 } ChatEvent;
 
 #ifdef __cplusplus
@@ -34,12 +41,32 @@ extern "C" {
 #endif
 
 int  client_connect(const char *ip, uint16_t port, const char *username);
+/* Connect to the least loaded discovered server; needs discovery_start_scan */
+int  client_connect_auto(const char *username);
 void client_disconnect(void);
+/* to: a client name, "#room" (members only), or any other name for everyone */
 int  client_send_chat(const char *to, const char *text);
-int  client_send_file(const char *filepath, const char *to);
+/* Join (1) or leave (0) a room named "#..."; the server opens it on the
+ * first join and closes it with the last leave */
+int  client_join_room(const char *room, int join);
+/* direct: try a peer-to-peer data connection, keeping the relay as fallback;
+ * streams: direct connections to split the file across (0: default);
+ * dedup, compress: 1 on, -1 off, 0 default (see transfer_send_file) */
+int  client_send_file(const char *filepath, const char *to, int direct, int streams,
+                      int dedup, int compress);
 int  client_pause_transfer(int xfer_id);
 int  client_resume_transfer(int xfer_id);
+/* Transfer engine callback (transfer_init): queues the report as an event */
+void client_on_transfer(const XferProgress *p);
+
+/* Events are read by one thread.  Progress events for a transfer still in
+ * the queue are merged into one with the latest count. */
 int  client_poll_event(ChatEvent *out);
+
+/* Block until an event is queued or timeout_ms pass; returns 1 if one is.
+ * client_event_fd() turns readable instead, for callers that poll it. */
+int  client_wait_event(int timeout_ms);
+int  client_event_fd(void);
 int  client_is_connected(void);
 const char *client_get_username(void);
 int  client_get_sock_fd(void);
@@ -0,0 +1,98 @@
+/* compress.c
+ * zlib deflate/inflate for single chunks; stubs without zlib.
+ */
+
+#include "compress.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+struct Compressor {
+    z_stream zs;
+};
+
+int comp_available(void)
+{
+    return 1;
+}
+
+Compressor *comp_new(void)
+{
+    Compressor *z = (Compressor *)calloc(1, sizeof(Compressor));
+    if (!z) return NULL;
+    /* Raw deflate: each chunk already carries a CRC32C */
+    if (deflateInit2(&z->zs, COMP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void comp_free(Compressor *z)
+{
+    if (!z) return;
+    deflateEnd(&z->zs);
+    free(z);
+}
+
+uint32_t comp_chunk(Compressor *z, const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+    if (deflateReset(&z->zs) != Z_OK) return 0;
+    z->zs.next_in   = (Bytef *)src;
+    z->zs.avail_in  = len;
+    z->zs.next_out  = dst;
+    z->zs.avail_out = len;
+
+    /* Running out of room means it didn't shrink */
+    if (deflate(&z->zs, Z_FINISH) != Z_STREAM_END) return 0;
+    return z->zs.avail_out > 0 ? len - z->zs.avail_out : 0;
+}
+
+int comp_expand(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t want)
+{
+    z_stream zs = {0};
+    if (inflateInit2(&zs, -15) != Z_OK) return -1;
+    zs.next_in   = (Bytef *)src;
+    zs.avail_in  = len;
+    zs.next_out  = dst;
+    zs.avail_out = want;
+
+    int rc = inflate(&zs, Z_FINISH);
+    int ok = rc == Z_STREAM_END && zs.avail_out == 0 && zs.avail_in == 0;
+    inflateEnd(&zs);
+    return ok ? 0 : -1;
+}
+
+#else
+
+int comp_available(void)
+{
+    return 0;
+}
+
+Compressor *comp_new(void)
+{
+    return NULL;
+}
+
+void comp_free(Compressor *z)
+{
+    (void)z;
+}
+
+uint32_t comp_chunk(Compressor *z, const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+    (void)z; (void)src; (void)len; (void)dst;
+    return 0;
+}
+
+int comp_expand(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t want)
+{
+    (void)src; (void)len; (void)dst; (void)want;
+    return -1;
+}
+
+#endif /* HAVE_ZLIB */
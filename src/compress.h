@@ -0,0 +1,37 @@
+/* compress.h
+ * Per-chunk deflate (zlib, raw RFC 1951 streams) for file transfer.
+ * Without zlib at build time nothing is compressed and
+ * comp_available() says so, so the receiver never offers it.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#define COMP_LEVEL   1          /* zlib level: speed over ratio */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Compressor Compressor;
+
+int          comp_available(void);
+
+/* One per thread: deflate state is reused across chunks */
+Compressor  *comp_new(void);
+void         comp_free(Compressor *z);
+
+/* Deflate len bytes of src into dst, which holds len bytes.  Returns the
+ * compressed length, or 0 when the result would not be smaller. */
+uint32_t     comp_chunk(Compressor *z, const uint8_t *src, uint32_t len, uint8_t *dst);
+
+/* Inflate src into dst, which must come out exactly `want` bytes */
+int          comp_expand(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t want);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPRESS_H */
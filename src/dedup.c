@@ -0,0 +1,390 @@
+/* dedup.c
+ * FastCDC: a gear hash rolls over the file and a chunk ends where its top
+ * bits are zero, so an insert or delete only moves the boundaries next to
+ * it.  The store maps chunk hashes to where they sit in earlier downloads
+ * and lives in <downloads>/.mwchunks.
+ */
+
+#include "dedup.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* ── FastCDC ─────────────────────────────────────────────── */
+
+static uint64_t       gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Fixed seed: every sender must cut the same file at the same places */
+static void gear_init(void)
+{
+    uint64_t x = 0x4D65736857617665ULL;     /* "MeshWave" */
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static int log2_u32(uint32_t v)
+{
+    int b = 0;
+    while (v > 1) { v >>= 1; b++; }
+    return b;
+}
+
+/* Length of the next chunk of p[0, n).  Normalized chunking: a stricter
+ * mask before `avg` and a looser one after pull sizes toward the average. */
+static uint32_t cdc_cut(const uint8_t *p, uint32_t n, uint32_t min, uint32_t avg,
+                        uint32_t max, uint64_t mask_s, uint64_t mask_l)
+{
+    if (n <= min) return n;
+    if (n > max) n = max;
+    uint32_t normal = n < avg ? n : avg;
+
+    uint64_t h = 0;
+    uint32_t i = min;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & mask_s)) return i + 1;
+    }
+    for (; i < n; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & mask_l)) return i + 1;
+    }
+    return n;
+}
+
+int dedup_split(int fd, uint64_t size, uint32_t avg, uint32_t max,
+                uint64_t **offs_out, uint32_t *count_out)
+{
+    pthread_once(&gear_once, gear_init);
+
+    int      bits   = log2_u32(avg);
+    uint64_t mask_s = ~0ULL << (64 - (bits + 2));
+    uint64_t mask_l = ~0ULL << (64 - (bits - 2));
+    uint32_t min    = avg / 4;
+    if (max < avg) max = avg;
+
+    size_t    cap   = (size_t)max * 4;
+    uint8_t  *buf   = (uint8_t *)malloc(cap);
+    uint32_t  count = 0, ocap = 1024;
+    uint64_t *offs  = (uint64_t *)malloc(ocap * sizeof(uint64_t));
+    if (!buf || !offs) { free(buf); free(offs); return -1; }
+
+    size_t   start = 0, end = 0;
+    uint64_t pos   = 0;             /* file offset of buf[start] */
+    offs[0] = 0;
+
+    while (pos < size) {
+        /* Keep at least one max-sized chunk in view while the file lasts */
+        uint64_t file_end = pos + (end - start);
+        if (end - start < max && file_end < size) {
+            memmove(buf, buf + start, end - start);
+            end  -= start;
+            start = 0;
+            while (end < cap && file_end < size) {
+                ssize_t n = pread(fd, buf + end, cap - end, (off_t)file_end);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) { free(buf); free(offs); return -1; }
+                end      += (size_t)n;
+                file_end += (uint64_t)n;
+            }
+        }
+
+        size_t   avail = end - start;
+        uint32_t cut   = cdc_cut(buf + start, avail > max ? max : (uint32_t)avail,
+                                 min, avg, max, mask_s, mask_l);
+        start += cut;
+        pos   += cut;
+
+        if (count + 2 > ocap) {
+            ocap *= 2;
+            uint64_t *grown = (uint64_t *)realloc(offs, ocap * sizeof(uint64_t));
+            if (!grown) { free(buf); free(offs); return -1; }
+            offs = grown;
+        }
+        offs[++count] = pos;
+    }
+
+    free(buf);
+    *offs_out  = offs;
+    *count_out = count;
+    return 0;
+}
+
+/* ── Chunk store ─────────────────────────────────────────── */
+
+typedef struct {
+    uint8_t  hash[HASH_DIGEST_LEN];
+    uint64_t off;
+    uint32_t len;
+    uint32_t file;         /* index into store_files */
+} StoreEntry;
+
+/* A file's chunks are entries[first, first + count) */
+typedef struct {
+    char     name[256];
+    uint32_t first;
+    uint32_t count;
+} StoreFile;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static char        store_dir[512];
+static int         store_loaded = 0;
+static StoreEntry *entries      = NULL;
+static uint32_t    entry_count  = 0;
+static StoreFile  *files        = NULL;
+static uint32_t    file_count   = 0;
+static int32_t    *slots        = NULL;     /* open addressing, -1 empty */
+static uint32_t    slot_mask    = 0;
+
+static uint32_t slot_of(const uint8_t *hash)
+{
+    uint32_t h;
+    memcpy(&h, hash, 4);    /* BLAKE3 output is already uniform */
+    return h & slot_mask;
+}
+
+static int index_rebuild(void)
+{
+    uint32_t cap = 1024;
+    while (cap < entry_count * 2) cap *= 2;
+
+    int32_t *grown = (int32_t *)malloc(cap * sizeof(int32_t));
+    if (!grown) return -1;
+    free(slots);
+    slots     = grown;
+    slot_mask = cap - 1;
+    memset(slots, 0xFF, cap * sizeof(int32_t));
+
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint32_t s = slot_of(entries[i].hash);
+        while (slots[s] >= 0) s = (s + 1) & slot_mask;
+        slots[s] = (int32_t)i;
+    }
+    return 0;
+}
+
+static void store_clear(void)
+{
+    free(entries);
+    free(files);
+    free(slots);
+    entries = NULL;
+    files   = NULL;
+    slots   = NULL;
+    entry_count = file_count = slot_mask = 0;
+}
+
+/* Append one file's chunks; offsets follow from the lengths */
+static int store_append(const char *name, const uint32_t *lens,
+                        const uint8_t (*hashes)[HASH_DIGEST_LEN], uint32_t count)
+{
+    StoreEntry *ge = (StoreEntry *)realloc(entries, (size_t)(entry_count + count) * sizeof(StoreEntry));
+    if (!ge) return -1;
+    entries = ge;
+    StoreFile *gf = (StoreFile *)realloc(files, (size_t)(file_count + 1) * sizeof(StoreFile));
+    if (!gf) return -1;
+    files = gf;
+
+    StoreFile *f = &files[file_count];
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->first = entry_count;
+    f->count = count;
+
+    uint64_t off = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        StoreEntry *e = &entries[entry_count + i];
+        memcpy(e->hash, hashes[i], HASH_DIGEST_LEN);
+        e->off  = off;
+        e->len  = lens[i];
+        e->file = file_count;
+        off += lens[i];
+    }
+    entry_count += count;
+    file_count++;
+    return 0;
+}
+
+/* Drop file `index`, shifting the later files and their entries down */
+static void store_drop(uint32_t index)
+{
+    StoreFile *f = &files[index];
+    uint32_t first = f->first, count = f->count;
+
+    memmove(&entries[first], &entries[first + count],
+            (size_t)(entry_count - first - count) * sizeof(StoreEntry));
+    entry_count -= count;
+    memmove(&files[index], &files[index + 1], (size_t)(file_count - index - 1) * sizeof(StoreFile));
+    file_count--;
+
+    for (uint32_t i = index; i < file_count; i++) files[i].first -= count;
+    for (uint32_t i = first; i < entry_count; i++) entries[i].file--;
+}
+
+static void store_path(char *out, size_t len)
+{
+    snprintf(out, len, "%s/%s", store_dir, DEDUP_STORE_FILE);
+}
+
+/* "MWC1", then per file: name_len(2B) name count(4B) count * (len(4B) hash(32B)) */
+static void store_load(const char *dir)
+{
+    store_clear();
+    snprintf(store_dir, sizeof(store_dir), "%s", dir);
+    store_loaded = 1;
+
+    char path[sizeof(store_dir) + sizeof(DEDUP_STORE_FILE) + 1];
+    store_path(path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { index_rebuild(); return; }
+
+    char magic[4];
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "MWC1", 4) != 0) {
+        util_log(LOG_WARN, "dedup: ignoring unreadable %s", path);
+        fclose(fp);
+        index_rebuild();
+        return;
+    }
+
+    uint8_t hdr[4];
+    while (fread(hdr, 1, 2, fp) == 2) {
+        char    name[256];
+        size_t  name_len = (size_t)hdr[0] << 8 | hdr[1];
+        if (name_len == 0 || name_len >= sizeof(name) ||
+            fread(name, 1, name_len, fp) != name_len || fread(hdr, 1, 4, fp) != 4)
+            break;
+        name[name_len] = '\0';
+
+        uint32_t count = (uint32_t)hdr[0] << 24 | (uint32_t)hdr[1] << 16 |
+                         (uint32_t)hdr[2] << 8 | hdr[3];
+        if (count > DEDUP_STORE_MAX - entry_count) break;
+
+        uint32_t *lens   = (uint32_t *)malloc((size_t)count * sizeof(uint32_t) + 1);
+        uint8_t (*hashes)[HASH_DIGEST_LEN] =
+            (uint8_t (*)[HASH_DIGEST_LEN])malloc((size_t)count * HASH_DIGEST_LEN + 1);
+        int ok = lens && hashes;
+        for (uint32_t i = 0; ok && i < count; i++) {
+            uint8_t e[DEDUP_ENTRY_LEN];
+            ok = fread(e, 1, DEDUP_ENTRY_LEN, fp) == DEDUP_ENTRY_LEN;
+            lens[i] = (uint32_t)e[0] << 24 | (uint32_t)e[1] << 16 | (uint32_t)e[2] << 8 | e[3];
+            memcpy(hashes[i], e + 4, HASH_DIGEST_LEN);
+        }
+        if (ok) ok = store_append(name, lens, (const uint8_t (*)[HASH_DIGEST_LEN])hashes, count) == 0;
+        free(lens);
+        free(hashes);
+        if (!ok) break;
+    }
+    fclose(fp);
+    index_rebuild();
+}
+
+/* Written to a temporary and renamed over, so a crash never leaves half */
+static int store_save(void)
+{
+    char path[sizeof(store_dir) + sizeof(DEDUP_STORE_FILE) + 1];
+    char tmp[sizeof(path) + 4];
+    store_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return -1;
+
+    int ok = fwrite("MWC1", 1, 4, fp) == 4;
+    for (uint32_t f = 0; ok && f < file_count; f++) {
+        size_t  name_len = strlen(files[f].name);
+        uint32_t count   = files[f].count;
+        uint8_t hdr[4]   = { (uint8_t)(name_len >> 8), (uint8_t)name_len };
+        ok = fwrite(hdr, 1, 2, fp) == 2 && fwrite(files[f].name, 1, name_len, fp) == name_len;
+
+        hdr[0] = (uint8_t)(count >> 24); hdr[1] = (uint8_t)(count >> 16);
+        hdr[2] = (uint8_t)(count >> 8);  hdr[3] = (uint8_t)count;
+        ok = ok && fwrite(hdr, 1, 4, fp) == 4;
+
+        for (uint32_t i = 0; ok && i < count; i++) {
+            const StoreEntry *e = &entries[files[f].first + i];
+            uint8_t rec[DEDUP_ENTRY_LEN];
+            rec[0] = (uint8_t)(e->len >> 24); rec[1] = (uint8_t)(e->len >> 16);
+            rec[2] = (uint8_t)(e->len >> 8);  rec[3] = (uint8_t)e->len;
+            memcpy(rec + 4, e->hash, HASH_DIGEST_LEN);
+            ok = fwrite(rec, 1, DEDUP_ENTRY_LEN, fp) == DEDUP_ENTRY_LEN;
+        }
+    }
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Holds store_lock */
+static void store_use(const char *dir)
+{
+    if (!store_loaded || strcmp(store_dir, dir) != 0)
+        store_load(dir);
+}
+
+int dedup_store_find(const char *dir, const uint8_t hash[HASH_DIGEST_LEN],
+                     char *path, size_t path_len, uint64_t *off, uint32_t *len)
+{
+    int found = -1;
+    pthread_mutex_lock(&store_lock);
+    store_use(dir);
+    if (slots) {
+        for (uint32_t s = slot_of(hash); slots[s] >= 0; s = (s + 1) & slot_mask) {
+            const StoreEntry *e = &entries[slots[s]];
+            if (memcmp(e->hash, hash, HASH_DIGEST_LEN) != 0) continue;
+            snprintf(path, path_len, "%s/%s", store_dir, files[e->file].name);
+            *off  = e->off;
+            *len  = e->len;
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+    return found;
+}
+
+void dedup_store_add(const char *dir, const char *name, const uint64_t *offs,
+                     const uint8_t (*hashes)[HASH_DIGEST_LEN], uint32_t count)
+{
+    if (count == 0 || count > DEDUP_STORE_MAX) return;
+
+    uint32_t *lens = (uint32_t *)malloc((size_t)count * sizeof(uint32_t));
+    if (!lens) return;
+    for (uint32_t i = 0; i < count; i++)
+        lens[i] = (uint32_t)(offs[i + 1] - offs[i]);
+
+    pthread_mutex_lock(&store_lock);
+    store_use(dir);
+
+    /* The new download replaced any older file of that name */
+    for (uint32_t f = 0; f < file_count; f++) {
+        if (strcmp(files[f].name, name) == 0) {
+            store_drop(f);
+            break;
+        }
+    }
+    while (file_count > 0 && entry_count + count > DEDUP_STORE_MAX)
+        store_drop(0);
+
+    if (store_append(name, lens, hashes, count) < 0 || index_rebuild() < 0) {
+        util_log(LOG_WARN, "dedup: out of memory, forgetting the chunk store");
+        store_clear();
+        index_rebuild();
+    } else if (store_save() < 0) {
+        util_log(LOG_WARN, "dedup: cannot write %s/%s: %s",
+                 store_dir, DEDUP_STORE_FILE, strerror(errno));
+    }
+    pthread_mutex_unlock(&store_lock);
+    free(lens);
+}
@@ -0,0 +1,43 @@
+/* dedup.h
+ * Content-defined chunking (FastCDC) for re-sends of mostly unchanged
+ * files, and the receiver's store of chunk hashes from finished downloads.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "hash.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_STORE_FILE      ".mwchunks"   /* in the downloads directory */
+#define DEDUP_STORE_MAX       (1 << 20)     /* chunks remembered, oldest files go first */
+#define DEDUP_ENTRY_LEN       (4 + HASH_DIGEST_LEN)     /* manifest: len(4B) hash */
+#define DEDUP_MANIFEST_BATCH  1024          /* entries per MSG_FILE_MANIFEST */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cut bytes [0, size) of fd where the content says so: chunks average
+ * `avg` bytes (a power of two) and stay within avg/4 .. max.  *offs gets
+ * count + 1 boundaries, the last one `size`; free() it. */
+int  dedup_split(int fd, uint64_t size, uint32_t avg, uint32_t max,
+                 uint64_t **offs, uint32_t *count);
+
+/* Look up a chunk by its BLAKE3 hash among the files received into dir.
+ * Fills the file's path and the chunk's place in it.  The file may have
+ * changed since, so callers check the bytes they read against the hash. */
+int  dedup_store_find(const char *dir, const uint8_t hash[HASH_DIGEST_LEN],
+                      char *path, size_t path_len, uint64_t *off, uint32_t *len);
+
+/* Remember the chunks of dir/name, replacing what was known about it */
+void dedup_store_add(const char *dir, const char *name, const uint64_t *offs,
+                     const uint8_t (*hashes)[HASH_DIGEST_LEN], uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DEDUP_H */
@@ -1,30 +1,84 @@
 /* discovery.c
- * UDP broadcast announce (server) and scan (client).
- * Server sends a JSON beacon every 2s; clients collect and expire entries.
+ * Multicast announce (server) and scan (client).
+ * Servers send a small binary beacon to DISC_GROUP4 and DISC_GROUP6, fast
+ * after startup or a load change and backing off to DISC_IDLE_MS while
+ * nothing changes.  A starting client probes the groups and every server
+ * answers at once, so the server list fills in milliseconds.
  */
 
 #include "discovery.h"
+#include "poller.h"
+#include "metrics.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <errno.h>
 
+/* Beacon layout, big-endian:
+ *   0  'M' 'W'        5  caps        12  IPv4 address (0 if none)
+ *   2  DISC_VERSION   6  port        16  name length
+ *   3  kind           8  load        17  name, not terminated
+ *   4  proto version 10  interval ms
+ * then after the name, if present: relay KiB/s (4 bytes)
+ */
+#define DISC_HDR_LEN  17
+#define DISC_DGRAM    512     /* receive buffer; older JSON beacons fit too */
+#define DISC_IFS_MAX  8
+#define DISC_TABLE    64      /* seen-server slots, a power of two > MAX_PEERS */
+
+typedef struct {
+    uint8_t  kind;
+    uint8_t  proto;
+    uint8_t  caps;
+    uint16_t port;
+    uint16_t load;
+    uint16_t interval_ms;
+    uint32_t ipv4;          /* network order */
+    uint32_t relay_kbps;
+    char     name[MAX_NAME];
+} Beacon;
+
+typedef struct {
+    unsigned       index;
+    struct in_addr a4;
+    int            has4, has6;
+} DiscIf;
+
+typedef struct {
+    int    fd4, fd6;
+    int    joined4;         /* interfaces that took the IPv4 group */
+    DiscIf ifs[DISC_IFS_MAX];
+    int    n_ifs;
+} DiscNet;
+
 static pthread_t      announce_thread;
 static volatile int   announce_running = 0;
+static Poller        *announce_poller;
+static int            announce_load = 0;
+static int            announce_dirty = 0;
 
 static pthread_t      scan_thread;
 static volatile int   scan_running = 0;
+static Poller        *scan_poller;
+static void         (*scan_notify)(void);
 
-static ServerInfo     seen_servers[MAX_PEERS];
-static long           seen_timestamps[MAX_PEERS];
+typedef struct {
+    ServerInfo info;
+    long       expires;
+    int        used;
+} SeenSlot;
+
+static SeenSlot       seen[DISC_TABLE];
 static int            seen_count = 0;
 static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -52,59 +106,377 @@ const char *discovery_get_local_ip(void)
     return local_ip;
 }
 
+/* ── Beacon codec ────────────────────────────────────────── */
+
+static size_t beacon_encode(const Beacon *b, uint8_t *out)
+{
+    size_t nlen = strnlen(b->name, MAX_NAME - 1);
+    out[0]  = 'M';
+    out[1]  = 'W';
+    out[2]  = DISC_VERSION;
+    out[3]  = b->kind;
+    out[4]  = b->proto;
+    out[5]  = b->caps;
+    out[6]  = (uint8_t)(b->port >> 8);
+    out[7]  = (uint8_t)b->port;
+    out[8]  = (uint8_t)(b->load >> 8);
+    out[9]  = (uint8_t)b->load;
+    out[10] = (uint8_t)(b->interval_ms >> 8);
+    out[11] = (uint8_t)b->interval_ms;
+    memcpy(out + 12, &b->ipv4, 4);
+    out[16] = (uint8_t)nlen;
+    memcpy(out + DISC_HDR_LEN, b->name, nlen);
+    uint8_t *t = out + DISC_HDR_LEN + nlen;
+    t[0] = (uint8_t)(b->relay_kbps >> 24);
+    t[1] = (uint8_t)(b->relay_kbps >> 16);
+    t[2] = (uint8_t)(b->relay_kbps >> 8);
+    t[3] = (uint8_t)b->relay_kbps;
+    return DISC_HDR_LEN + nlen + 4;
+}
+
+/* Later versions may append fields; only the prefix we know is read */
+static int beacon_decode(const uint8_t *p, size_t len, Beacon *b)
+{
+    if (len < DISC_HDR_LEN || p[0] != 'M' || p[1] != 'W' || p[2] < DISC_VERSION)
+        return -1;
+    size_t nlen = p[16];
+    if (nlen >= MAX_NAME || DISC_HDR_LEN + nlen > len) return -1;
+
+    b->kind        = p[3];
+    b->proto       = p[4];
+    b->caps        = p[5];
+    b->port        = (uint16_t)(p[6] << 8 | p[7]);
+    b->load        = (uint16_t)(p[8] << 8 | p[9]);
+    b->interval_ms = (uint16_t)(p[10] << 8 | p[11]);
+    memcpy(&b->ipv4, p + 12, 4);
+    memcpy(b->name, p + DISC_HDR_LEN, nlen);
+    b->name[nlen] = '\0';
+
+    const uint8_t *t = p + DISC_HDR_LEN + nlen;
+    b->relay_kbps = DISC_HDR_LEN + nlen + 4 <= len
+                  ? (uint32_t)t[0] << 24 | (uint32_t)t[1] << 16 | (uint32_t)t[2] << 8 | t[3]
+                  : 0;
+    return 0;
+}
+
+/* The JSON broadcast older servers still send */
+static int beacon_decode_legacy(const char *buf, Beacon *b, char *ip)
+{
+    const char *p, *e;
+    memset(b, 0, sizeof(*b));
+    b->kind        = DISC_KIND_BEACON;
+    b->proto       = PROTO_V1;
+    b->caps        = DISC_CAP_V1;
+    b->interval_ms = DISC_LEGACY_MS;
+
+    if ((p = strstr(buf, "\"name\":\"")) && (e = strchr(p + 8, '"')))
+        snprintf(b->name, MAX_NAME, "%.*s", (int)(e - p - 8), p + 8);
+    if ((p = strstr(buf, "\"ip\":\"")) && (e = strchr(p + 6, '"')))
+        snprintf(ip, 46, "%.*s", (int)(e - p - 6), p + 6);
+    if ((p = strstr(buf, "\"port\":")))
+        b->port = (uint16_t)atoi(p + 7);
+    if ((p = strstr(buf, "\"version\":")))
+        b->proto = (uint8_t)atoi(p + 10);
+    return b->name[0] && ip[0] && b->port ? 0 : -1;
+}
+
+/* ── Sockets ─────────────────────────────────────────────── */
+
+static void disc_ifaces(DiscNet *net)
+{
+    struct ifaddrs *addrs, *cur;
+    net->n_ifs = 0;
+    if (getifaddrs(&addrs) != 0) return;
+
+    for (cur = addrs; cur; cur = cur->ifa_next) {
+        if (!cur->ifa_addr) continue;
+        int fam = cur->ifa_addr->sa_family;
+        if (fam != AF_INET && fam != AF_INET6) continue;
+        if (!(cur->ifa_flags & IFF_UP) || !(cur->ifa_flags & IFF_MULTICAST)) continue;
+        if (cur->ifa_flags & IFF_LOOPBACK) continue;
+
+        unsigned idx = if_nametoindex(cur->ifa_name);
+        int i = 0;
+        while (i < net->n_ifs && net->ifs[i].index != idx) i++;
+        if (i == net->n_ifs) {
+            if (i == DISC_IFS_MAX) continue;
+            memset(&net->ifs[i], 0, sizeof(DiscIf));
+            net->ifs[i].index = idx;
+            net->n_ifs++;
+        }
+        if (fam == AF_INET && !net->ifs[i].has4) {
+            net->ifs[i].a4   = ((struct sockaddr_in *)cur->ifa_addr)->sin_addr;
+            net->ifs[i].has4 = 1;
+        } else if (fam == AF_INET6) {
+            net->ifs[i].has6 = 1;
+        }
+    }
+    freeifaddrs(addrs);
+}
+
+static int disc_bind(int family)
+{
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    #ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    #endif
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    int rc;
+    if (family == AF_INET) {
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons(DISC_PORT);
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        rc = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    } else {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
+        struct sockaddr_in6 sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port   = htons(DISC_PORT);
+        sa.sin6_addr   = in6addr_any;
+        rc = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    }
+    if (rc < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Bind DISC_PORT on both families and join the groups on every multicast
+ * interface.  IPv6 is best effort; without IPv4 discovery is off. */
+static int disc_open(DiscNet *net, Poller *p)
+{
+    memset(net, 0, sizeof(*net));
+    disc_ifaces(net);
+
+    net->fd4 = disc_bind(AF_INET);
+    if (net->fd4 < 0) {
+        util_log(LOG_ERROR, "discovery bind: %s", strerror(errno));
+        return -1;
+    }
+    int yes = 1, hops = 1;
+    unsigned char ttl = 1;
+    setsockopt(net->fd4, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+    setsockopt(net->fd4, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    struct ip_mreq mr;
+    inet_pton(AF_INET, DISC_GROUP4, &mr.imr_multiaddr);
+    for (int i = 0; i < net->n_ifs; i++) {
+        if (!net->ifs[i].has4) continue;
+        mr.imr_interface = net->ifs[i].a4;
+        if (setsockopt(net->fd4, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr)) == 0)
+            net->joined4++;
+        else
+            net->ifs[i].has4 = 0;
+    }
+
+    net->fd6 = disc_bind(AF_INET6);
+    if (net->fd6 >= 0) {
+        struct ipv6_mreq mr6;
+        int joined6 = 0;
+        inet_pton(AF_INET6, DISC_GROUP6, &mr6.ipv6mr_multiaddr);
+        setsockopt(net->fd6, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+        for (int i = 0; i < net->n_ifs; i++) {
+            if (!net->ifs[i].has6) continue;
+            mr6.ipv6mr_interface = net->ifs[i].index;
+            if (setsockopt(net->fd6, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mr6, sizeof(mr6)) == 0)
+                joined6++;
+            else
+                net->ifs[i].has6 = 0;
+        }
+        if (!joined6) {
+            close(net->fd6);
+            net->fd6 = -1;
+        }
+    }
+
+    poller_add(p, net->fd4, POLL_IN, NULL);
+    if (net->fd6 >= 0) poller_add(p, net->fd6, POLL_IN, NULL);
+    return 0;
+}
+
+static void disc_close(DiscNet *net, Poller *p)
+{
+    poller_del(p, net->fd4);
+    close(net->fd4);
+    if (net->fd6 >= 0) {
+        poller_del(p, net->fd6);
+        close(net->fd6);
+    }
+}
+
+/* One copy per interface and family, each carrying that interface's IPv4
+ * address.  With no multicast interface, fall back to broadcast. */
+static void disc_send(DiscNet *net, Beacon *b)
+{
+    uint8_t pkt[DISC_HDR_LEN + MAX_NAME + 4];
+    size_t  n;
+
+    struct sockaddr_in g4;
+    memset(&g4, 0, sizeof(g4));
+    g4.sin_family = AF_INET;
+    g4.sin_port   = htons(DISC_PORT);
+    inet_pton(AF_INET, DISC_GROUP4, &g4.sin_addr);
+
+    struct sockaddr_in6 g6;
+    memset(&g6, 0, sizeof(g6));
+    g6.sin6_family = AF_INET6;
+    g6.sin6_port   = htons(DISC_PORT);
+    inet_pton(AF_INET6, DISC_GROUP6, &g6.sin6_addr);
+
+    for (int i = 0; i < net->n_ifs; i++) {
+        DiscIf *f = &net->ifs[i];
+        b->ipv4 = f->has4 ? f->a4.s_addr : 0;
+        n = beacon_encode(b, pkt);
+        if (f->has4) {
+            setsockopt(net->fd4, IPPROTO_IP, IP_MULTICAST_IF, &f->a4, sizeof(f->a4));
+            sendto(net->fd4, pkt, n, 0, (struct sockaddr *)&g4, sizeof(g4));
+        }
+        if (f->has6 && net->fd6 >= 0) {
+            g6.sin6_scope_id = f->index;
+            sendto(net->fd6, pkt, n, 0, (struct sockaddr *)&g6, sizeof(g6));
+        }
+    }
+
+    if (!net->joined4) {
+        b->ipv4 = 0;
+        n = beacon_encode(b, pkt);
+        g4.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+        sendto(net->fd4, pkt, n, 0, (struct sockaddr *)&g4, sizeof(g4));
+    }
+}
+
+/* Read one pending datagram from either socket.  Fills `ip` with the
+ * address to dial: the IPv4 source, or the address an IPv6 beacon carries.
+ * Returns 1 for a beacon, 0 when both are drained. */
+static int disc_recv(DiscNet *net, Beacon *b, char *ip)
+{
+    uint8_t buf[DISC_DGRAM];
+    for (;;) {
+        struct sockaddr_storage src;
+        socklen_t slen = sizeof(src);
+        ssize_t n = recvfrom(net->fd4, buf, sizeof(buf) - 1, 0,
+                             (struct sockaddr *)&src, &slen);
+        int v6 = 0;
+        if (n < 0 && net->fd6 >= 0) {
+            slen = sizeof(src);
+            n  = recvfrom(net->fd6, buf, sizeof(buf) - 1, 0,
+                          (struct sockaddr *)&src, &slen);
+            v6 = 1;
+        }
+        if (n < 0) return 0;
+
+        if (n > 0 && buf[0] == '{') {
+            buf[n] = '\0';
+            if (beacon_decode_legacy((const char *)buf, b, ip) == 0) return 1;
+            continue;
+        }
+        if (beacon_decode(buf, (size_t)n, b) < 0) continue;
+
+        struct in_addr a;
+        if (!v6 && src.ss_family == AF_INET)
+            a = ((struct sockaddr_in *)&src)->sin_addr;
+        else
+            a.s_addr = b->ipv4;
+        if (a.s_addr == 0 && b->kind != DISC_KIND_PROBE) continue;
+        inet_ntop(AF_INET, &a, ip, 46);
+        return 1;
+    }
+}
+
 /* ── Announce (server side) ──────────────────────────────── */
 
 typedef struct {
     char     name[MAX_NAME];
     uint16_t data_port;
+    uint8_t  caps;
 } AnnounceCtx;
 
 static void *announce_loop(void *arg)
 {
     AnnounceCtx *ctx = (AnnounceCtx *)arg;
 
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) { util_log(LOG_ERROR, "announce socket: %s", strerror(errno)); free(ctx); return NULL; }
+    DiscNet net;
+    if (disc_open(&net, announce_poller) < 0) { free(ctx); return NULL; }
 
-    int yes = 1;
-    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
-    #ifdef SO_REUSEPORT
-    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
-    #endif
+    Beacon b;
+    memset(&b, 0, sizeof(b));
+    b.kind  = DISC_KIND_BEACON;
+    b.proto = PROTO_VERSION;
+    b.caps  = ctx->caps;
+    b.port  = ctx->data_port;
+    snprintf(b.name, MAX_NAME, "%s", ctx->name);
 
-    struct sockaddr_in dst;
-    memset(&dst, 0, sizeof(dst));
-    dst.sin_family      = AF_INET;
-    dst.sin_port        = htons(DISC_PORT);
-    dst.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    util_log(LOG_INFO, "discovery: announcing as \"%s\" on %s:%d", ctx->name, local_ip, ctx->data_port);
 
-    detect_local_ip();
+    long     gap = DISC_FAST_MS, next = 0, last = 0;
+    int      probed = 0;
+    uint64_t relayed = metrics_counter(MET_RELAY_BYTES);
 
-    char pkt[512];
-    snprintf(pkt, sizeof(pkt),
-             "{\"name\":\"%s\",\"ip\":\"%s\",\"port\":%d,\"version\":1}",
-             ctx->name, local_ip, ctx->data_port);
+    while (announce_running) {
+        long now = util_time_ms();
 
-    util_log(LOG_INFO, "discovery: announcing as \"%s\" on %s:%d", ctx->name, local_ip, ctx->data_port);
+        /* A change restarts the fast schedule, one beacon per DISC_FAST_MS */
+        if (__atomic_exchange_n(&announce_dirty, 0, __ATOMIC_ACQUIRE)) {
+            gap  = DISC_FAST_MS;
+            next = last + DISC_FAST_MS > now ? last + DISC_FAST_MS : now;
+        }
+        if (probed && now - last >= DISC_PROBE_GAP_MS) next = now;
+
+        if (now >= next) {
+            /* Relay rate averaged over the gap since the last beacon */
+            uint64_t total = metrics_counter(MET_RELAY_BYTES);
+            if (now > last)
+                b.relay_kbps = (uint32_t)((total - relayed) / 1024 * 1000 / (uint64_t)(now - last));
+            relayed = total;
+
+            b.load        = (uint16_t)__atomic_load_n(&announce_load, __ATOMIC_RELAXED);
+            b.interval_ms = (uint16_t)gap;
+            disc_send(&net, &b);
+            last   = now;
+            next   = now + gap;
+            gap    = gap * 2 < DISC_IDLE_MS ? gap * 2 : DISC_IDLE_MS;
+            probed = 0;
+        }
 
-    while (announce_running) {
-        sendto(fd, pkt, strlen(pkt), 0, (struct sockaddr *)&dst, sizeof(dst));
-        usleep(DISC_INTERVAL_MS * 1000);
+        long wait = next - now;
+        if (probed && last + DISC_PROBE_GAP_MS - now < wait)
+            wait = last + DISC_PROBE_GAP_MS - now;
+        PollEvent evs[2];
+        poller_wait(announce_poller, evs, 2, wait > 0 ? (int)wait : 0);
+
+        Beacon in;
+        char   ip[46];
+        while (disc_recv(&net, &in, ip))
+            if (in.kind == DISC_KIND_PROBE) probed = 1;
     }
 
-    close(fd);
+    b.kind = DISC_KIND_BYE;
+    disc_send(&net, &b);
+    disc_close(&net, announce_poller);
     free(ctx);
     return NULL;
 }
 
-void discovery_start_announce(const char *server_name, uint16_t data_port)
+void discovery_start_announce(const char *server_name, uint16_t data_port, uint8_t caps)
 {
     if (announce_running) return;
+    if (!announce_poller && !(announce_poller = poller_create())) return;
     announce_running = 1;
+    detect_local_ip();
 
     AnnounceCtx *ctx = (AnnounceCtx *)malloc(sizeof(AnnounceCtx));
     snprintf(ctx->name, MAX_NAME, "%s", server_name);
     ctx->data_port = data_port;
+    ctx->caps      = caps;
 
     pthread_create(&announce_thread, NULL, announce_loop, ctx);
 }
@@ -113,128 +485,175 @@ void discovery_stop_announce(void)
 {
     if (!announce_running) return;
     announce_running = 0;
+    poller_wake(announce_poller);
     pthread_join(announce_thread, NULL);
 }
 
+void discovery_set_load(int peers)
+{
+    if (peers > 0xFFFF) peers = 0xFFFF;
+    if (__atomic_exchange_n(&announce_load, peers, __ATOMIC_RELAXED) == peers) return;
+    __atomic_store_n(&announce_dirty, 1, __ATOMIC_RELEASE);
+    if (announce_running) poller_wake(announce_poller);
+}
+
 /* ── Scan (client side) ──────────────────────────────────── */
 
-static void upsert_server(const char *name, const char *ip, uint16_t port)
+static unsigned seen_hash(const char *ip, uint16_t port)
+{
+    unsigned h = 2166136261u;
+    for (const char *p = ip; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    h = (h ^ port) * 16777619u;
+    return h & (DISC_TABLE - 1);
+}
+
+/* The slot holding ip:port, or the empty slot where it would go */
+static int seen_slot(const char *ip, uint16_t port)
+{
+    int i = (int)seen_hash(ip, port);
+    while (seen[i].used &&
+           (seen[i].info.port != port || strcmp(seen[i].info.ip, ip) != 0))
+        i = (i + 1) & (DISC_TABLE - 1);
+    return i;
+}
+
+/* Backward-shift delete: pull later probes of the chain into the hole */
+static void seen_delete(int i)
+{
+    int j = i;
+    for (;;) {
+        seen[i].used = 0;
+        for (;;) {
+            j = (j + 1) & (DISC_TABLE - 1);
+            if (!seen[j].used) {
+                seen_count--;
+                return;
+            }
+            int k = (int)seen_hash(seen[j].info.ip, seen[j].info.port);
+            /* k outside (i, j] cyclically: the entry may move to i */
+            if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) break;
+        }
+        seen[i] = seen[j];
+        i = j;
+    }
+}
+
+/* Returns 1 if a server was added or removed */
+static int upsert_server(const Beacon *b, const char *ip, long now)
 {
-    long now = util_time_ms();
     pthread_mutex_lock(&seen_lock);
 
-    for (int i = 0; i < seen_count; i++) {
-        if (strcmp(seen_servers[i].ip, ip) == 0 && seen_servers[i].port == port) {
-            snprintf(seen_servers[i].name, MAX_NAME, "%s", name);
-            seen_timestamps[i] = now;
+    int i = seen_slot(ip, b->port);
+    if (b->kind == DISC_KIND_BYE) {
+        if (seen[i].used) {
+            util_log(LOG_INFO, "discovery: server \"%s\" left", seen[i].info.name);
+            seen_delete(i);
             pthread_mutex_unlock(&seen_lock);
-            return;
+            return 1;
         }
+        pthread_mutex_unlock(&seen_lock);
+        return 0;
     }
 
-    if (seen_count < MAX_PEERS) {
-        snprintf(seen_servers[seen_count].name, MAX_NAME, "%s", name);
-        snprintf(seen_servers[seen_count].ip, 46, "%s", ip);
-        seen_servers[seen_count].port = port;
-        seen_timestamps[seen_count] = now;
+    int added = 0;
+    if (!seen[i].used) {
+        if (seen_count >= MAX_PEERS) {
+            pthread_mutex_unlock(&seen_lock);
+            return 0;
+        }
+        memset(&seen[i], 0, sizeof(SeenSlot));
+        seen[i].used = 1;
+        snprintf(seen[i].info.ip, 46, "%s", ip);
+        seen[i].info.port = b->port;
         seen_count++;
-        util_log(LOG_INFO, "discovery: found server \"%s\" at %s:%d", name, ip, port);
+        added = 1;
+        util_log(LOG_INFO, "discovery: found server \"%s\" at %s:%d", b->name, ip, b->port);
     }
+    snprintf(seen[i].info.name, MAX_NAME, "%s", b->name);
+    seen[i].info.load    = b->load;
+    seen[i].info.version = b->proto;
+    seen[i].info.caps    = b->caps;
+    seen[i].info.relay_kbps = b->relay_kbps;
+
+    long gap = b->interval_ms ? b->interval_ms : DISC_IDLE_MS;
+    seen[i].expires = now + DISC_MISSES * gap + DISC_FAST_MS;
 
     pthread_mutex_unlock(&seen_lock);
+    return added;
 }
 
-static void expire_servers(void)
+/* Drop servers past their expiry; returns ms until the next one is due.
+ * *changed is set if any went. */
+static long expire_servers(long now, int *changed)
 {
-    long now = util_time_ms();
+    long wait = 1000;
     pthread_mutex_lock(&seen_lock);
 
-    for (int i = 0; i < seen_count; ) {
-        if (now - seen_timestamps[i] > DISC_EXPIRE_MS) {
-            util_log(LOG_INFO, "discovery: expired server \"%s\"", seen_servers[i].name);
-            seen_servers[i] = seen_servers[seen_count - 1];
-            seen_timestamps[i] = seen_timestamps[seen_count - 1];
-            seen_count--;
-        } else {
-            i++;
+    for (int i = 0; i < DISC_TABLE; ) {
+        if (seen[i].used && now >= seen[i].expires) {
+            util_log(LOG_INFO, "discovery: expired server \"%s\"", seen[i].info.name);
+            seen_delete(i);     /* may refill slot i; look again */
+            *changed = 1;
+            continue;
         }
+        if (seen[i].used && seen[i].expires - now < wait)
+            wait = seen[i].expires - now;
+        i++;
     }
 
     pthread_mutex_unlock(&seen_lock);
+    return wait;
 }
 
 static void *scan_loop(void *arg)
 {
     (void)arg;
 
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) { util_log(LOG_ERROR, "scan socket: %s", strerror(errno)); return NULL; }
-
-    int yes = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-    #ifdef SO_REUSEPORT
-    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
-    #endif
-
-    struct sockaddr_in bind_addr;
-    memset(&bind_addr, 0, sizeof(bind_addr));
-    bind_addr.sin_family      = AF_INET;
-    bind_addr.sin_port        = htons(DISC_PORT);
-    bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(fd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
-        util_log(LOG_ERROR, "scan bind: %s", strerror(errno));
-        close(fd);
-        return NULL;
-    }
-
-    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    DiscNet net;
+    if (disc_open(&net, scan_poller) < 0) return NULL;
 
     util_log(LOG_INFO, "discovery: scanning for servers on port %d", DISC_PORT);
 
-    while (scan_running) {
-        char buf[512];
-        struct sockaddr_in src;
-        socklen_t slen = sizeof(src);
-
-        ssize_t n = recvfrom(fd, buf, sizeof(buf) - 1, 0,
-                             (struct sockaddr *)&src, &slen);
-        if (n > 0) {
-            buf[n] = '\0';
+    Beacon probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.kind  = DISC_KIND_PROBE;
+    probe.proto = PROTO_VERSION;
 
-            char name[MAX_NAME] = {0}, ip[46] = {0};
-            int port = 0;
+    long probe_at = 0, probe_gap = DISC_FAST_MS;
+    int  probes = 0;
 
-            char *p;
-            if ((p = strstr(buf, "\"name\":\""))) {
-                p += 8;
-                char *e = strchr(p, '"');
-                if (e) { int len = (int)(e - p); if (len >= MAX_NAME) len = MAX_NAME - 1; strncpy(name, p, len); }
-            }
-            if ((p = strstr(buf, "\"ip\":\""))) {
-                p += 6;
-                char *e = strchr(p, '"');
-                if (e) { int len = (int)(e - p); if (len >= 46) len = 45; strncpy(ip, p, len); }
-            }
-            if ((p = strstr(buf, "\"port\":"))) {
-                port = atoi(p + 7);
-            }
-
-            if (name[0] && ip[0] && port > 0)
-                upsert_server(name, ip, (uint16_t)port);
+    while (scan_running) {
+        long now = util_time_ms();
+        if (probes < DISC_PROBES && now >= probe_at) {
+            disc_send(&net, &probe);
+            probes++;
+            probe_at   = now + probe_gap;
+            probe_gap *= 2;
         }
 
-        expire_servers();
+        Beacon b;
+        char   ip[46];
+        int    changed = 0;
+        while (disc_recv(&net, &b, ip))
+            if (b.kind == DISC_KIND_BEACON || b.kind == DISC_KIND_BYE)
+                changed |= upsert_server(&b, ip, now);
+
+        long wait = expire_servers(now, &changed);
+        void (*notify)(void) = __atomic_load_n(&scan_notify, __ATOMIC_ACQUIRE);
+        if (changed && notify) notify();
+        if (probes < DISC_PROBES && probe_at - now < wait) wait = probe_at - now;
+        PollEvent evs[2];
+        poller_wait(scan_poller, evs, 2, wait > 0 ? (int)wait : 0);
     }
 
-    close(fd);
+    disc_close(&net, scan_poller);
     return NULL;
 }
 
 void discovery_start_scan(void)
 {
     if (scan_running) return;
+    if (!scan_poller && !(scan_poller = poller_create())) return;
     scan_running = 1;
     detect_local_ip();
     pthread_create(&scan_thread, NULL, scan_loop, NULL);
@@ -244,15 +663,21 @@ void discovery_stop_scan(void)
 {
     if (!scan_running) return;
     scan_running = 0;
+    poller_wake(scan_poller);
     pthread_join(scan_thread, NULL);
 }
 
+void discovery_set_notify(void (*fn)(void))
+{
+    __atomic_store_n(&scan_notify, fn, __ATOMIC_RELEASE);
+}
+
 int discovery_get_servers(ServerInfo *out, int max)
 {
-    int count;
+    int count = 0;
     pthread_mutex_lock(&seen_lock);
-    count = seen_count < max ? seen_count : max;
-    memcpy(out, seen_servers, count * sizeof(ServerInfo));
+    for (int i = 0; i < DISC_TABLE && count < max; i++)
+        if (seen[i].used) out[count++] = seen[i].info;
     pthread_mutex_unlock(&seen_lock);
     return count;
 }
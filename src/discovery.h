@@ -1,5 +1,5 @@
 /* discovery.h
- * UDP broadcast peer discovery for LAN servers.
+ * UDP multicast discovery of LAN servers: beacons, probes and the seen list.
  */
 
 #ifndef DISCOVERY_H
@@ -11,12 +11,18 @@
 extern "C" {
 #endif
 
-void discovery_start_announce(const char *server_name, uint16_t data_port);
+/* caps: DISC_CAP_* bits to advertise */
+void discovery_start_announce(const char *server_name, uint16_t data_port, uint8_t caps);
 void discovery_stop_announce(void);
 
+/* Connected peer count to announce; a change is beaconed within DISC_FAST_MS */
+void discovery_set_load(int peers);
+
 void discovery_start_scan(void);
 void discovery_stop_scan(void);
 
+/* fn runs on the scan thread whenever a server appears or goes */
+void        discovery_set_notify(void (*fn)(void));
 int         discovery_get_servers(ServerInfo *out, int max);
 const char *discovery_get_local_ip(void);
 
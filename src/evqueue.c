@@ -0,0 +1,197 @@
+/* evqueue.c
+ * Byte ring with an atomically reserved head.  Producers claim space with
+ * a CAS, fill it, and publish the record by storing its size last; the
+ * consumer stops at the first record not yet published.  The consumer
+ * zeroes what it has read, so unpublished space always reads as size 0.
+ * A sleeping consumer is woken through an eventfd (Linux) or a pipe.
+ */
+
+#include "evqueue.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define REC_PAD  0x80000000u    /* filler up to the end of the ring */
+
+typedef struct {
+    _Atomic uint32_t size;      /* bytes with this header, 0 until committed */
+    uint32_t         len;       /* payload bytes */
+} RecHdr;
+
+struct EvQueue {
+    uint8_t          *ring;
+    uint32_t          cap;
+    int               wake_rd;
+    int               wake_wr;  /* same as wake_rd for an eventfd */
+    _Alignas(64) _Atomic uint64_t head;     /* producers */
+    _Alignas(64) _Atomic uint64_t tail;     /* consumer */
+    atomic_int        sleeping;
+};
+
+EvQueue *evq_create(uint32_t bytes)
+{
+    uint32_t cap = 4096;
+    while (cap < bytes && cap < (1u << 30)) cap <<= 1;
+
+    EvQueue *q = (EvQueue *)calloc(1, sizeof(EvQueue));
+    if (!q) return NULL;
+    q->ring = (uint8_t *)calloc(1, cap);
+    q->cap  = cap;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->sleeping, 0);
+
+#ifdef __linux__
+    q->wake_rd = q->wake_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int ok = q->wake_rd >= 0;
+#else
+    int pipefd[2];
+    int ok = pipe(pipefd) == 0;
+    if (ok) {
+        q->wake_rd = pipefd[0];
+        q->wake_wr = pipefd[1];
+        fcntl(q->wake_rd, F_SETFL, fcntl(q->wake_rd, F_GETFL) | O_NONBLOCK);
+        fcntl(q->wake_wr, F_SETFL, fcntl(q->wake_wr, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+    if (!q->ring || !ok) {
+        if (ok) evq_destroy(q);
+        else { free(q->ring); free(q); }
+        return NULL;
+    }
+    return q;
+}
+
+void evq_destroy(EvQueue *q)
+{
+    if (!q) return;
+    close(q->wake_rd);
+    if (q->wake_wr != q->wake_rd) close(q->wake_wr);
+    free(q->ring);
+    free(q);
+}
+
+void *evq_reserve(EvQueue *q, uint32_t len, uint32_t fill)
+{
+    uint32_t need = ((uint32_t)sizeof(RecHdr) + len + EVQ_ALIGN - 1) & ~(uint32_t)(EVQ_ALIGN - 1);
+    if (fill > q->cap) fill = q->cap;
+    if (len >= q->cap || need > fill) return NULL;
+
+    uint64_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t off, pad;
+    for (;;) {
+        off = (uint32_t)h & (q->cap - 1);
+        pad = off + need > q->cap ? q->cap - off : 0;
+        uint64_t t = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (h + pad + need - t > fill) return NULL;
+        if (atomic_compare_exchange_weak_explicit(&q->head, &h, h + pad + need,
+                                                  memory_order_acq_rel,
+                                                  memory_order_relaxed))
+            break;
+    }
+
+    /* A record never wraps; the rest of the ring is skipped instead */
+    if (pad) {
+        RecHdr *p = (RecHdr *)(q->ring + off);
+        atomic_store_explicit(&p->size, pad | REC_PAD, memory_order_release);
+        off = 0;
+    }
+    RecHdr *r = (RecHdr *)(q->ring + off);
+    r->len = len;
+    return r + 1;
+}
+
+void evq_commit(EvQueue *q, void *rec)
+{
+    RecHdr  *r    = (RecHdr *)rec - 1;
+    uint32_t size = ((uint32_t)sizeof(RecHdr) + r->len + EVQ_ALIGN - 1) & ~(uint32_t)(EVQ_ALIGN - 1);
+    atomic_store(&r->size, size);
+
+    /* Pairs with the store-then-check in evq_wait */
+    if (atomic_exchange(&q->sleeping, 0)) {
+#ifdef __linux__
+        uint64_t one = 1;
+        ssize_t n = write(q->wake_wr, &one, sizeof(one));
+#else
+        char c = 1;
+        ssize_t n = write(q->wake_wr, &c, 1);
+#endif
+        (void)n;    /* full means a wake is already pending */
+    }
+}
+
+/* The record at the tail, past any filler */
+static RecHdr *head_record(EvQueue *q)
+{
+    uint64_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        RecHdr  *r    = (RecHdr *)(q->ring + ((uint32_t)t & (q->cap - 1)));
+        uint32_t size = atomic_load(&r->size);
+        if (!(size & REC_PAD))
+            return size ? r : NULL;
+        size &= ~REC_PAD;
+        memset(r, 0, size);
+        t += size;
+        atomic_store_explicit(&q->tail, t, memory_order_release);
+    }
+}
+
+const void *evq_peek(EvQueue *q, uint32_t *len)
+{
+    RecHdr *r = head_record(q);
+    if (!r) return NULL;
+    *len = r->len;
+    return r + 1;
+}
+
+void evq_pop(EvQueue *q)
+{
+    RecHdr *r = head_record(q);
+    if (!r) return;
+    uint32_t size = atomic_load_explicit(&r->size, memory_order_relaxed);
+    memset(r, 0, size);
+    atomic_store_explicit(&q->tail, atomic_load_explicit(&q->tail, memory_order_relaxed) + size,
+                          memory_order_release);
+}
+
+static void drain_wake(EvQueue *q)
+{
+    uint64_t buf[8];
+    while (read(q->wake_rd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+int evq_wait(EvQueue *q, int timeout_ms)
+{
+    drain_wake(q);
+    atomic_store(&q->sleeping, 1);
+    if (head_record(q)) {
+        atomic_store(&q->sleeping, 0);
+        return 1;
+    }
+    if (timeout_ms == 0) return 0;      /* armed: evq_fd fires on the next commit */
+
+    struct pollfd pfd = { q->wake_rd, POLLIN, 0 };
+    poll(&pfd, 1, timeout_ms);
+    drain_wake(q);
+    atomic_store(&q->sleeping, 0);
+    return head_record(q) != NULL;
+}
+
+int evq_fd(const EvQueue *q)
+{
+    return q->wake_rd;
+}
+
+uint32_t evq_capacity(const EvQueue *q)
+{
+    return q->cap;
+}
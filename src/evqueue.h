@@ -0,0 +1,51 @@
+/* evqueue.h
+ * Lock-free multi-producer, single-consumer queue of variable-length
+ * records in a byte ring, with a pollable descriptor that becomes readable
+ * when records arrive for a consumer that went to sleep.
+ */
+
+#ifndef EVQUEUE_H
+#define EVQUEUE_H
+
+#include <stdint.h>
+
+#define EVQ_ALIGN  8
+
+typedef struct EvQueue EvQueue;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* `bytes` is rounded up to a power of two */
+EvQueue    *evq_create(uint32_t bytes);
+void        evq_destroy(EvQueue *q);
+
+/* Producers: reserve room for a len-byte record, fill it, commit it.
+ * Fails (NULL) rather than wait when the record would take the ring past
+ * `fill` bytes in use, so callers can keep headroom for records that
+ * matter more.  Commits may land in any order; the consumer sees records
+ * in reservation order. */
+void       *evq_reserve(EvQueue *q, uint32_t len, uint32_t fill);
+void        evq_commit(EvQueue *q, void *rec);
+
+/* Consumer: the oldest committed record and its length, or NULL; it stays
+ * in place until evq_pop */
+const void *evq_peek(EvQueue *q, uint32_t *len);
+void        evq_pop(EvQueue *q);
+
+/* Consumer: sleep until a record is committed or timeout_ms pass (< 0:
+ * forever).  Returns 1 if one is ready. */
+int         evq_wait(EvQueue *q, int timeout_ms);
+
+/* Readable while the consumer should look at the queue; for callers that
+ * wait on it with other descriptors.  Call evq_wait(q, 0) to rearm. */
+int         evq_fd(const EvQueue *q);
+
+uint32_t    evq_capacity(const EvQueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVQUEUE_H */
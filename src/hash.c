@@ -0,0 +1,442 @@
+/* hash.c
+ * CRC32C and BLAKE3.  CRC32C is picked at first use: SSE4.2 crc32q on x86,
+ * the ARMv8 CRC extension on aarch64, or slice-by-8 tables.  BLAKE3 hashes
+ * runs of whole leaves in vector lanes, and can hash aligned subtrees on
+ * their own so chunks can be digested out of order and merged later.
+ */
+
+#include "hash.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#define CRC_ARM 1
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* ── CRC32C ──────────────────────────────────────────────── */
+
+#define CRC32C_POLY 0x82F63B78u     /* Castagnoli, bit-reflected */
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_fn)(uint32_t, const uint8_t *, size_t);
+static const char *crc_name = "software";
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_soft(uint32_t crc, const uint8_t *p, size_t n)
+{
+    while (n && ((uintptr_t)p & 7)) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        n--;
+    }
+    while (n >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                             (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                      (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(CRC_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t n)
+{
+    while (n && ((uintptr_t)p & 7)) { crc = _mm_crc32_u8(crc, *p++); n--; }
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        n -= 4;
+    }
+    while (n--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif defined(CRC_ARM)
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t n)
+{
+    while (n && ((uintptr_t)p & 7)) { crc = __crc32cb(crc, *p++); n--; }
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static int crc_hw_available(void)
+{
+#if defined(CRC_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(CRC_ARM) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(CRC_ARM) && defined(__APPLE__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+
+    crc_fn = crc_soft;
+#if defined(CRC_X86) || defined(CRC_ARM)
+    if (crc_hw_available()) {
+        crc_fn   = crc_hw;
+#if defined(CRC_X86)
+        crc_name = "sse4.2";
+#else
+        crc_name = "armv8";
+#endif
+    }
+#endif
+}
+
+uint32_t hash_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    return ~crc_fn(~crc, (const uint8_t *)data, len);
+}
+
+const char *hash_crc32c_impl(void)
+{
+    pthread_once(&crc_once, crc_init);
+    return crc_name;
+}
+
+/* ── BLAKE3 ──────────────────────────────────────────────── */
+
+enum {
+    CHUNK_START = 1 << 0,
+    CHUNK_END   = 1 << 1,
+    PARENT      = 1 << 2,
+    ROOT        = 1 << 3
+};
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotr32(uint32_t w, int c) { return (w >> c) | (w << (32 - c)); }
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t w)
+{
+    p[0] = (uint8_t)w; p[1] = (uint8_t)(w >> 8); p[2] = (uint8_t)(w >> 16); p[3] = (uint8_t)(w >> 24);
+}
+
+#define G(a, b, c, d, x, y) do {                       \
+        s[a] = s[a] + s[b] + (x); s[d] = rotr32(s[d] ^ s[a], 16); \
+        s[c] = s[c] + s[d];       s[b] = rotr32(s[b] ^ s[c], 12); \
+        s[a] = s[a] + s[b] + (y); s[d] = rotr32(s[d] ^ s[a], 8);  \
+        s[c] = s[c] + s[d];       s[b] = rotr32(s[b] ^ s[c], 7);  \
+    } while (0)
+
+/* Compress one block into the new chaining value (first 8 output words) */
+static void compress(uint32_t cv[8], const uint8_t block[64], uint8_t block_len,
+                     uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16], s[16];
+    for (int i = 0; i < 16; i++) m[i] = load32(block + 4 * i);
+
+    memcpy(s, cv, 32);
+    memcpy(s + 8, IV, 16);
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *k = MSG_SCHEDULE[r];
+        G(0, 4, 8,  12, m[k[0]],  m[k[1]]);
+        G(1, 5, 9,  13, m[k[2]],  m[k[3]]);
+        G(2, 6, 10, 14, m[k[4]],  m[k[5]]);
+        G(3, 7, 11, 15, m[k[6]],  m[k[7]]);
+        G(0, 5, 10, 15, m[k[8]],  m[k[9]]);
+        G(1, 6, 11, 12, m[k[10]], m[k[11]]);
+        G(2, 7, 8,  13, m[k[12]], m[k[13]]);
+        G(3, 4, 9,  14, m[k[14]], m[k[15]]);
+    }
+    for (int i = 0; i < 8; i++) cv[i] = s[i] ^ s[i + 8];
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint8_t flags,
+                      uint32_t out[8])
+{
+    uint8_t block[64];
+    for (int i = 0; i < 8; i++) {
+        store32(block + 4 * i, left[i]);
+        store32(block + 32 + 4 * i, right[i]);
+    }
+    memcpy(out, IV, 32);
+    compress(out, block, 64, 0, PARENT | flags);
+}
+
+/* Eight whole chunks at once, one per vector lane.  GCC lowers the vector
+ * type to AVX2 (cloned and picked at load time), SSE2 or NEON pairs, or
+ * plain scalar code where the target has none of them. */
+#define LANES 8
+typedef uint32_t vecN __attribute__((vector_size(4 * LANES)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && defined(__linux__)
+#define LANES_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define LANES_CLONES
+#endif
+
+#define VROTR(x, c) (((x) >> (c)) | ((x) << (32 - (c))))
+#define VG(a, b, c, d, x, y) do {                                    \
+        v[a] = v[a] + v[b] + (x); v[d] = VROTR(v[d] ^ v[a], 16);      \
+        v[c] = v[c] + v[d];       v[b] = VROTR(v[b] ^ v[c], 12);      \
+        v[a] = v[a] + v[b] + (y); v[d] = VROTR(v[d] ^ v[a], 8);       \
+        v[c] = v[c] + v[d];       v[b] = VROTR(v[b] ^ v[c], 7);       \
+    } while (0)
+
+LANES_CLONES
+static void chunks_xN(const uint8_t *in, uint64_t counter, uint32_t out[LANES][8])
+{
+    vecN h[8], v[16], m[16], ctr_lo, ctr_hi;
+
+    for (int i = 0; i < 8; i++) h[i] = (vecN){ 0 } + IV[i];
+    for (int j = 0; j < LANES; j++) {
+        ctr_lo[j] = (uint32_t)(counter + j);
+        ctr_hi[j] = (uint32_t)((counter + j) >> 32);
+    }
+
+    for (int b = 0; b < HASH_BLAKE3_CHUNK / 64; b++) {
+        for (int i = 0; i < 16; i++)
+            for (int j = 0; j < LANES; j++)
+                m[i][j] = load32(in + j * HASH_BLAKE3_CHUNK + b * 64 + 4 * i);
+
+        uint32_t flags = (b == 0 ? CHUNK_START : 0) |
+                         (b == HASH_BLAKE3_CHUNK / 64 - 1 ? CHUNK_END : 0);
+        for (int i = 0; i < 8; i++) v[i] = h[i];
+        for (int i = 0; i < 4; i++) v[8 + i] = (vecN){ 0 } + IV[i];
+        v[12] = ctr_lo;
+        v[13] = ctr_hi;
+        v[14] = (vecN){ 0 } + 64;
+        v[15] = (vecN){ 0 } + flags;
+
+        for (int r = 0; r < 7; r++) {
+            const uint8_t *k = MSG_SCHEDULE[r];
+            VG(0, 4, 8,  12, m[k[0]],  m[k[1]]);
+            VG(1, 5, 9,  13, m[k[2]],  m[k[3]]);
+            VG(2, 6, 10, 14, m[k[4]],  m[k[5]]);
+            VG(3, 7, 11, 15, m[k[6]],  m[k[7]]);
+            VG(0, 5, 10, 15, m[k[8]],  m[k[9]]);
+            VG(1, 6, 11, 12, m[k[10]], m[k[11]]);
+            VG(2, 7, 8,  13, m[k[12]], m[k[13]]);
+            VG(3, 4, 9,  14, m[k[14]], m[k[15]]);
+        }
+        for (int i = 0; i < 8; i++) h[i] = v[i] ^ v[i + 8];
+    }
+
+    for (int j = 0; j < LANES; j++)
+        for (int i = 0; i < 8; i++)
+            out[j][i] = h[i][j];
+}
+
+static void chunk_reset(Blake3Hasher *h, uint64_t counter)
+{
+    memcpy(h->cv, IV, 32);
+    h->chunk_counter     = counter;
+    h->block_len         = 0;
+    h->blocks_compressed = 0;
+    memset(h->block, 0, 64);
+}
+
+static size_t chunk_len(const Blake3Hasher *h)
+{
+    return (size_t)h->blocks_compressed * 64 + h->block_len;
+}
+
+void hash_blake3_init_at(Blake3Hasher *h, uint64_t chunk_counter)
+{
+    chunk_reset(h, chunk_counter);
+    h->chunks_done = 0;
+    h->stack_len   = 0;
+}
+
+void hash_blake3_init(Blake3Hasher *h)
+{
+    hash_blake3_init_at(h, 0);
+}
+
+/* Push a finished chunk's CV, merging every completed pair of subtrees.
+ * Merges follow the count since init, so a hasher started at an aligned
+ * counter builds exactly its subtree of the whole-input tree. */
+static void push_chunk_cv(Blake3Hasher *h, uint32_t cv[8])
+{
+    uint64_t total = ++h->chunks_done;
+    while ((total & 1) == 0) {
+        parent_cv(h->stack[--h->stack_len], cv, 0, cv);
+        total >>= 1;
+    }
+    memcpy(h->stack[h->stack_len++], cv, 32);
+}
+
+void hash_blake3_update(Blake3Hasher *h, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    while (len > 0) {
+        /* Whole chunks with more input behind them go through the lanes */
+        if (chunk_len(h) == 0 && len > LANES * HASH_BLAKE3_CHUNK) {
+            uint32_t cvs[LANES][8];
+            do {
+                chunks_xN(p, h->chunk_counter, cvs);
+                for (int j = 0; j < LANES; j++)
+                    push_chunk_cv(h, cvs[j]);
+                chunk_reset(h, h->chunk_counter + LANES);
+                p   += LANES * HASH_BLAKE3_CHUNK;
+                len -= LANES * HASH_BLAKE3_CHUNK;
+            } while (len > LANES * HASH_BLAKE3_CHUNK);
+            continue;
+        }
+
+        /* A full chunk is only closed once more input shows it isn't the last */
+        if (chunk_len(h) == HASH_BLAKE3_CHUNK) {
+            uint32_t cv[8];
+            memcpy(cv, h->cv, 32);
+            compress(cv, h->block, 64, h->chunk_counter,
+                     CHUNK_END | (h->blocks_compressed == 0 ? CHUNK_START : 0));
+            push_chunk_cv(h, cv);
+            chunk_reset(h, h->chunk_counter + 1);
+        }
+
+        size_t take = HASH_BLAKE3_CHUNK - chunk_len(h);
+        if (take > len) take = len;
+        len -= take;
+
+        while (take > 0) {
+            if (h->block_len == 64) {
+                compress(h->cv, h->block, 64, h->chunk_counter,
+                         h->blocks_compressed == 0 ? CHUNK_START : 0);
+                h->blocks_compressed++;
+                h->block_len = 0;
+                memset(h->block, 0, 64);
+            }
+            size_t n = 64 - h->block_len;
+            if (n > take) n = take;
+            memcpy(h->block + h->block_len, p, n);
+            h->block_len += (uint8_t)n;
+            p    += n;
+            take -= n;
+        }
+    }
+}
+
+static void finish(Blake3Hasher *h, uint8_t root, uint8_t out[HASH_DIGEST_LEN])
+{
+    uint8_t chunk_flags = CHUNK_END | (h->blocks_compressed == 0 ? CHUNK_START : 0);
+    uint32_t cv[8];
+    memcpy(cv, h->cv, 32);
+
+    if (h->stack_len == 0) {
+        compress(cv, h->block, h->block_len, root ? 0 : h->chunk_counter, chunk_flags | root);
+    } else {
+        compress(cv, h->block, h->block_len, h->chunk_counter, chunk_flags);
+        for (int i = h->stack_len - 1; i >= 0; i--)
+            parent_cv(h->stack[i], cv, i == 0 ? root : 0, cv);
+    }
+    for (int i = 0; i < 8; i++) store32(out + 4 * i, cv[i]);
+}
+
+void hash_blake3_final(Blake3Hasher *h, uint8_t out[HASH_DIGEST_LEN])
+{
+    finish(h, ROOT, out);
+}
+
+void hash_blake3_final_cv(Blake3Hasher *h, uint8_t out[HASH_DIGEST_LEN])
+{
+    finish(h, 0, out);
+}
+
+/* The left subtree always holds the largest power of two of leaves that
+ * is strictly fewer than n */
+static void merge_tree(const uint8_t (*cvs)[HASH_DIGEST_LEN], size_t n, uint8_t flags,
+                       uint32_t out[8])
+{
+    if (n == 1) {
+        for (int i = 0; i < 8; i++) out[i] = load32(cvs[0] + 4 * i);
+        return;
+    }
+    size_t left = 1;
+    while (left * 2 < n) left *= 2;
+
+    uint32_t l[8], r[8];
+    merge_tree(cvs, left, 0, l);
+    merge_tree(cvs + left, n - left, 0, r);
+    parent_cv(l, r, flags, out);
+}
+
+void hash_blake3_merge(const uint8_t (*cvs)[HASH_DIGEST_LEN], size_t n,
+                       uint8_t out[HASH_DIGEST_LEN])
+{
+    uint32_t root[8];
+    merge_tree(cvs, n, ROOT, root);
+    for (int i = 0; i < 8; i++) store32(out + 4 * i, root[i]);
+}
@@ -0,0 +1,53 @@
+/* hash.h
+ * Checksums for file transfer: CRC32C per chunk (hardware-accelerated where
+ * the CPU has it) and BLAKE3 for whole-file digests.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_DIGEST_LEN   32
+#define HASH_BLAKE3_CHUNK 1024      /* BLAKE3 leaf size */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Extend `crc` (0 to start) over data.  Uses SSE4.2 or ARMv8 CRC
+ * instructions when available, slice-by-8 tables otherwise. */
+uint32_t    hash_crc32c(uint32_t crc, const void *data, size_t len);
+const char *hash_crc32c_impl(void);
+
+/* Incremental BLAKE3.  A hasher started at a chunk counter other than 0
+ * hashes one subtree of a larger input; hash_blake3_final_cv() then yields
+ * that subtree's chaining value for hash_blake3_merge(). */
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint64_t chunks_done;       /* completed chunks since init */
+    uint8_t  block[64];
+    uint8_t  block_len;
+    uint8_t  blocks_compressed;
+    uint8_t  stack_len;
+    uint32_t stack[54][8];
+} Blake3Hasher;
+
+void hash_blake3_init(Blake3Hasher *h);
+void hash_blake3_init_at(Blake3Hasher *h, uint64_t chunk_counter);
+void hash_blake3_update(Blake3Hasher *h, const void *data, size_t len);
+void hash_blake3_final(Blake3Hasher *h, uint8_t out[HASH_DIGEST_LEN]);
+void hash_blake3_final_cv(Blake3Hasher *h, uint8_t out[HASH_DIGEST_LEN]);
+
+/* Root digest of an input split into n >= 2 equal power-of-two subtrees
+ * (the last may be short), given their chaining values in order. */
+void hash_blake3_merge(const uint8_t (*cvs)[HASH_DIGEST_LEN], size_t n,
+                       uint8_t out[HASH_DIGEST_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASH_H */
@@ -1,6 +1,9 @@
 /* http.cpp
- * Minimal embedded HTTP/1.1 server.
+ * Embedded HTTP/1.1 server.
  * Serves index.html from web_bundle.h, provides REST API and SSE events.
+ * One thread drives every connection through the poller: keep-alive
+ * requests are parsed there and handed to a few workers, and SSE events
+ * are appended to per-subscriber write buffers.
  */
 
 #include "http.h"
@@ -10,8 +13,12 @@
 extern "C" {
 #include "discovery.h"
 #include "server.h"
+#include "msgstore.h"
 #include "client.h"
 #include "transfer.h"
+#include "ratelimit.h"
+#include "poller.h"
+#include "metrics.h"
 #include "util.h"
 }
 
@@ -20,51 +27,15 @@ extern "C" {
 #include <cstring>
 #include <string>
 #include <vector>
+#include <cctype>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <errno.h>
 
-static int            http_fd   = -1;
-static pthread_t      http_thread;
-static volatile int   http_running = 0;
-
-/* SSE client tracking */
-#define MAX_SSE 16
-static int            sse_fds[MAX_SSE];
-static int            sse_count = 0;
-static pthread_mutex_t sse_lock = PTHREAD_MUTEX_INITIALIZER;
-
-static void sse_add(int fd)
-{
-    pthread_mutex_lock(&sse_lock);
-    if (sse_count < MAX_SSE)
-        sse_fds[sse_count++] = fd;
-    else
-        close(fd);
-    pthread_mutex_unlock(&sse_lock);
-}
-
-static void sse_broadcast(const char *event, const char *data)
-{
-    char buf[MAX_MSG + 256];
-    int len = snprintf(buf, sizeof(buf), "event: %s\ndata: %s\n\n", event, data);
-
-    pthread_mutex_lock(&sse_lock);
-    for (int i = 0; i < sse_count; ) {
-        ssize_t n = send(sse_fds[i], buf, len, MSG_NOSIGNAL);
-        if (n <= 0) {
-            close(sse_fds[i]);
-            sse_fds[i] = sse_fds[--sse_count];
-        } else {
-            i++;
-        }
-    }
-    pthread_mutex_unlock(&sse_lock);
-}
-
 /* ── tiny JSON helpers ──────────────────────────────────── */
 
 static std::string json_escape(const char *s)
@@ -91,79 +62,222 @@ struct HttpReq {
     char body[MAX_MSG];
     int  body_len;
     int  content_length;
+    bool keep_alive;
+    unsigned accept_enc;        /* ENC_* the client takes */
+    char if_none_match[128];
+    char range[64];
+
+    /* Streamed uploads: the body goes to a spool file, not `body` */
+    bool      upload;
+    bool      chunked;          /* Transfer-Encoding: chunked */
+    bool      expect_continue;
+    long long upload_len;       /* Content-Length, when not chunked */
+    char      upload_path[512]; /* the finished spool file, for the handler */
+};
+
+#define ENC_GZIP  0x1
+#define ENC_BR    0x2
+
+/* What a handler answers: the bytes to send, and what becomes of the
+ * connection afterwards */
+struct HttpReply {
+    std::string data;
+    bool        keep_alive;
+    bool        sse;        /* stays open as an event stream */
+    int         file_fd;    /* >= 0: body continues with [file_off, file_end) */
+    long long   file_off, file_end;
 };
 
-static int parse_request(int fd, HttpReq *req)
+/* Copy the value of header `name` out of head (which starts with the
+ * request line and ends in CRLF); "" if absent. */
+static void header_value(const std::string &head, const char *name, char *out, size_t len)
 {
-    char raw[8192];
-    memset(raw, 0, sizeof(raw));
-    memset(req, 0, sizeof(*req));
+    out[0] = '\0';
+    std::string needle = std::string("\r\n") + name + ":";
+    const char *p = strcasestr(head.c_str(), needle.c_str());
+    if (!p) return;
+    p += needle.size();
+    while (*p == ' ' || *p == '\t') p++;
+    const char *e = strstr(p, "\r\n");
+    size_t n = e ? (size_t)(e - p) : strlen(p);
+    if (n >= len) n = len - 1;
+    memcpy(out, p, n);
+    out[n] = '\0';
+}
 
-    ssize_t total = 0;
-    while (total < (ssize_t)sizeof(raw) - 1) {
-        ssize_t n = recv(fd, raw + total, sizeof(raw) - 1 - total, 0);
-        if (n <= 0) return -1;
-        total += n;
-        if (strstr(raw, "\r\n\r\n")) break;
+/* Codings from an Accept-Encoding list, leaving out any refused with q=0 */
+static unsigned parse_accept_encoding(const char *v)
+{
+    unsigned enc = 0;
+    while (*v) {
+        while (*v == ' ' || *v == ',') v++;
+        const char *tok = v;
+        while (*v && *v != ',' && *v != ';' && *v != ' ') v++;
+        size_t tlen = (size_t)(v - tok);
+        const char *q = NULL;
+        while (*v && *v != ',') {
+            if (*v == 'q' && v[1] == '=') q = v + 2;
+            v++;
+        }
+        if (q && atof(q) <= 0.0) continue;
+        if (tlen == 4 && strncasecmp(tok, "gzip", 4) == 0) enc |= ENC_GZIP;
+        if (tlen == 2 && strncasecmp(tok, "br", 2) == 0)   enc |= ENC_BR;
     }
+    return enc;
+}
 
-    sscanf(raw, "%15s %255s", req->method, req->path);
-
-    char *cl = strcasestr(raw, "Content-Length:");
-    if (cl) req->content_length = atoi(cl + 15);
+static bool is_upload_path(const char *path)
+{
+    return strncmp(path, "/api/file/upload", 16) == 0 && (path[16] == '\0' || path[16] == '?');
+}
 
-    char *body_start = strstr(raw, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4;
-        int already = (int)(total - (body_start - raw));
-        memcpy(req->body, body_start, already);
+/* Parse one request from the front of buf.  Returns the bytes it took,
+ * 0 if it isn't all there yet, or -(HTTP status) for one to refuse. */
+static int parse_request(const std::string &buf, HttpReq *req)
+{
+    size_t end = buf.find("\r\n\r\n");
+    if (end == std::string::npos)
+        return buf.size() > HTTP_HEADER_MAX ? -431 : 0;
+    if (end > HTTP_HEADER_MAX) return -431;
 
-        while (already < req->content_length && already < MAX_MSG - 1) {
-            ssize_t n = recv(fd, req->body + already, req->content_length - already, 0);
-            if (n <= 0) break;
-            already += (int)n;
-        }
-        req->body_len = already;
-        req->body[already] = '\0';
+    std::string head = buf.substr(0, end + 2);
+    memset(req, 0, sizeof(*req));
+    char version[16] = "";
+    sscanf(head.c_str(), "%15s %255s %15s", req->method, req->path, version);
+
+    /* An upload's body is streamed by the caller, however long it is */
+    const char *cl = strcasestr(head.c_str(), "\r\nContent-Length:");
+    if (strcmp(req->method, "POST") == 0 && is_upload_path(req->path)) {
+        char te[64], expect[64];
+        header_value(head, "Transfer-Encoding", te, sizeof(te));
+        header_value(head, "Expect", expect, sizeof(expect));
+        req->upload          = true;
+        req->chunked         = strcasestr(te, "chunked") != NULL;
+        req->expect_continue = strcasecmp(expect, "100-continue") == 0;
+        req->upload_len      = cl ? strtoll(cl + 17, NULL, 10) : -1;
+        if (!req->chunked && req->upload_len < 0) return -411;
+    } else {
+        if (cl) req->content_length = atoi(cl + 17);
+        if (req->content_length < 0 || req->content_length >= MAX_MSG) return -413;
     }
 
-    return 0;
+    /* HTTP/1.1 keeps the connection unless told otherwise, 1.0 only if asked */
+    const char *conn = strcasestr(head.c_str(), "\r\nConnection:");
+    if (strcmp(version, "HTTP/1.0") == 0)
+        req->keep_alive = conn && strncasecmp(conn + 13, " keep-alive", 11) == 0;
+    else
+        req->keep_alive = !(conn && strncasecmp(conn + 13, " close", 6) == 0);
+
+    char enc[256];
+    header_value(head, "Accept-Encoding", enc, sizeof(enc));
+    req->accept_enc = parse_accept_encoding(enc);
+    header_value(head, "If-None-Match", req->if_none_match, sizeof(req->if_none_match));
+    header_value(head, "Range", req->range, sizeof(req->range));
+
+    size_t body = end + 4;
+    if (buf.size() < body + (size_t)req->content_length) return 0;
+    memcpy(req->body, buf.data() + body, req->content_length);
+    req->body_len = req->content_length;
+    req->body[req->body_len] = '\0';
+    return (int)(body + req->content_length);
 }
 
 /* ── HTTP response helpers ──────────────────────────────── */
 
-static void send_response(int fd, int code, const char *ctype, const char *body, int blen)
+static const char *status_text(int code)
+{
+    switch (code) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    default:  return "Bad Request";
+    }
+}
+
+/* `extra` is further header lines, each ending in CRLF.  With no body
+ * only the headers go in; the caller supplies blen bytes some other way. */
+static void send_response_hdrs(HttpReply &rep, int code, const char *ctype, const char *extra,
+                               const void *body, long long blen)
 {
-    char hdr[512];
-    const char *status = code == 200 ? "OK" : code == 404 ? "Not Found" : "Bad Request";
+    char hdr[1024];
     int hlen = snprintf(hdr, sizeof(hdr),
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %d\r\n"
+        "Content-Length: %lld\r\n"
         "Access-Control-Allow-Origin: *\r\n"
-        "Connection: close\r\n"
+        "%s%s"
         "\r\n",
-        code, status, ctype, blen);
+        code, status_text(code), ctype, blen, extra,
+        rep.keep_alive ? "" : "Connection: close\r\n");
+
+    rep.data.append(hdr, hlen);
+    if (body && blen > 0) rep.data.append((const char *)body, (size_t)blen);
+}
+
+static void send_response(HttpReply &rep, int code, const char *ctype, const char *body, int blen)
+{
+    send_response_hdrs(rep, code, ctype, "", body, blen);
+}
+
+/* The dashboard, precompressed at build time.  Browsers revalidate it on
+ * each load and get 304 while the build hasn't changed. */
+static void send_index(HttpReply &rep, const HttpReq *req)
+{
+    const void *body = index_html;
+    int         blen = (int)INDEX_HTML_LEN;
+    const char *etag = INDEX_HTML_ETAG;
+    const char *coding = NULL;
+
+    if ((req->accept_enc & ENC_BR) && INDEX_HTML_BR_LEN > 0) {
+        body = index_html_br; blen = INDEX_HTML_BR_LEN;
+        etag = INDEX_HTML_BR_ETAG; coding = "br";
+    } else if (req->accept_enc & ENC_GZIP) {
+        body = index_html_gz; blen = INDEX_HTML_GZ_LEN;
+        etag = INDEX_HTML_GZ_ETAG; coding = "gzip";
+    }
 
-    send(fd, hdr, hlen, 0);
-    if (blen > 0) send(fd, body, blen, 0);
+    char extra[256];
+    snprintf(extra, sizeof(extra),
+             "ETag: %s\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Vary: Accept-Encoding\r\n"
+             "%s%s%s",
+             etag, coding ? "Content-Encoding: " : "", coding ? coding : "", coding ? "\r\n" : "");
+
+    if (strstr(req->if_none_match, etag) || strcmp(req->if_none_match, "*") == 0) {
+        char hdr[512];
+        int hlen = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "%s%s"
+            "\r\n",
+            extra, rep.keep_alive ? "" : "Connection: close\r\n");
+        rep.data.append(hdr, hlen);
+        return;
+    }
+    send_response_hdrs(rep, 200, "text/html; charset=utf-8", extra, body, blen);
 }
 
-static void send_json(int fd, int code, const std::string &json)
+static void send_json(HttpReply &rep, int code, const std::string &json)
 {
-    send_response(fd, code, "application/json", json.c_str(), (int)json.size());
+    send_response(rep, code, "application/json", json.c_str(), (int)json.size());
 }
 
-static void send_sse_headers(int fd)
+static void send_sse_headers(HttpReply &rep)
 {
-    const char *hdr =
+    rep.data +=
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: text/event-stream\r\n"
         "Cache-Control: no-cache\r\n"
         "Connection: keep-alive\r\n"
         "Access-Control-Allow-Origin: *\r\n"
         "\r\n";
-    send(fd, hdr, strlen(hdr), 0);
 }
 
 /* ── tiny JSON field extractor ──────────────────────────── */
@@ -189,14 +303,205 @@ static std::string json_field(const char *json, const char *key)
     return std::string(p, e - p);
 }
 
+/* ── query strings ──────────────────────────────────────── */
+
+static std::string url_decode(const char *s, size_t n)
+{
+    std::string out;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '+') {
+            out += ' ';
+        } else if (s[i] == '%' && i + 2 < n &&
+                   isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2])) {
+            char hex[3] = { s[i + 1], s[i + 2], 0 };
+            out += (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+/* Value of `key` in the path's query string, decoded; "" if absent */
+static std::string query_param(const char *path, const char *key)
+{
+    const char *q = strchr(path, '?');
+    if (!q) return "";
+    size_t klen = strlen(key);
+    for (const char *p = q + 1; *p; ) {
+        const char *e = strchr(p, '&');
+        size_t      n = e ? (size_t)(e - p) : strlen(p);
+        if (n > klen && p[klen] == '=' && strncmp(p, key, klen) == 0)
+            return url_decode(p + klen + 1, n - klen - 1);
+        p += n + (e ? 1 : 0);
+    }
+    return "";
+}
+
+/* Mode changes start or stop whole modules; one at a time */
+static pthread_mutex_t mode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ── Files ──────────────────────────────────────────────── */
+
+/* An upload's spool file and the directory it has to itself */
+static void spool_discard(const char *file)
+{
+    unlink(file);
+    std::string dir(file);
+    dir.resize(dir.rfind('/'));
+    rmdir(dir.c_str());
+}
+
+/* Queue a send of a local file; options as in /api/file/send.  spool: path
+ * is an upload's spool file, deleted once the send is over */
+static void start_send(HttpReply &rep, const std::string &path, const std::string &to,
+                       bool direct, int streams, const std::string &dedup,
+                       const std::string &comp, const std::string &prio, bool spool = false)
+{
+    int xfer_id = client_send_file(path.c_str(), to.c_str(), direct ? 1 : 0, streams,
+                                   dedup == "true" ? 1 : dedup == "false" ? -1 : 0,
+                                   comp == "true" ? 1 : comp == "false" ? -1 : 0);
+    if (spool && (xfer_id < 0 || transfer_set_spool(xfer_id) < 0))
+        spool_discard(path.c_str());    /* failed, or already over */
+    if (xfer_id >= 0 && !prio.empty())
+        transfer_set_priority(xfer_id, prio == "high" ? XFER_PRIO_HIGH :
+                                       prio == "bulk" ? XFER_PRIO_BULK : XFER_PRIO_NORMAL);
+    if (xfer_id >= 0) {
+        send_json(rep, 200, "{\"ok\":true,\"id\":" + std::to_string(xfer_id) + "}");
+    } else {
+        send_json(rep, 400, "{\"error\":\"send failed\"}");
+    }
+}
+
+/* A received file, whole or one byte range of it.  The I/O thread copies
+ * the body from the file as the socket drains. */
+static void send_download(HttpReply &rep, const HttpReq *req, int xfer_id)
+{
+    char path[512];
+    if (transfer_saved_path(xfer_id, path, sizeof(path)) < 0) {
+        send_json(rep, 404, "{\"error\":\"no completed download with that id\"}");
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        send_json(rep, 404, "{\"error\":\"file is gone\"}");
+        return;
+    }
+    long long size = (long long)st.st_size;
+    long long from = 0, to = size - 1;
+    int       code = 200;
+
+    /* One range: bytes=a-b, bytes=a- or bytes=-n.  Lists are answered whole. */
+    if (strncmp(req->range, "bytes=", 6) == 0 && !strchr(req->range, ',')) {
+        const char *r    = req->range + 6;
+        char       *dash = NULL;
+        if (*r == '-') {
+            long long n = strtoll(r + 1, NULL, 10);
+            from = n < size ? size - n : 0;
+        } else {
+            from = strtoll(r, &dash, 10);
+            if (dash && *dash == '-' && dash[1]) to = strtoll(dash + 1, NULL, 10);
+            if (to >= size) to = size - 1;
+        }
+        if (from > to || from >= size) {
+            close(fd);
+            char extra[96];
+            snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n", size);
+            send_response_hdrs(rep, 416, "text/plain", extra, "", 0);
+            return;
+        }
+        code = 206;
+    }
+
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char extra[768];
+    int  n = snprintf(extra, sizeof(extra),
+                      "Accept-Ranges: bytes\r\n"
+                      "Content-Disposition: attachment; filename=\"%s\"\r\n",
+                      json_escape(base).c_str());
+    if (code == 206)
+        snprintf(extra + n, sizeof(extra) - n, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 from, to, size);
+    send_response_hdrs(rep, code, "application/octet-stream", extra, NULL, to - from + 1);
+
+    if (strcmp(req->method, "HEAD") == 0 || to < from) {
+        close(fd);
+        return;
+    }
+    rep.file_fd  = fd;
+    rep.file_off = from;
+    rep.file_end = to + 1;
+}
+
+/* ── Metrics ────────────────────────────────────────────── */
+
+static std::string prom_label(const char *s)
+{
+    std::string out;
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"') out += '\\';
+        if (*s == '\n') { out += "\\n"; continue; }
+        out += *s;
+    }
+    return out;
+}
+
+/* The process-wide metrics, then per-peer relay figures while serving */
+static void send_metrics(HttpReply &rep)
+{
+    /* Counters keep moving between the sizing pass and the real one: retry
+     * until the text fits, with some room for digits gained meanwhile */
+    std::string body;
+    size_t      len = metrics_format(NULL, 0);
+    do {
+        body.assign(len + 256, '\0');
+        len = metrics_format(&body[0], body.size());
+    } while (len >= body.size());
+    body.resize(len);
+
+    Peer peers[MAX_PEERS];
+    int  n = server_is_running() ? server_get_peers(peers, MAX_PEERS) : 0;
+    if (n > 0) {
+        body += "# HELP meshwave_relay_bytes_total Bytes the server read from or wrote to each peer\n"
+                "# TYPE meshwave_relay_bytes_total counter\n";
+        for (int i = 0; i < n; i++) {
+            std::string peer = prom_label(peers[i].name);
+            body += "meshwave_relay_bytes_total{peer=\"" + peer + "\",direction=\"in\"} "
+                  + std::to_string(peers[i].bytes_in) + "\n";
+            body += "meshwave_relay_bytes_total{peer=\"" + peer + "\",direction=\"out\"} "
+                  + std::to_string(peers[i].bytes_out) + "\n";
+        }
+        body += "# HELP meshwave_relay_queued_bytes Relay output waiting on each peer's socket\n"
+                "# TYPE meshwave_relay_queued_bytes gauge\n";
+        for (int i = 0; i < n; i++)
+            body += "meshwave_relay_queued_bytes{peer=\"" + prom_label(peers[i].name) + "\"} "
+                  + std::to_string(peers[i].queued_bytes) + "\n";
+        body += "# HELP meshwave_relay_dropped_chunks_total Chunks shed for each slow peer\n"
+                "# TYPE meshwave_relay_dropped_chunks_total counter\n";
+        for (int i = 0; i < n; i++)
+            body += "meshwave_relay_dropped_chunks_total{peer=\"" + prom_label(peers[i].name) + "\"} "
+                  + std::to_string(peers[i].dropped_pkts) + "\n";
+    }
+    send_response(rep, 200, "text/plain; version=0.0.4", body.data(), (int)body.size());
+}
+
 /* ── Route handling ─────────────────────────────────────── */
 
-static void handle_request(int fd, HttpReq *req)
+static void handle_request(HttpReq *req, HttpReply &rep)
 {
     /* GET / — serve dashboard */
     if (strcmp(req->method, "GET") == 0 && strcmp(req->path, "/") == 0) {
-        send_response(fd, 200, "text/html", index_html, (int)strlen(index_html));
-        close(fd);
+        send_index(rep, req);
+        return;
+    }
+
+    /* GET /metrics — Prometheus text exposition */
+    if (strcmp(req->method, "GET") == 0 && strcmp(req->path, "/metrics") == 0) {
+        send_metrics(rep);
         return;
     }
 
@@ -210,29 +515,75 @@ static void handle_request(int fd, HttpReq *req)
             if (i) json += ",";
             json += "{\"name\":\"" + json_escape(svs[i].name) +
                     "\",\"ip\":\"" + svs[i].ip +
-                    "\",\"port\":" + std::to_string(svs[i].port) + "}";
+                    "\",\"port\":" + std::to_string(svs[i].port) +
+                    ",\"load\":" + std::to_string(svs[i].load) +
+                    ",\"version\":" + std::to_string(svs[i].version) +
+                    ",\"relay_kbps\":" + std::to_string(svs[i].relay_kbps) +
+                    ",\"federated\":" + std::string(svs[i].caps & DISC_CAP_LINK ? "true" : "false") + "}";
         }
         json += "]";
-        send_json(fd, 200, json);
-        close(fd);
+        send_json(rep, 200, json);
         return;
     }
 
     /* GET /api/peers — connected peers (server mode) */
     if (strcmp(req->method, "GET") == 0 && strcmp(req->path, "/api/peers") == 0) {
-        Peer ps[MAX_PEERS];
-        int n = server_get_peers(ps, MAX_PEERS);
+        std::vector<Peer> ps(server_peer_count() + 16);
+        int n = server_get_peers(ps.data(), (int)ps.size());
 
         std::string json = "[";
         for (int i = 0; i < n; i++) {
             if (i) json += ",";
             json += "{\"name\":\"" + json_escape(ps[i].name) +
                     "\",\"addr\":\"" + ps[i].addr +
-                    "\",\"port\":" + std::to_string(ps[i].port) + "}";
+                    "\",\"port\":" + std::to_string(ps[i].port) +
+                    ",\"queued\":" + std::to_string(ps[i].queued_bytes) +
+                    ",\"dropped\":" + std::to_string(ps[i].dropped_pkts) +
+                    ",\"link\":" + std::string(ps[i].link ? "true" : "false") + "}";
         }
         json += "]";
-        send_json(fd, 200, json);
-        close(fd);
+        send_json(rep, 200, json);
+        return;
+    }
+
+    /* GET /api/history?peer=NAME[&before=ID][&limit=N] — chats to or from a
+     * client, newest first, from the server's message store.  `next` is the
+     * `before` for the following page, 0 on the last one. */
+    if (strcmp(req->method, "GET") == 0 && strncmp(req->path, "/api/history", 12) == 0 &&
+        (req->path[12] == '\0' || req->path[12] == '?')) {
+        std::string peer = query_param(req->path, "peer");
+        if (peer.empty()) {
+            send_json(rep, 400, "{\"error\":\"peer required\"}");
+            return;
+        }
+        if (!msgstore_is_open()) {
+            send_json(rep, 409, "{\"error\":\"no message store (server mode only)\"}");
+            return;
+        }
+
+        uint64_t before = strtoull(query_param(req->path, "before").c_str(), NULL, 10);
+        int      limit  = atoi(query_param(req->path, "limit").c_str());
+        if (limit <= 0) limit = 50;
+        if (limit > MSGSTORE_PAGE_MAX) limit = MSGSTORE_PAGE_MAX;
+
+        /* One more than asked tells whether another page follows */
+        std::vector<StoredMsg> ms((size_t)limit + 1);
+        int n    = msgstore_history(peer.c_str(), before, ms.data(), limit + 1);
+        int more = n > limit;
+        if (more) n = limit;
+
+        std::string json = "{\"messages\":[";
+        for (int i = 0; i < n; i++) {
+            if (i) json += ",";
+            json += "{\"id\":" + std::to_string(ms[i].id) +
+                    ",\"from\":\"" + json_escape(ms[i].from) +
+                    "\",\"to\":\"" + json_escape(ms[i].to) +
+                    "\",\"text\":\"" + json_escape(ms[i].text) +
+                    "\",\"ts\":" + std::to_string(ms[i].ts_ms) +
+                    ",\"pending\":" + std::string(ms[i].pending ? "true" : "false") + "}";
+        }
+        json += "],\"next\":" + std::to_string(more ? ms[n - 1].id : 0) + "}";
+        send_json(rep, 200, json);
         return;
     }
 
@@ -243,38 +594,41 @@ static void handle_request(int fd, HttpReq *req)
         json += ",\"client_connected\":" + std::string(client_is_connected() ? "true" : "false");
         json += ",\"username\":\"" + json_escape(client_get_username()) + "\"";
         json += "}";
-        send_json(fd, 200, json);
-        close(fd);
+        send_json(rep, 200, json);
         return;
     }
 
-    /* POST /api/mode — set mode {mode: "server"|"client", name: "...", ip: "...", port: N} */
+    /* POST /api/mode — set mode {mode: "server"|"client", name: "...", ip: "...", port: N};
+     * ip "auto" picks the least loaded discovered server */
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/mode") == 0) {
         std::string mode = json_field(req->body, "mode");
         std::string name = json_field(req->body, "name");
 
         if (mode == "server") {
             if (name.empty()) name = "MeshWave-Server";
+            pthread_mutex_lock(&mode_lock);
             server_start(name.c_str());
-            send_json(fd, 200, "{\"ok\":true,\"mode\":\"server\"}");
+            pthread_mutex_unlock(&mode_lock);
+            send_json(rep, 200, "{\"ok\":true,\"mode\":\"server\"}");
         } else if (mode == "client") {
             std::string ip   = json_field(req->body, "ip");
             std::string port = json_field(req->body, "port");
             if (name.empty()) name = "User";
-            if (ip.empty() || port.empty()) {
-                send_json(fd, 400, "{\"error\":\"ip and port required\"}");
-                close(fd);
+            if (ip.empty() || (port.empty() && ip != "auto")) {
+                send_json(rep, 400, "{\"error\":\"ip and port required\"}");
                 return;
             }
-            int rc = client_connect(ip.c_str(), (uint16_t)atoi(port.c_str()), name.c_str());
+            pthread_mutex_lock(&mode_lock);
+            int rc = ip == "auto" ? client_connect_auto(name.c_str())
+                                  : client_connect(ip.c_str(), (uint16_t)atoi(port.c_str()), name.c_str());
+            pthread_mutex_unlock(&mode_lock);
             if (rc == 0)
-                send_json(fd, 200, "{\"ok\":true,\"mode\":\"client\"}");
+                send_json(rep, 200, "{\"ok\":true,\"mode\":\"client\"}");
             else
-                send_json(fd, 400, "{\"error\":\"connection failed\"}");
+                send_json(rep, 400, "{\"error\":\"connection failed\"}");
         } else {
-            send_json(fd, 400, "{\"error\":\"mode must be server or client\"}");
+            send_json(rep, 400, "{\"error\":\"mode must be server or client\"}");
         }
-        close(fd);
         return;
     }
 
@@ -284,43 +638,77 @@ static void handle_request(int fd, HttpReq *req)
         std::string text = json_field(req->body, "text");
 
         if (to.empty() || text.empty()) {
-            send_json(fd, 400, "{\"error\":\"to and text required\"}");
-            close(fd);
+            send_json(rep, 400, "{\"error\":\"to and text required\"}");
             return;
         }
 
         int rc = client_send_chat(to.c_str(), text.c_str());
-        send_json(fd, rc == 0 ? 200 : 400,
+        send_json(rep, rc == 0 ? 200 : 400,
                   rc == 0 ? "{\"ok\":true}" : "{\"error\":\"send failed\"}");
-        close(fd);
+        return;
+    }
+
+    /* POST /api/room — join or leave a room {room, action: "join"|"leave"} */
+    if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/room") == 0) {
+        std::string room   = json_field(req->body, "room");
+        std::string action = json_field(req->body, "action");
+
+        if (room.empty() || (action != "join" && action != "leave")) {
+            send_json(rep, 400, "{\"error\":\"room and action (join|leave) required\"}");
+            return;
+        }
+        if (room[0] != ROOM_PREFIX) room.insert(room.begin(), ROOM_PREFIX);
+
+        int rc = client_join_room(room.c_str(), action == "join");
+        send_json(rep, rc == 0 ? 200 : 400,
+                  rc == 0 ? "{\"ok\":true}" : "{\"error\":\"room request failed\"}");
         return;
     }
 
     /* GET /api/events — SSE stream */
     if (strcmp(req->method, "GET") == 0 && strcmp(req->path, "/api/events") == 0) {
-        send_sse_headers(fd);
-        sse_add(fd);
-        return; /* fd stays open, managed by SSE system */
+        send_sse_headers(rep);
+        rep.sse = true;     /* the connection stays open for sse_broadcast */
+        return;
     }
 
-    /* POST /api/file/send — initiate file transfer {path, to} */
+    /* POST /api/file/send — initiate file transfer
+     * {path, to, direct?, streams?, dedup?, compress?, priority?} */
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/file/send") == 0) {
-        std::string path = json_field(req->body, "path");
-        std::string to   = json_field(req->body, "to");
+        std::string path    = json_field(req->body, "path");
+        std::string to      = json_field(req->body, "to");
+        bool        direct  = json_field(req->body, "direct") == "true";
+        int         streams = atoi(json_field(req->body, "streams").c_str());
+        std::string dedup   = json_field(req->body, "dedup");
+        std::string comp    = json_field(req->body, "compress");
+        std::string prio    = json_field(req->body, "priority");
 
         if (path.empty() || to.empty()) {
-            send_json(fd, 400, "{\"error\":\"path and to required\"}");
-            close(fd);
+            send_json(rep, 400, "{\"error\":\"path and to required\"}");
             return;
         }
 
-        int xfer_id = client_send_file(path.c_str(), to.c_str());
-        if (xfer_id >= 0) {
-            send_json(fd, 200, "{\"ok\":true,\"id\":" + std::to_string(xfer_id) + "}");
-        } else {
-            send_json(fd, 400, "{\"error\":\"send failed\"}");
-        }
-        close(fd);
+        start_send(rep, path, to, direct, streams, dedup, comp, prio);
+        return;
+    }
+
+    /* POST /api/file/upload?to=&name=[&direct=&streams=&dedup=&compress=&priority=]
+     * — the body (Content-Length or chunked) was spooled to a directory of
+     * its own under uploads/ by the I/O thread; send it on like
+     * /api/file/send, and delete it when the transfer is over */
+    if (req->upload) {
+        const char *p = req->path;
+        start_send(rep, req->upload_path, query_param(p, "to"),
+                   query_param(p, "direct") == "true", atoi(query_param(p, "streams").c_str()),
+                   query_param(p, "dedup"), query_param(p, "compress"), query_param(p, "priority"),
+                   true);
+        return;
+    }
+
+    /* GET /api/file/download/<id> — a received file, with Range support */
+    if ((strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0) &&
+        strncmp(req->path, "/api/file/download/", 19) == 0) {
+        send_download(rep, req, atoi(req->path + 19));
         return;
     }
 
@@ -328,14 +716,12 @@ static void handle_request(int fd, HttpReq *req)
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/file/pause") == 0) {
         std::string id_str = json_field(req->body, "id");
         if (id_str.empty()) {
-            send_json(fd, 400, "{\"error\":\"id required\"}");
-            close(fd);
+            send_json(rep, 400, "{\"error\":\"id required\"}");
             return;
         }
         int rc = client_pause_transfer(atoi(id_str.c_str()));
-        send_json(fd, rc == 0 ? 200 : 400,
+        send_json(rep, rc == 0 ? 200 : 400,
                   rc == 0 ? "{\"ok\":true}" : "{\"error\":\"pause failed\"}");
-        close(fd);
         return;
     }
 
@@ -343,21 +729,55 @@ static void handle_request(int fd, HttpReq *req)
     if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/file/resume") == 0) {
         std::string id_str = json_field(req->body, "id");
         if (id_str.empty()) {
-            send_json(fd, 400, "{\"error\":\"id required\"}");
-            close(fd);
+            send_json(rep, 400, "{\"error\":\"id required\"}");
             return;
         }
         int rc = client_resume_transfer(atoi(id_str.c_str()));
-        send_json(fd, rc == 0 ? 200 : 400,
+        send_json(rep, rc == 0 ? 200 : 400,
                   rc == 0 ? "{\"ok\":true}" : "{\"error\":\"resume failed\"}");
-        close(fd);
+        return;
+    }
+
+    /* POST /api/transfer/limit — change a send rate cap
+     * {rate, id?|peer?, fair?}: the transfer's (id 0: the default for new
+     * ones), the peer's ("*": the per-peer default), or the global cap;
+     * rate "0" lifts it */
+    if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/api/transfer/limit") == 0) {
+        std::string rate = json_field(req->body, "rate");
+        std::string id   = json_field(req->body, "id");
+        std::string peer = json_field(req->body, "peer");
+        std::string fair = json_field(req->body, "fair");
+        uint64_t    bps  = 0;
+
+        if (!fair.empty())
+            transfer_set_fair(fair == "true");
+        if (rate.empty() && fair.empty()) {
+            send_json(rep, 400, "{\"error\":\"rate or fair required\"}");
+            return;
+        }
+        if (!rate.empty() && rate_parse(rate.c_str(), &bps) < 0) {
+            send_json(rep, 400, "{\"error\":\"bad rate\"}");
+            return;
+        }
+
+        int rc = 0;
+        if (!rate.empty()) {
+            if (!id.empty())
+                rc = transfer_set_xfer_limit(atoi(id.c_str()), bps);
+            else if (!peer.empty())
+                rc = transfer_set_peer_limit(peer == "*" ? NULL : peer.c_str(), bps);
+            else
+                transfer_set_limit(bps);
+        }
+        send_json(rep, rc == 0 ? 200 : 400,
+                  rc == 0 ? "{\"ok\":true}" : "{\"error\":\"no such transfer\"}");
         return;
     }
 
     /* GET /api/transfers — status of all transfers */
     if (strcmp(req->method, "GET") == 0 && strcmp(req->path, "/api/transfers") == 0) {
-        Transfer ts[MAX_TRANSFERS];
-        int n = transfer_get_all(ts, MAX_TRANSFERS);
+        std::vector<Transfer> ts(transfer_count());
+        int n = transfer_get_all(ts.data(), (int)ts.size());
 
         const char *state_names[] = { "idle", "active", "paused", "done", "error" };
         std::string json = "[";
@@ -365,54 +785,516 @@ static void handle_request(int fd, HttpReq *req)
             if (i) json += ",";
             int pct = ts[i].total_chunks > 0
                 ? (int)(ts[i].done_chunks * 100 / ts[i].total_chunks) : 0;
+            char saved[512];
+            bool download = ts[i].state == XFER_DONE &&
+                            transfer_saved_path(ts[i].id, saved, sizeof(saved)) == 0;
             json += "{\"id\":" + std::to_string(ts[i].id)
                  + ",\"filename\":\"" + json_escape(ts[i].filename) + "\""
                  + ",\"peer\":\"" + json_escape(ts[i].peer) + "\""
                  + ",\"state\":\"" + state_names[ts[i].state] + "\""
                  + ",\"done\":" + std::to_string(ts[i].done_chunks)
                  + ",\"total\":" + std::to_string(ts[i].total_chunks)
-                 + ",\"percent\":" + std::to_string(pct) + "}";
+                 + ",\"percent\":" + std::to_string(pct)
+                 + ",\"size\":" + std::to_string(ts[i].file_size)
+                 + ",\"rate\":" + std::to_string(ts[i].state == XFER_ACTIVE ? ts[i].bytes_per_sec : 0)
+                 + ",\"direct\":" + (ts[i].direct ? "true" : "false")
+                 + ",\"download\":" + (download ? "true" : "false")
+                 + ",\"streams\":" + std::to_string(ts[i].streams ? ts[i].streams : 1) + "}";
         }
         json += "]";
-        send_json(fd, 200, json);
-        close(fd);
+        send_json(rep, 200, json);
         return;
     }
 
     /* OPTIONS for CORS preflight */
     if (strcmp(req->method, "OPTIONS") == 0) {
-        const char *hdr =
-            "HTTP/1.1 204 No Content\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-            "Access-Control-Allow-Headers: Content-Type\r\n"
-            "Connection: close\r\n\r\n";
-        send(fd, hdr, strlen(hdr), 0);
-        close(fd);
+        rep.data += "HTTP/1.1 204 No Content\r\n"
+                    "Access-Control-Allow-Origin: *\r\n"
+                    "Access-Control-Allow-Methods: GET, HEAD, POST, OPTIONS\r\n"
+                    "Access-Control-Allow-Headers: Content-Type, Range\r\n";
+        rep.data += rep.keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
         return;
     }
 
-    send_response(fd, 404, "text/plain", "Not Found", 9);
-    close(fd);
+    send_response(rep, 404, "text/plain", "Not Found", 9);
 }
 
-/* ── SSE event pump: drains client event queue ──────────── */
+/* ── Connections ────────────────────────────────────────── */
+
+/* Chunked upload decoding */
+enum { UP_BODY, UP_CHUNK_SIZE, UP_CHUNK_END, UP_TRAILER, UP_DONE };
+
+/* Owned by the I/O thread, except `req` and `rep` while a worker has it */
+struct HttpConn {
+    int         fd;
+    std::string rbuf;
+    std::string wbuf;
+    size_t      woff;
+    bool        busy;       /* a worker is answering req */
+    bool        sse;
+    bool        closing;    /* close once wbuf is written */
+    bool        dead;       /* closed; freed when no worker holds it */
+    bool        read_held;  /* rbuf is full: read again once the request ahead is answered */
+    long long   active_ms;  /* last byte in or out */
+    HttpReq     req;
+    HttpReply   rep;
+    HttpConn   *next;       /* job or done queue */
+
+    /* A download body still to come from a file */
+    int         file_fd;
+    long long   file_off, file_end;
+
+    /* An upload being spooled */
+    int         upload_fd;
+    int         upload_state;   /* UP_* */
+    long long   upload_left;    /* of the body or the current chunk */
+    char        spool[600];
+};
+
+static int            http_fd   = -1;
+static pthread_t      http_thread;
+static volatile int   http_running = 0;
+static Poller        *http_poller = NULL;
+static int            events_tag;   /* poller tag of the client event queue */
+
+static std::vector<HttpConn *> http_conns;  /* I/O thread only */
+static int            sse_count = 0;
+static unsigned       upload_seq = 0;  /* names each upload's spool directory */
 
-static pthread_t pump_thread;
-static volatile int pump_running = 0;
+/* Requests waiting for a worker, and answers waiting for the I/O thread */
+static pthread_t       workers[HTTP_WORKERS];
+static int             worker_count = 0;
+static HttpConn       *job_head = NULL, *job_tail = NULL;
+static HttpConn       *done_head = NULL;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_cond = PTHREAD_COND_INITIALIZER;
 
-static void *event_pump(void *arg)
+static void *http_worker(void *arg)
 {
     (void)arg;
-    while (pump_running) {
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        while (!job_head && http_running)
+            pthread_cond_wait(&job_cond, &job_lock);
+        HttpConn *c = job_head;
+        if (!c) { pthread_mutex_unlock(&job_lock); break; }
+        job_head = c->next;
+        if (!job_head) job_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        c->rep.data.clear();
+        c->rep.keep_alive = c->req.keep_alive;
+        c->rep.sse        = false;
+        c->rep.file_fd    = -1;
+        handle_request(&c->req, c->rep);
+        metrics_add(MET_HTTP_REQUESTS, 1);
+
+        pthread_mutex_lock(&job_lock);
+        c->next   = done_head;
+        done_head = c;
+        pthread_mutex_unlock(&job_lock);
+        poller_wake(http_poller);
+    }
+    return NULL;
+}
+
+static void queue_job(HttpConn *c)
+{
+    c->busy = true;
+    pthread_mutex_lock(&job_lock);
+    c->next = NULL;
+    if (job_tail) job_tail->next = c;
+    else          job_head = c;
+    job_tail = c;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+/* An upload cut short leaves nothing behind */
+static void upload_abort(HttpConn *c)
+{
+    if (c->upload_fd < 0) return;
+    close(c->upload_fd);
+    spool_discard(c->spool);
+    c->upload_fd = -1;
+}
+
+static void conn_close(HttpConn *c)
+{
+    if (c->dead) return;
+    c->dead = true;
+    poller_del(http_poller, c->fd);
+    close(c->fd);
+    if (c->sse) metrics_gauge_set(MET_SSE_SUBSCRIBERS, --sse_count);
+    metrics_gauge_add(MET_HTTP_CONNS, -1);
+    upload_abort(c);
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+}
+
+static void conn_dispatch(HttpConn *c);
+static void conn_resume(HttpConn *c);
+
+/* Write what the socket takes, reading more of a download body as it
+ * drains; a finished non-keep-alive reply closes */
+static void conn_flush(HttpConn *c)
+{
+    while (!c->dead) {
+        if (c->woff == c->wbuf.size()) {
+            if (c->file_fd < 0 || c->file_off >= c->file_end) break;
+            long long want = c->file_end - c->file_off;
+            if (want > HTTP_FILE_CHUNK) want = HTTP_FILE_CHUNK;
+            c->wbuf.resize((size_t)want);
+            c->woff = 0;
+            ssize_t r = pread(c->file_fd, &c->wbuf[0], (size_t)want, (off_t)c->file_off);
+            if (r <= 0) {
+                util_log(LOG_WARN, "http: download read failed: %s", r < 0 ? strerror(errno) : "file shrank");
+                conn_close(c);
+                return;
+            }
+            c->wbuf.resize((size_t)r);
+            c->file_off += r;
+            continue;
+        }
+        ssize_t n = send(c->fd, c->wbuf.data() + c->woff, c->wbuf.size() - c->woff, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->woff += (size_t)n;
+            c->active_ms = util_time_ms();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        conn_close(c);
+        return;
+    }
+    if (c->dead) return;
+    if (c->woff == c->wbuf.size()) {
+        c->wbuf.clear();
+        c->woff = 0;
+        if (c->file_fd >= 0) {
+            close(c->file_fd);
+            c->file_fd = -1;
+            if (!c->closing) {
+                conn_dispatch(c);       /* pipelined behind it */
+                conn_resume(c);
+            }
+        }
+        if (c->closing) conn_close(c);
+    } else if (c->file_fd < 0 && c->woff > HTTP_SSE_HWM) {
+        c->wbuf.erase(0, c->woff);
+        c->woff = 0;
+    }
+}
+
+static void conn_refuse(HttpConn *c, int code)
+{
+    HttpReply rep = { std::string(), false, false, -1, 0, 0 };
+    send_response(rep, code, "text/plain", status_text(code), (int)strlen(status_text(code)));
+    upload_abort(c);
+    c->wbuf += rep.data;
+    c->closing = true;
+    conn_flush(c);
+}
+
+/* Open the spool file for an upload whose headers just arrived */
+static int upload_begin(HttpConn *c)
+{
+    std::string name = query_param(c->req.path, "name");
+    if (query_param(c->req.path, "to").empty() || name.empty() || name[0] == '.' ||
+        name.find('/') != std::string::npos || name.size() > 200) {
+        conn_refuse(c, 400);
+        return -1;
+    }
+
+    /* uploads/<n>/<name>: the sender re-opens the file by path while it
+     * runs, so a later upload of the same name must not replace it */
+    char dir[64];
+    mkdir(HTTP_UPLOAD_DIR, 0755);
+    for (;;) {
+        snprintf(dir, sizeof(dir), "%s/%u", HTTP_UPLOAD_DIR, ++upload_seq);
+        if (mkdir(dir, 0755) == 0) break;
+        if (errno != EEXIST) {
+            util_log(LOG_ERROR, "http: upload %s: %s", dir, strerror(errno));
+            conn_refuse(c, 500);
+            return -1;
+        }
+    }
+    snprintf(c->spool, sizeof(c->spool), "%s/.%s.part", dir, name.c_str());
+    snprintf(c->req.upload_path, sizeof(c->req.upload_path), "%s/%s", dir, name.c_str());
+    c->upload_fd = open(c->spool, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c->upload_fd < 0) {
+        util_log(LOG_ERROR, "http: upload %s: %s", c->spool, strerror(errno));
+        rmdir(dir);
+        conn_refuse(c, 500);
+        return -1;
+    }
+
+    c->upload_state = c->req.chunked ? UP_CHUNK_SIZE : UP_BODY;
+    c->upload_left  = c->req.chunked ? 0 : c->req.upload_len;
+    if (c->req.expect_continue) {
+        c->wbuf += "HTTP/1.1 100 Continue\r\n\r\n";
+        conn_flush(c);
+    }
+    return 0;
+}
+
+/* Write what has arrived of the upload body to the spool file.  Once it
+ * is all there the file takes its name and the send goes to a worker. */
+static void upload_feed(HttpConn *c)
+{
+    size_t pos = 0;
+    while (c->upload_fd >= 0) {
+        if (c->upload_state == UP_BODY) {
+            size_t n = c->rbuf.size() - pos;
+            if ((long long)n > c->upload_left) n = (size_t)c->upload_left;
+            if (n == 0 && c->upload_left > 0) break;
+            size_t off = 0;
+            while (off < n) {
+                ssize_t w = write(c->upload_fd, c->rbuf.data() + pos + off, n - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) {
+                    util_log(LOG_ERROR, "http: upload %s: %s", c->spool, strerror(errno));
+                    conn_refuse(c, 500);
+                    return;
+                }
+                off += (size_t)w;
+            }
+            pos            += n;
+            c->upload_left -= (long long)n;
+            if (c->upload_left == 0)
+                c->upload_state = c->req.chunked ? UP_CHUNK_END : UP_DONE;
+        } else if (c->upload_state == UP_CHUNK_SIZE || c->upload_state == UP_TRAILER) {
+            size_t eol = c->rbuf.find("\r\n", pos);
+            if (eol == std::string::npos) {
+                if (c->rbuf.size() - pos > HTTP_HEADER_MAX) { conn_refuse(c, 400); return; }
+                break;
+            }
+            if (c->upload_state == UP_TRAILER) {
+                if (eol == pos) c->upload_state = UP_DONE;
+            } else {
+                char *end;
+                long long len = strtoll(c->rbuf.c_str() + pos, &end, 16);
+                if (end == c->rbuf.c_str() + pos || len < 0) { conn_refuse(c, 400); return; }
+                c->upload_left  = len;
+                c->upload_state = len ? UP_BODY : UP_TRAILER;
+            }
+            pos = eol + 2;
+        } else if (c->upload_state == UP_CHUNK_END) {
+            if (c->rbuf.size() - pos < 2) break;
+            if (c->rbuf.compare(pos, 2, "\r\n") != 0) { conn_refuse(c, 400); return; }
+            pos += 2;
+            c->upload_state = UP_CHUNK_SIZE;
+        } else {
+            close(c->upload_fd);
+            c->upload_fd = -1;
+            if (rename(c->spool, c->req.upload_path) < 0) {
+                util_log(LOG_ERROR, "http: upload %s: %s", c->req.upload_path, strerror(errno));
+                spool_discard(c->spool);
+                conn_refuse(c, 500);
+                return;
+            }
+            queue_job(c);
+        }
+    }
+    if (!c->dead) c->rbuf.erase(0, pos);
+}
+
+/* Hand the next complete request to a worker; one at a time per
+ * connection, so pipelined replies keep their order */
+static void conn_dispatch(HttpConn *c)
+{
+    if (c->dead || c->busy || c->sse || c->closing || c->file_fd >= 0) return;
+    if (c->upload_fd >= 0) {
+        upload_feed(c);
+        return;
+    }
+
+    int used = parse_request(c->rbuf, &c->req);
+    if (used == 0) return;
+    if (used < 0) {
+        conn_refuse(c, -used);
+        return;
+    }
+    c->rbuf.erase(0, (size_t)used);
+
+    if (c->req.upload) {
+        if (upload_begin(c) == 0) upload_feed(c);
+        return;
+    }
+    queue_job(c);
+}
+
+static void conn_read(HttpConn *c)
+{
+    static char buf[64 * 1024];     /* I/O thread only */
+    while (!c->dead) {
+        if (c->rbuf.size() > HTTP_HEADER_MAX + MAX_MSG) {
+            if (c->closing) {
+                c->rbuf.clear();    /* refused already: only wait for the close */
+            } else if (c->sse) {
+                conn_close(c);      /* a 413 has no place in the event stream */
+                return;
+            } else if (c->busy || c->file_fd >= 0) {
+                c->read_held = true;    /* the socket buffers the rest meanwhile */
+                return;
+            } else {
+                conn_refuse(c, 413);
+                return;
+            }
+        }
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c->rbuf.append(buf, (size_t)n);
+            c->active_ms = util_time_ms();
+            conn_dispatch(c);       /* keeps an upload's body flowing to disk */
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        conn_close(c);      /* EOF or hard error */
+        return;
+    }
+}
+
+/* Edge-triggered: nothing wakes a held read, so pick it up by hand once
+ * the request that held it is answered */
+static void conn_resume(HttpConn *c)
+{
+    if (!c->read_held || c->dead) return;
+    c->read_held = false;
+    conn_read(c);
+}
+
+/* Workers' answers go out from here */
+static void collect_replies(void)
+{
+    pthread_mutex_lock(&job_lock);
+    HttpConn *c = done_head;
+    done_head = NULL;
+    pthread_mutex_unlock(&job_lock);
+
+    while (c) {
+        HttpConn *next = c->next;
+        c->busy = false;
+        if (c->dead) {
+            if (c->rep.file_fd >= 0) close(c->rep.file_fd);
+        } else {
+            c->wbuf += c->rep.data;
+            c->file_fd  = c->rep.file_fd;
+            c->file_off = c->rep.file_off;
+            c->file_end = c->rep.file_end;
+            if (c->rep.sse) {
+                c->sse = true;
+                metrics_gauge_set(MET_SSE_SUBSCRIBERS, ++sse_count);
+            } else if (!c->rep.keep_alive) {
+                c->closing = true;
+            }
+            conn_flush(c);
+            conn_dispatch(c);
+            conn_resume(c);
+        }
+        c = next;
+    }
+}
+
+static void accept_all(void)
+{
+    for (;;) {
+        int cfd = accept(http_fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                util_log(LOG_WARN, "http accept: %s", strerror(errno));
+            return;
+        }
+        util_set_nonblocking(cfd);
+
+        HttpConn *c  = new HttpConn();
+        c->fd        = cfd;
+        c->file_fd   = -1;
+        c->upload_fd = -1;
+        c->active_ms = util_time_ms();
+        if (poller_add(http_poller, cfd, POLL_IN | POLL_OUT, c) < 0) {
+            close(cfd);
+            delete c;
+            continue;
+        }
+        http_conns.push_back(c);
+        metrics_gauge_add(MET_HTTP_CONNS, 1);
+    }
+}
+
+/* Close idle keep-alive connections, ping event streams so dead ones are
+ * noticed, and free what was closed */
+static void sweep_conns(void)
+{
+    long long now = util_time_ms();
+    for (size_t i = 0; i < http_conns.size(); ) {
+        HttpConn *c = http_conns[i];
+        if (!c->dead && !c->busy && now - c->active_ms > (c->sse ? HTTP_SSE_PING_MS : HTTP_IDLE_MS)) {
+            if (c->sse) {
+                c->wbuf += ":\n\n";
+                conn_flush(c);
+                c->active_ms = now;
+            } else if (c->wbuf.empty()) {
+                conn_close(c);
+            }
+        }
+        if (c->dead && !c->busy) {
+            http_conns[i] = http_conns.back();
+            http_conns.pop_back();
+            delete c;
+            continue;
+        }
+        i++;
+    }
+}
+
+/* ── SSE fan-out ────────────────────────────────────────── */
+
+/* Queue one event on every subscriber.  A subscriber that has fallen
+ * HTTP_SSE_HWM behind misses progress events until it catches up, and
+ * one HTTP_SSE_MAX behind is dropped (EventSource reconnects). */
+static void sse_broadcast(const char *event, const char *data, bool droppable)
+{
+    if (!sse_count) return;
+    metrics_add(MET_SSE_EVENTS, 1);
+    char buf[MAX_MSG + 1024];
+    int len = snprintf(buf, sizeof(buf), "event: %s\ndata: %s\n\n", event, data);
+    if (len >= (int)sizeof(buf)) len = (int)sizeof(buf) - 1;
+
+    for (HttpConn *c : http_conns) {
+        if (!c->sse || c->dead) continue;
+        size_t behind = c->wbuf.size() - c->woff;
+        if (behind > HTTP_SSE_MAX) {
+            util_log(LOG_WARN, "http: dropping an event stream %zu bytes behind", behind);
+            metrics_add(MET_SSE_DISCONNECTS, 1);
+            conn_close(c);
+            continue;
+        }
+        if (droppable && behind > HTTP_SSE_HWM) {
+            metrics_add(MET_SSE_SKIPPED, 1);
+            continue;
+        }
+        c->wbuf.append(buf, (size_t)len);
+        conn_flush(c);
+    }
+}
+
+/* Drain the client event queue; it re-arms its descriptor once empty */
+static void sse_pump(void)
+{
+    do {
         ChatEvent ev;
         while (client_poll_event(&ev)) {
             if (ev.type == EVT_CHAT) {
-                char json[MAX_MSG + 256];
-                snprintf(json, sizeof(json),
-                         "{\"from\":\"%s\",\"text\":\"%s\",\"ts\":%ld}",
-                         ev.from, ev.text, ev.timestamp);
-                sse_broadcast("chat", json);
+                std::string json = "{\"from\":\"" + json_escape(ev.from) +
+                                   "\",\"text\":\"" + json_escape(ev.text) +
+                                   "\",\"room\":\"" + json_escape(ev.room) +
+                                   "\",\"ts\":" + std::to_string(ev.timestamp) + "}";
+                sse_broadcast("chat", json.c_str(), false);
             } else {
                 const char *state_name = "active";
                 const char *event_name = "file_progress";
@@ -426,15 +1308,17 @@ static void *event_pump(void *arg)
                 char json[1024];
                 snprintf(json, sizeof(json),
                          "{\"id\":%d,\"filename\":\"%s\",\"peer\":\"%s\","
-                         "\"state\":\"%s\",\"done\":%u,\"total\":%u,\"percent\":%d}",
-                         ev.xfer_id, ev.filename, ev.from,
-                         state_name, ev.done_chunks, ev.total_chunks, pct);
-                sse_broadcast(event_name, json);
+                         "\"state\":\"%s\",\"done\":%u,\"total\":%u,\"percent\":%d,"
+                         "\"rate\":%llu,\"eta\":%lld}",
+                         ev.xfer_id, ev.text, ev.from,
+                         state_name, ev.done_chunks, ev.total_chunks, pct,
+                         (unsigned long long)ev.bytes_per_sec, (long long)ev.eta_s);
+                sse_broadcast(event_name, json, ev.type == EVT_FILE_PROGRESS &&
+                                                ev.xfer_state == XFER_ACTIVE);
             }
+            if (sse_count) metrics_observe(MET_SSE_LATENCY, util_time_us() - ev.queued_us);
         }
-        usleep(50000); /* 50ms */
-    }
-    return NULL;
+    } while (client_wait_event(0));
 }
 
 /* ── Main HTTP loop ─────────────────────────────────────── */
@@ -461,43 +1345,57 @@ static void *http_loop(void *arg)
         return NULL;
     }
 
-    listen(http_fd, 16);
+    listen(http_fd, SOMAXCONN);
+    util_set_nonblocking(http_fd);
+    poller_add(http_poller, http_fd, POLL_IN, &http_fd);
+    if (client_event_fd() >= 0)
+        poller_add(http_poller, client_event_fd(), POLL_IN, &events_tag);
     util_log(LOG_INFO, "http: serving on http://localhost:%d", port);
 
-    pump_running = 1;
-    pthread_create(&pump_thread, NULL, event_pump, NULL);
+    for (int i = 0; i < HTTP_WORKERS; i++)
+        if (pthread_create(&workers[worker_count], NULL, http_worker, NULL) == 0)
+            worker_count++;
 
+    sse_pump();
+    long long swept = util_time_ms();
     while (http_running) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(http_fd, &rfds);
-
-        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-        int ready = select(http_fd + 1, &rfds, NULL, NULL, &tv);
-        if (ready <= 0) continue;
-
-        struct sockaddr_in cli;
-        socklen_t clen = sizeof(cli);
-        int cfd = accept(http_fd, (struct sockaddr *)&cli, &clen);
-        if (cfd < 0) continue;
-
-        HttpReq req;
-        if (parse_request(cfd, &req) == 0) {
-            handle_request(cfd, &req);
-        } else {
-            close(cfd);
+        PollEvent evs[256];
+        int n = poller_wait(http_poller, evs, 256, 1000);
+        if (n < 0) break;
+
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data == &http_fd)    { accept_all(); continue; }
+            if (evs[i].data == &events_tag) { sse_pump();   continue; }
+
+            HttpConn *c = (HttpConn *)evs[i].data;
+            if (evs[i].events & POLL_OUT) conn_flush(c);
+            if (evs[i].events & (POLL_IN | POLL_ERR)) conn_read(c);
         }
-    }
+        collect_replies();
 
-    pump_running = 0;
-    pthread_join(pump_thread, NULL);
+        if (util_time_ms() - swept >= 1000) {
+            sweep_conns();
+            swept = util_time_ms();
+        }
+    }
 
-    pthread_mutex_lock(&sse_lock);
-    for (int i = 0; i < sse_count; i++)
-        close(sse_fds[i]);
-    sse_count = 0;
-    pthread_mutex_unlock(&sse_lock);
+    pthread_mutex_lock(&job_lock);
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i], NULL);
+    worker_count = 0;
+    collect_replies();
+
+    for (HttpConn *c : http_conns) {
+        conn_close(c);
+        delete c;
+    }
+    http_conns.clear();
 
+    if (client_event_fd() >= 0)
+        poller_del(http_poller, client_event_fd());
+    poller_del(http_poller, http_fd);
     close(http_fd);
     http_fd = -1;
     return NULL;
@@ -508,6 +1406,7 @@ static int saved_port;
 void http_start(int port)
 {
     if (http_running) return;
+    if (!http_poller && !(http_poller = poller_create())) return;
     http_running = 1;
     saved_port = port;
     pthread_create(&http_thread, NULL, http_loop, &saved_port);
@@ -517,5 +1416,6 @@ void http_stop(void)
 {
     if (!http_running) return;
     http_running = 0;
+    poller_wake(http_poller);
     pthread_join(http_thread, NULL);
 }
@@ -5,6 +5,15 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#define HTTP_WORKERS       4               /* threads answering API requests */
+#define HTTP_HEADER_MAX    8192            /* request line + headers */
+#define HTTP_IDLE_MS       30000           /* idle keep-alive connections close */
+#define HTTP_SSE_PING_MS   15000           /* comment line to quiet streams */
+#define HTTP_SSE_HWM       (64 * 1024)     /* queued bytes before progress is skipped */
+#define HTTP_SSE_MAX       (1024 * 1024)   /* queued bytes before a stream is dropped */
+#define HTTP_FILE_CHUNK    (256 * 1024)    /* download bytes read per refill */
+#define HTTP_UPLOAD_DIR    "uploads"       /* where uploaded files are kept to send */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -0,0 +1,315 @@
+/* logger.c
+ * Asynchronous logging behind util_log.  Each thread writes lines into its
+ * own single-producer ring; one logger thread merges the rings by time,
+ * adds the timestamp and level, and writes them to stderr or a file.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+int util_log_min = LOG_INFO;
+
+typedef struct {
+    long long real_us;      /* wall clock, for the timestamp and the merge */
+    uint8_t   level;
+    uint16_t  len;
+    char      msg[LOG_LINE_MAX];
+} LogLine;
+
+typedef struct LogRing {
+    _Alignas(64) _Atomic uint32_t head;     /* the owning thread's */
+    _Alignas(64) _Atomic uint32_t tail;     /* the logger thread's */
+    _Atomic uint32_t dropped;               /* lines lost to a full ring */
+    _Atomic int      orphaned;              /* owner exited; free once drained */
+    int              tid;
+    struct LogRing  *next;
+    LogLine          lines[LOG_RING_SLOTS];
+} LogRing;
+
+static LogRing        *rings     = NULL;    /* ring_lock */
+static int             ring_ids  = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   ring_key;
+static _Thread_local LogRing *my_ring = NULL;
+
+static FILE           *log_out   = NULL;    /* NULL: stderr */
+static int             log_json  = 0;
+static pthread_mutex_t out_lock  = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t  log_once  = PTHREAD_ONCE_INIT;
+static pthread_t       log_thread;
+static int             log_started = 0;
+static atomic_int      log_stopping;
+static atomic_int      log_closed;
+static atomic_int      log_sleeping;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *level_name(int level)
+{
+    switch (level) {
+        case LOG_DEBUG: return "DEBUG";
+        case LOG_INFO:  return "INFO";
+        case LOG_WARN:  return "WARN";
+        case LOG_ERROR: return "ERROR";
+        default:        return "???";
+    }
+}
+
+int util_log_parse_level(const char *name, LogLevel *out)
+{
+    static const LogLevel levels[] = { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(name, level_name(levels[i])) == 0) {
+            *out = levels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* ── Formatting (logger thread, or anyone once it has stopped) ── */
+
+static void write_line(const LogLine *l, int tid)
+{
+    FILE  *f   = log_out ? log_out : stderr;
+    time_t sec = (time_t)(l->real_us / 1000000);
+    int    ms  = (int)(l->real_us / 1000 % 1000);
+
+    if (log_json) {
+        char   esc[LOG_LINE_MAX * 6 + 1];
+        size_t n = 0;
+        for (int i = 0; i < l->len; i++) {
+            unsigned char c = (unsigned char)l->msg[i];
+            if (c == '"' || c == '\\') {
+                esc[n++] = '\\';
+                esc[n++] = (char)c;
+            } else if (c < 0x20) {
+                n += (size_t)snprintf(esc + n, sizeof(esc) - n, "\\u%04x", c);
+            } else {
+                esc[n++] = (char)c;
+            }
+        }
+        esc[n] = '\0';
+        fprintf(f, "{\"ts\":%lld.%03d,\"level\":\"%s\",\"thread\":%d,\"msg\":\"%s\"}\n",
+                (long long)sec, ms, level_name(l->level), tid, esc);
+        return;
+    }
+
+    /* localtime_r takes a lock of its own; most lines share the second */
+    static time_t    last_sec = -1;
+    static struct tm tm;
+    if (sec != last_sec) {
+        localtime_r(&sec, &tm);
+        last_sec = sec;
+    }
+    fprintf(f, "[%02d:%02d:%02d.%03d] [%s] %.*s\n",
+            tm.tm_hour, tm.tm_min, tm.tm_sec, ms, level_name(l->level), l->len, l->msg);
+}
+
+static void fill_line(LogLine *l, LogLevel level, const char *fmt, va_list ap)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    l->real_us = (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    l->level   = (uint8_t)level;
+
+    int n = vsnprintf(l->msg, sizeof(l->msg), fmt, ap);
+    if (n < 0) n = 0;
+    if (n >= (int)sizeof(l->msg)) n = (int)sizeof(l->msg) - 1;
+    l->len = (uint16_t)n;
+}
+
+/* ── Logger thread ── */
+
+/* Write out everything queued, oldest line first across rings.  Returns
+ * the number of lines written. */
+static int drain(void)
+{
+    int written = 0;
+    pthread_mutex_lock(&ring_lock);
+    pthread_mutex_lock(&out_lock);
+    for (;;) {
+        LogRing *best = NULL;
+        for (LogRing *r = rings; r; r = r->next) {
+            uint32_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            if (atomic_load_explicit(&r->head, memory_order_acquire) == t) continue;
+            if (!best || r->lines[t % LOG_RING_SLOTS].real_us <
+                         best->lines[atomic_load_explicit(&best->tail, memory_order_relaxed) % LOG_RING_SLOTS].real_us)
+                best = r;
+        }
+        if (!best) break;
+
+        uint32_t t = atomic_load_explicit(&best->tail, memory_order_relaxed);
+        write_line(&best->lines[t % LOG_RING_SLOTS], best->tid);
+        atomic_store_explicit(&best->tail, t + 1, memory_order_release);
+        written++;
+    }
+
+    /* Report losses, and free the rings of threads that have exited */
+    for (LogRing **pp = &rings; *pp; ) {
+        LogRing *r = *pp;
+        uint32_t lost = atomic_exchange(&r->dropped, 0);
+        if (lost) {
+            LogLine l;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            l.real_us = (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+            l.level   = LOG_WARN;
+            l.len     = (uint16_t)snprintf(l.msg, sizeof(l.msg), "log: %u lines dropped", lost);
+            write_line(&l, r->tid);
+        }
+        if (atomic_load(&r->orphaned) &&
+            atomic_load(&r->head) == atomic_load(&r->tail)) {
+            *pp = r->next;
+            free(r);
+            continue;
+        }
+        pp = &r->next;
+    }
+    fflush(log_out ? log_out : stderr);
+    pthread_mutex_unlock(&out_lock);
+    pthread_mutex_unlock(&ring_lock);
+    return written;
+}
+
+static int pending(void)
+{
+    int any = 0;
+    pthread_mutex_lock(&ring_lock);
+    for (LogRing *r = rings; r && !any; r = r->next)
+        any = atomic_load(&r->head) != atomic_load(&r->tail);
+    pthread_mutex_unlock(&ring_lock);
+    return any;
+}
+
+static void *log_loop(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        if (drain() > 0) continue;
+        if (atomic_load(&log_stopping)) break;
+
+        /* Producers signal only while log_sleeping is set, so check once
+         * more after setting it; otherwise wake every LOG_FLUSH_MS */
+        pthread_mutex_lock(&wake_lock);
+        atomic_store(&log_sleeping, 1);
+        if (!pending() && !atomic_load(&log_stopping)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+        }
+        atomic_store(&log_sleeping, 0);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+static void ring_release(void *p)
+{
+    atomic_store(&((LogRing *)p)->orphaned, 1);
+}
+
+static void log_start(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+    if (pthread_create(&log_thread, NULL, log_loop, NULL) == 0) {
+        log_started = 1;
+        atexit(util_log_close);
+    } else {
+        atomic_store(&log_closed, 1);
+    }
+}
+
+static LogRing *ring_attach(void)
+{
+    LogRing *r = (LogRing *)calloc(1, sizeof(LogRing));
+    if (!r) return NULL;
+    pthread_mutex_lock(&ring_lock);
+    r->tid  = ++ring_ids;
+    r->next = rings;
+    rings   = r;
+    pthread_mutex_unlock(&ring_lock);
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+/* ── Public ── */
+
+void util_log_write(LogLevel level, const char *fmt, ...)
+{
+    pthread_once(&log_once, log_start);
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    LogRing *r = my_ring;
+    if (!r && !atomic_load(&log_closed)) r = ring_attach();
+    if (!r || atomic_load(&log_closed)) {
+        LogLine l;
+        fill_line(&l, level, fmt, ap);
+        va_end(ap);
+        pthread_mutex_lock(&out_lock);
+        write_line(&l, r ? r->tid : 0);
+        fflush(log_out ? log_out : stderr);
+        pthread_mutex_unlock(&out_lock);
+        return;
+    }
+
+    uint32_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        va_end(ap);
+        return;
+    }
+    fill_line(&r->lines[h % LOG_RING_SLOTS], level, fmt, ap);
+    va_end(ap);
+    atomic_store(&r->head, h + 1);
+
+    /* Routine lines wait for the next tick; warnings, and a ring filling
+     * up, wake the logger now */
+    if ((level >= LOG_WARN || h + 1 - atomic_load(&r->tail) >= LOG_RING_SLOTS / 2) &&
+        atomic_load(&log_sleeping)) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+int util_log_open(const char *path, int json)
+{
+    FILE *f = NULL;
+    if (path && !(f = fopen(path, "a"))) return -1;
+
+    pthread_mutex_lock(&out_lock);
+    if (log_out) fclose(log_out);
+    log_out  = f;
+    log_json = json;
+    pthread_mutex_unlock(&out_lock);
+    return 0;
+}
+
+void util_log_close(void)
+{
+    pthread_once(&log_once, log_start);
+    if (!log_started || atomic_exchange(&log_stopping, 1)) return;
+
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(log_thread, NULL);
+
+    atomic_store(&log_closed, 1);
+    drain();    /* anything that raced in before the flag went up */
+}
@@ -6,10 +6,13 @@
 extern "C" {
 #include "discovery.h"
 #include "server.h"
+#include "msgstore.h"
 #include "client.h"
 #include "transfer.h"
+#include "ratelimit.h"
 #include "util.h"
 }
+#include "bench.h"
 #include "http.h"
 #include "protocol.h"
 
@@ -17,6 +20,7 @@ extern "C" {
 #include <cstdlib>
 #include <cstring>
 #include <csignal>
+#include <cerrno>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -44,10 +48,49 @@ static void print_usage(const char *prog)
 {
     printf("Usage: %s [options]\n", prog);
     printf("  --server NAME     Start directly as server\n");
-    printf("  --client IP       Start directly as client connecting to IP\n");
+    printf("  --client IP       Start directly as client connecting to IP, or \"auto\"\n");
+    printf("                    for the least loaded server discovered\n");
     printf("  --name NAME       Set username (client mode, default: User)\n");
     printf("  --port PORT       HTTP port (default: %d)\n", HTTP_PORT);
+    printf("  --data-port PORT  TCP data port to serve or connect to (default: %d)\n", DATA_PORT);
+    printf("  --federate        Server: link with other federating servers on the LAN\n");
+    printf("  --history PATH    Server: keep chats for away clients in PATH (default: %s)\n",
+           MSGSTORE_FILE);
+    printf("  --no-history      Server: keep no chat history\n");
+    printf("  --chunk-size KB   Chunk size for outgoing files (default: auto, max %d)\n", CHUNK_SIZE_MAX / 1024);
+    printf("  --window N        Initial chunks in flight per transfer (default: %d)\n", XFER_WINDOW_INIT);
+    printf("  --window-max N    Upper bound for the adaptive window (default: %d)\n", XFER_WINDOW_MAX);
+    printf("  --send-io MODE    pread, mmap or sendfile for outgoing chunks (default: %s)\n",
+#ifdef __linux__
+           "sendfile");
+#else
+           "pread");
+#endif
+    printf("  --fsync-mb N      Flush received files to disk every N MB (default: 0, on completion)\n");
+    printf("  --streams N       Connections per direct transfer (default: 1, max %d)\n", XFER_STREAMS_MAX);
+    printf("  --dedup           Cut outgoing files by content so re-sends skip known chunks\n");
+    printf("  --compress        Deflate outgoing chunks unless the data doesn't shrink\n");
+    printf("  --limit RATE      Cap on all outgoing transfers together, e.g. 20M (bytes/s)\n");
+    printf("  --peer-limit RATE Cap on the transfers to each peer\n");
+    printf("  --xfer-limit RATE Cap on each outgoing transfer\n");
+    printf("  --fair            Share a cap evenly between the transfers it holds back\n");
+    printf("  --progress-ms N   Report transfer progress at most every N ms (default: %d)\n", XFER_PROGRESS_MS);
+    printf("  --progress-pct N  ... or every N percent of the file (default: off)\n");
+    printf("  --queue-max MB    Relay output queued per peer before it counts as slow (default: %d)\n",
+           PEER_QUEUE_HWM / (1024 * 1024));
+    printf("  --slow-peer MODE  drop, or disconnect peers stalled over the limit (default: drop)\n");
+    printf("  --log-level LEVEL debug, info, warn or error (default: info)\n");
+    printf("  --log-file PATH   Append log lines to PATH instead of stderr\n");
+    printf("  --log-json        Write each log line as a JSON object\n");
     printf("  --no-browser      Don't auto-open browser\n");
+    printf("  --bench           Run the benchmark below on loopback and print JSON\n");
+    printf("  --bench-sizes L   File sizes, one round each (default: %s)\n", BENCH_SIZES);
+    printf("  --bench-parallel N Transfers started together per round (default: %d)\n", BENCH_PARALLEL);
+    printf("  --bench-direct    Send peer to peer instead of through the relay\n");
+    printf("  --bench-chat N    Chat messages sent (default: %d)\n", BENCH_CHAT_MSGS);
+    printf("  --bench-chat-rate N  ... per second, 0 for unpaced (default: %d)\n", BENCH_CHAT_RATE);
+    printf("  --bench-sse N     Event streams on the receiver (default: %d)\n", BENCH_SSE_SUBS);
+    printf("  --bench-out PATH  Write the JSON report to PATH instead of stdout\n");
     printf("  -h, --help        Show this help\n");
 }
 
@@ -58,7 +101,30 @@ int main(int argc, char *argv[])
     const char *client_ip    = NULL;
     const char *user_name    = "User";
     int         http_port    = HTTP_PORT;
+    int         data_port    = DATA_PORT;
+    int         federate     = 0;
+    const char *history      = MSGSTORE_FILE;
     int         no_browser   = 0;
+    int         window_init  = XFER_WINDOW_INIT;
+    int         window_max   = XFER_WINDOW_MAX;
+    int         streams      = 1;
+    const char *send_io      = NULL;
+    long        fsync_mb     = 0;
+    long        queue_max_mb = PEER_QUEUE_HWM / (1024 * 1024);
+    int         drop_slow    = 1;
+    int         chunk_kb     = 0;
+    int         dedup        = 0;
+    int         compress     = 0;
+    int         fair         = 0;
+    int         progress_ms  = XFER_PROGRESS_MS;
+    int         progress_pct = 0;
+    const char *limits[3]    = { NULL, NULL, NULL };  /* total, per peer, per transfer */
+    const char *log_level    = NULL;
+    const char *log_file     = NULL;
+    int         log_json     = 0;
+    int         bench        = 0;
+    BenchConfig bench_cfg    = { BENCH_SIZES, BENCH_PARALLEL, 0, BENCH_CHAT_MSGS,
+                                 BENCH_CHAT_RATE, BENCH_SSE_SUBS, NULL, HTTP_PORT };
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
@@ -71,6 +137,68 @@ int main(int argc, char *argv[])
             user_name = argv[++i];
         } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
             http_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--data-port") == 0 && i + 1 < argc) {
+            data_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--federate") == 0) {
+            federate = 1;
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            history = argv[++i];
+        } else if (strcmp(argv[i], "--no-history") == 0) {
+            history = NULL;
+        } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+            chunk_kb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window_init = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--window-max") == 0 && i + 1 < argc) {
+            window_max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--send-io") == 0 && i + 1 < argc) {
+            send_io = argv[++i];
+        } else if (strcmp(argv[i], "--fsync-mb") == 0 && i + 1 < argc) {
+            fsync_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--streams") == 0 && i + 1 < argc) {
+            streams = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limits[0] = argv[++i];
+        } else if (strcmp(argv[i], "--peer-limit") == 0 && i + 1 < argc) {
+            limits[1] = argv[++i];
+        } else if (strcmp(argv[i], "--xfer-limit") == 0 && i + 1 < argc) {
+            limits[2] = argv[++i];
+        } else if (strcmp(argv[i], "--fair") == 0) {
+            fair = 1;
+        } else if (strcmp(argv[i], "--progress-ms") == 0 && i + 1 < argc) {
+            progress_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--progress-pct") == 0 && i + 1 < argc) {
+            progress_pct = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--queue-max") == 0 && i + 1 < argc) {
+            queue_max_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--slow-peer") == 0 && i + 1 < argc) {
+            drop_slow = strcmp(argv[++i], "disconnect") != 0;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level = argv[++i];
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (strcmp(argv[i], "--log-json") == 0) {
+            log_json = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--bench-sizes") == 0 && i + 1 < argc) {
+            bench_cfg.sizes = argv[++i];
+        } else if (strcmp(argv[i], "--bench-parallel") == 0 && i + 1 < argc) {
+            bench_cfg.parallel = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-direct") == 0) {
+            bench_cfg.direct = 1;
+        } else if (strcmp(argv[i], "--bench-chat") == 0 && i + 1 < argc) {
+            bench_cfg.chat_msgs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-chat-rate") == 0 && i + 1 < argc) {
+            bench_cfg.chat_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-sse") == 0 && i + 1 < argc) {
+            bench_cfg.sse_subs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) {
+            bench_cfg.out = argv[++i];
         } else if (strcmp(argv[i], "--no-browser") == 0) {
             no_browser = 1;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -81,19 +209,77 @@ int main(int argc, char *argv[])
 
     signal(SIGINT,  on_signal);
     signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (log_level) {
+        LogLevel lv;
+        if (util_log_parse_level(log_level, &lv) < 0) {
+            util_log(LOG_ERROR, "bad log level \"%s\"", log_level);
+            return 1;
+        }
+        util_log_min = lv;
+    }
+    if ((log_file || log_json) && util_log_open(log_file, log_json) < 0) {
+        util_log(LOG_ERROR, "cannot open log file %s: %s", log_file, strerror(errno));
+        return 1;
+    }
+
+    if (bench) {
+        /* Transfer options go to the clients; only the relay runs here */
+        bench_cfg.http_port = http_port;
+        server_set_queue_limit((size_t)queue_max_mb * 1024 * 1024,
+                               drop_slow ? SLOW_PEER_DROP : SLOW_PEER_DISCONNECT);
+        int rc = bench_run(&bench_cfg, argc, argv);
+        util_log_close();
+        return rc;
+    }
 
     util_log(LOG_INFO, "MeshWave starting...");
 
     mkdir("downloads", 0755);
-    transfer_init(NULL);
+    transfer_init(client_on_transfer);
+    transfer_set_window(window_init, window_max);
+    transfer_set_streams(streams);
+    transfer_set_dedup(dedup);
+    transfer_set_compress(compress);
+    transfer_set_fair(fair);
+    transfer_set_progress(progress_ms, progress_pct);
+    for (int i = 0; i < 3; i++) {
+        uint64_t bps = 0;
+        if (!limits[i]) continue;
+        if (rate_parse(limits[i], &bps) < 0) {
+            util_log(LOG_ERROR, "bad rate \"%s\"", limits[i]);
+            return 1;
+        }
+        if (i == 0)      transfer_set_limit(bps);
+        else if (i == 1) transfer_set_peer_limit(NULL, bps);
+        else             transfer_set_xfer_limit(0, bps);
+    }
+    if (fsync_mb > 0)
+        transfer_set_sync_every((uint64_t)fsync_mb * 1024 * 1024);
+    if (send_io)
+        transfer_set_send_io(strcmp(send_io, "mmap") == 0     ? XFER_IO_MMAP :
+                             strcmp(send_io, "sendfile") == 0 ? XFER_IO_SENDFILE :
+                                                                XFER_IO_PREAD);
+    server_set_queue_limit((size_t)queue_max_mb * 1024 * 1024,
+                           drop_slow ? SLOW_PEER_DROP : SLOW_PEER_DISCONNECT);
+    if (chunk_kb > 0)
+        transfer_set_chunk_size((uint32_t)chunk_kb * 1024);
 
     http_start(http_port);
 
+    server_set_data_port((uint16_t)data_port);
+    server_set_federate(federate);
+    server_set_history(history);
+
     if (mode_flag && strcmp(mode_flag, "server") == 0) {
         server_start(server_name);
     } else if (mode_flag && strcmp(mode_flag, "client") == 0) {
         discovery_start_scan();
-        client_connect(client_ip, DATA_PORT, user_name);
+        if (strcmp(client_ip, "auto") == 0)
+            client_connect_auto(user_name);
+        else
+            client_connect(client_ip, (uint16_t)data_port, user_name);
     } else {
         discovery_start_scan();
     }
@@ -115,5 +301,6 @@ int main(int argc, char *argv[])
     http_stop();
 
     util_log(LOG_INFO, "Goodbye.");
+    util_log_close();
     return 0;
 }
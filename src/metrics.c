@@ -0,0 +1,135 @@
+/* metrics.c
+ * Atomic counters and log2 histograms behind metrics.h.
+ */
+
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/* Each value on its own cache line: counters bumped from different
+ * threads must not share one */
+typedef struct {
+    _Alignas(64) _Atomic uint64_t v;
+} Cell;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum_us;
+} Hist;
+
+static Cell counters[MET_COUNTER_COUNT];
+static Cell gauges[MET_GAUGE_COUNT];
+static Hist hists[MET_HIST_COUNT];
+
+static const struct { const char *name, *help; } counter_info[MET_COUNTER_COUNT] = {
+    [MET_CHUNKS_SENT]          = { "meshwave_chunks_sent_total",          "File chunks put on the wire, resends included" },
+    [MET_CHUNK_BYTES_SENT]     = { "meshwave_chunk_bytes_sent_total",     "Chunk payload bytes put on the wire" },
+    [MET_CHUNKS_RETRIED]       = { "meshwave_chunks_retried_total",       "Chunks sent again after a NACK or timeout" },
+    [MET_CHUNKS_NACKED]        = { "meshwave_chunks_nacked_total",        "NACKs received for sent chunks" },
+    [MET_CHUNKS_TIMED_OUT]     = { "meshwave_chunks_timed_out_total",     "Chunks whose retransmit timer fired" },
+    [MET_CHUNKS_RECEIVED]      = { "meshwave_chunks_received_total",      "File chunks written to disk" },
+    [MET_CHUNK_BYTES_RECEIVED] = { "meshwave_chunk_bytes_received_total", "Chunk bytes written to disk" },
+    [MET_RELAY_PACKETS]        = { "meshwave_relay_packets_total",        "Packets the server has taken from peers" },
+    [MET_RELAY_BYTES]          = { "meshwave_relay_bytes_written_total",  "Bytes the server has written to peers" },
+    [MET_EVENTS_DROPPED]       = { "meshwave_events_dropped_total",       "Dashboard events lost to a full event queue" },
+    [MET_SSE_EVENTS]           = { "meshwave_sse_events_total",           "Events fanned out to SSE subscribers" },
+    [MET_SSE_SKIPPED]          = { "meshwave_sse_skipped_total",          "Progress events skipped for a lagging subscriber" },
+    [MET_SSE_DISCONNECTS]      = { "meshwave_sse_disconnects_total",      "Subscribers dropped for falling too far behind" },
+    [MET_HTTP_REQUESTS]        = { "meshwave_http_requests_total",        "HTTP requests answered" },
+    [MET_POOL_REUSED]          = { "meshwave_pool_reused_total",          "Buffers handed out again from a pool free list" },
+    [MET_POOL_ALLOCATED]       = { "meshwave_pool_allocated_total",       "Buffers the pool had to malloc" },
+};
+
+static const struct { const char *name, *help; } gauge_info[MET_GAUGE_COUNT] = {
+    [MET_SEND_QUEUED]     = { "meshwave_send_queue_depth",  "Outgoing transfers waiting for a send worker" },
+    [MET_SENDS_ACTIVE]    = { "meshwave_sends_active",      "Outgoing transfers on a send worker" },
+    [MET_HTTP_CONNS]      = { "meshwave_http_connections",  "Open HTTP connections" },
+    [MET_SSE_SUBSCRIBERS] = { "meshwave_sse_subscribers",   "Open SSE event streams" },
+};
+
+static const struct { const char *name, *help; } hist_info[MET_HIST_COUNT] = {
+    [MET_ACK_RTT]     = { "meshwave_ack_rtt_seconds",    "Chunk send to ACK, first transmissions only" },
+    [MET_DISK_WRITE]  = { "meshwave_disk_write_seconds", "Writing one received chunk" },
+    [MET_SSE_LATENCY] = { "meshwave_sse_latency_seconds", "Event queued to written to every SSE subscriber" },
+};
+
+void metrics_add(MetricCounter c, uint64_t n)
+{
+    atomic_fetch_add_explicit(&counters[c].v, n, memory_order_relaxed);
+}
+
+uint64_t metrics_counter(MetricCounter c)
+{
+    return atomic_load_explicit(&counters[c].v, memory_order_relaxed);
+}
+
+void metrics_gauge_add(MetricGauge g, int64_t delta)
+{
+    atomic_fetch_add_explicit(&gauges[g].v, (uint64_t)delta, memory_order_relaxed);
+}
+
+void metrics_gauge_set(MetricGauge g, int64_t value)
+{
+    atomic_store_explicit(&gauges[g].v, (uint64_t)value, memory_order_relaxed);
+}
+
+/* Bucket i holds samples up to 2^i us; the last one the rest */
+void metrics_observe(MetricHist h, long long us)
+{
+    if (us < 0) us = 0;
+    int i = 0;
+    while (i < METRICS_BUCKETS && us > (1LL << i)) i++;
+    atomic_fetch_add_explicit(&hists[h].buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hists[h].sum_us, (uint64_t)us, memory_order_relaxed);
+}
+
+typedef struct {
+    char  *buf;
+    size_t len, used;
+} Out;
+
+static void put(Out *o, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = o->used < o->len ? o->len - o->used : 0;
+    int n = vsnprintf(o->buf ? o->buf + o->used : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->used += (size_t)n;
+}
+
+size_t metrics_format(char *buf, size_t len)
+{
+    Out o = { buf, len, 0 };
+    if (buf && len) buf[0] = '\0';
+
+    for (int i = 0; i < MET_COUNTER_COUNT; i++)
+        put(&o, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            counter_info[i].name, counter_info[i].help, counter_info[i].name, counter_info[i].name,
+            (unsigned long long)atomic_load_explicit(&counters[i].v, memory_order_relaxed));
+
+    for (int i = 0; i < MET_GAUGE_COUNT; i++)
+        put(&o, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+            gauge_info[i].name, gauge_info[i].help, gauge_info[i].name, gauge_info[i].name,
+            (long long)atomic_load_explicit(&gauges[i].v, memory_order_relaxed));
+
+    for (int i = 0; i < MET_HIST_COUNT; i++) {
+        const char *name = hist_info[i].name;
+        put(&o, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_info[i].help, name);
+        uint64_t total = 0;
+        for (int b = 0; b <= METRICS_BUCKETS; b++) {
+            total += atomic_load_explicit(&hists[i].buckets[b], memory_order_relaxed);
+            if (b < METRICS_BUCKETS)
+                put(&o, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1LL << b) / 1e6,
+                    (unsigned long long)total);
+            else
+                put(&o, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+        }
+        put(&o, "%s_sum %.6f\n%s_count %llu\n", name,
+            (double)atomic_load_explicit(&hists[i].sum_us, memory_order_relaxed) / 1e6,
+            name, (unsigned long long)total);
+    }
+    return o.used;
+}
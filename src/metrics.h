@@ -0,0 +1,68 @@
+/* metrics.h
+ * Process-wide counters, gauges and latency histograms, rendered in the
+ * Prometheus text format for GET /metrics.  Every update is one relaxed
+ * atomic add, so hot paths can call these from any thread.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_BUCKETS     22      /* bounds 1 us .. ~2 s in powers of two, then +Inf */
+
+typedef enum {
+    MET_CHUNKS_SENT,
+    MET_CHUNK_BYTES_SENT,
+    MET_CHUNKS_RETRIED,
+    MET_CHUNKS_NACKED,
+    MET_CHUNKS_TIMED_OUT,
+    MET_CHUNKS_RECEIVED,
+    MET_CHUNK_BYTES_RECEIVED,
+    MET_RELAY_PACKETS,
+    MET_RELAY_BYTES,
+    MET_EVENTS_DROPPED,
+    MET_SSE_EVENTS,
+    MET_SSE_SKIPPED,
+    MET_SSE_DISCONNECTS,
+    MET_HTTP_REQUESTS,
+    MET_POOL_REUSED,
+    MET_POOL_ALLOCATED,
+    MET_COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+    MET_SEND_QUEUED,        /* outgoing transfers waiting for a worker */
+    MET_SENDS_ACTIVE,
+    MET_HTTP_CONNS,
+    MET_SSE_SUBSCRIBERS,
+    MET_GAUGE_COUNT
+} MetricGauge;
+
+typedef enum {
+    MET_ACK_RTT,            /* chunk sent to its ACK, first sends only */
+    MET_DISK_WRITE,         /* one received chunk's pwrite */
+    MET_SSE_LATENCY,        /* event queued to written to every subscriber */
+    MET_HIST_COUNT
+} MetricHist;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void   metrics_add(MetricCounter c, uint64_t n);
+void   metrics_gauge_add(MetricGauge g, int64_t delta);
+void   metrics_gauge_set(MetricGauge g, int64_t value);
+void   metrics_observe(MetricHist h, long long us);
+uint64_t metrics_counter(MetricCounter c);
+
+/* Write the exposition of everything above into buf; returns the length
+ * it needed, like snprintf */
+size_t metrics_format(char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
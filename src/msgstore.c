@@ -0,0 +1,468 @@
+/* msgstore.c
+ * One fixed-size segment file mapped shared: a header, then records laid
+ * end to end as a ring.  A record is complete before the header's head
+ * moves past it, so a crash loses at most the message being written.  When
+ * the ring is full the oldest records are overwritten.
+ *
+ * RAM holds only the index: per name, the ids and offsets of its newest
+ * MSGSTORE_DEPTH messages in id order.  Replay and history read records
+ * through the map, so neither scans the log; only msgstore_open walks it,
+ * to rebuild the index.
+ */
+
+#include "msgstore.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC    "MWLOG01"
+#define STORE_DATA     64           /* records start after the header */
+#define REC_PENDING    0x01
+
+typedef struct {
+    char     magic[8];
+    uint32_t size;          /* of the whole file */
+    uint32_t head;          /* where the next record goes */
+    uint32_t tail;          /* oldest record */
+    uint32_t count;         /* records held */
+    uint64_t next_id;
+} StoreHdr;
+
+/* Then "from\0to\0text", padded to 8 bytes */
+typedef struct {
+    uint32_t len;           /* whole record; 0 marks where the ring wrapped */
+    uint16_t text_len;
+    uint8_t  from_len;      /* without the NULs */
+    uint8_t  to_len;
+    uint64_t id;
+    int64_t  ts_ms;
+    uint32_t flags;
+    uint32_t reserved;
+    char     strs[];
+} StoreRec;
+
+typedef struct {
+    uint64_t id;
+    uint32_t off;
+} Ref;
+
+/* One name's messages, either direction: a ring of refs, oldest at head.
+ * Open addressing keyed by name; an empty name is a free slot. */
+typedef struct {
+    char  name[MAX_NAME];
+    Ref  *refs;
+    int   head, count, cap;
+    int   pending;          /* messages waiting for it; may overcount after overwrites */
+    int   known;            /* connected at some point */
+} Thread;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static char           *store_map = NULL;
+static StoreHdr       *store_hdr = NULL;
+static Thread         *threads = NULL;
+static int             thread_cap = 0;
+static int             thread_count = 0;
+static int             threads_full_warned = 0;
+
+/* ── Index ───────────────────────────────────────────────── */
+
+static unsigned thread_home(const char *name)
+{
+    unsigned h = 2166136261u;
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    return h & (unsigned)(thread_cap - 1);
+}
+
+static Thread *thread_get(const char *name, int create)
+{
+    if (!name[0] || strlen(name) >= MAX_NAME) return NULL;
+    if (thread_count > 0) {
+        for (unsigned i = thread_home(name); threads[i].name[0]; i = (i + 1) & (thread_cap - 1))
+            if (strcmp(threads[i].name, name) == 0) return &threads[i];
+    }
+    if (!create) return NULL;
+
+    if (thread_count == MSGSTORE_NAMES) {
+        if (!threads_full_warned++)
+            util_log(LOG_WARN, "msgstore: %d names indexed, not storing for more", MSGSTORE_NAMES);
+        return NULL;
+    }
+    if ((thread_count + 1) * 2 > thread_cap) {
+        int     ocap = thread_cap;
+        Thread *old  = threads;
+        int     ncap = ocap ? ocap * 2 : 64;
+        Thread *n    = (Thread *)calloc(ncap, sizeof(Thread));
+        if (!n) return NULL;
+
+        threads    = n;
+        thread_cap = ncap;
+        for (int i = 0; i < ocap; i++) {
+            if (!old[i].name[0]) continue;
+            unsigned j = thread_home(old[i].name);
+            while (n[j].name[0]) j = (j + 1) & (ncap - 1);
+            n[j] = old[i];
+        }
+        free(old);
+    }
+
+    unsigned i = thread_home(name);
+    while (threads[i].name[0]) i = (i + 1) & (thread_cap - 1);
+    snprintf(threads[i].name, MAX_NAME, "%s", name);
+    thread_count++;
+    return &threads[i];
+}
+
+/* Both ends of a message; creating the second may move the first */
+static void thread_pair(const char *from, const char *to, Thread **tf, Thread **tt)
+{
+    thread_get(from, 1);
+    thread_get(to, 1);
+    *tf = thread_get(from, 0);
+    *tt = thread_get(to, 0);
+}
+
+static void threads_clear(void)
+{
+    for (int i = 0; i < thread_cap; i++)
+        free(threads[i].refs);
+    free(threads);
+    threads      = NULL;
+    thread_cap   = 0;
+    thread_count = 0;
+}
+
+static Ref *thread_ref(Thread *t, int i)
+{
+    return &t->refs[(t->head + i) % t->cap];
+}
+
+static uint64_t store_oldest(void);
+
+/* Append a ref; past MSGSTORE_DEPTH the oldest one goes */
+static void thread_push(Thread *t, uint64_t id, uint32_t off)
+{
+    uint64_t oldest = store_oldest();
+    while (t->count > 0 && thread_ref(t, 0)->id < oldest) {
+        t->head = (t->head + 1) % t->cap;
+        t->count--;
+    }
+
+    if (t->count == t->cap && t->cap < MSGSTORE_DEPTH) {
+        int  ncap = t->cap ? t->cap * 2 : 16;
+        Ref *n    = (Ref *)malloc(ncap * sizeof(Ref));
+        if (!n) return;
+        for (int i = 0; i < t->count; i++)
+            n[i] = *thread_ref(t, i);
+        free(t->refs);
+        t->refs = n;
+        t->cap  = ncap;
+        t->head = 0;
+    }
+    if (t->count == t->cap) {
+        t->head = (t->head + 1) % t->cap;
+        t->count--;
+    }
+    Ref *r = thread_ref(t, t->count++);
+    r->id  = id;
+    r->off = off;
+}
+
+/* ── Segment ─────────────────────────────────────────────── */
+
+static StoreRec *rec_at(uint32_t off)
+{
+    return (StoreRec *)(store_map + off);
+}
+
+/* Nothing more this lap: too little room left for a record, or a marker */
+static int store_wraps(uint32_t off)
+{
+    return store_hdr->size - off < sizeof(StoreRec) || rec_at(off)->len == 0;
+}
+
+static uint64_t store_oldest(void)
+{
+    return store_hdr->count ? rec_at(store_hdr->tail)->id : store_hdr->next_id;
+}
+
+static const StoreRec *ref_rec(const Ref *r, uint64_t oldest)
+{
+    if (r->id < oldest || r->id >= store_hdr->next_id) return NULL;
+    const StoreRec *rec = rec_at(r->off);
+    return rec->id == r->id ? rec : NULL;
+}
+
+static void store_evict(void)
+{
+    StoreHdr *h = store_hdr;
+    h->tail += rec_at(h->tail)->len;
+    h->count--;
+    if (h->count > 0 && store_wraps(h->tail)) h->tail = STORE_DATA;
+}
+
+/* Offset with `need` free bytes at the head, overwriting the oldest
+ * records to make them.  The live records are [tail, head) within one lap,
+ * or [tail, end) + [STORE_DATA, head) once the head has wrapped. */
+static uint32_t store_reserve(uint32_t need)
+{
+    StoreHdr *h = store_hdr;
+    for (;;) {
+        if (h->count == 0) h->head = h->tail = STORE_DATA;
+        if (h->count == 0 || h->tail < h->head) {
+            if (h->head + need <= h->size) return h->head;
+            if (h->size - h->head >= sizeof(uint32_t))
+                memset(store_map + h->head, 0, sizeof(uint32_t));
+            h->head = STORE_DATA;
+            continue;
+        }
+        if (h->head + need <= h->tail) return h->head;
+        store_evict();
+    }
+}
+
+static void store_reset(void)
+{
+    memset(store_map, 0, STORE_DATA);
+    memcpy(store_hdr->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    store_hdr->size    = MSGSTORE_BYTES;
+    store_hdr->head    = STORE_DATA;
+    store_hdr->tail    = STORE_DATA;
+    store_hdr->count   = 0;
+    store_hdr->next_id = 1;
+}
+
+static int rec_valid(uint32_t off, uint64_t id)
+{
+    const StoreRec *r = rec_at(off);
+    if (r->len < sizeof(StoreRec) || r->len % 8 || r->len > store_hdr->size - off) return 0;
+    if (r->id != id || r->from_len >= MAX_NAME || r->to_len >= MAX_NAME || r->text_len > MAX_MSG)
+        return 0;
+    if (sizeof(StoreRec) + r->from_len + r->to_len + 2u + r->text_len > r->len) return 0;
+    return r->strs[r->from_len] == '\0' && r->strs[r->from_len + 1 + r->to_len] == '\0';
+}
+
+static void rec_copy(const StoreRec *r, StoredMsg *m)
+{
+    const char *p = r->strs;
+    m->id      = r->id;
+    m->ts_ms   = r->ts_ms;
+    m->pending = (r->flags & REC_PENDING) != 0;
+    memcpy(m->from, p, r->from_len + 1u);
+    p += r->from_len + 1;
+    memcpy(m->to, p, r->to_len + 1u);
+    p += r->to_len + 1;
+    memcpy(m->text, p, r->text_len);
+    m->text[r->text_len] = '\0';
+}
+
+/* Reindex what a previous run left; 0 if the segment doesn't hold up */
+static int store_rebuild(void)
+{
+    StoreHdr *h = store_hdr;
+    if (memcmp(h->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0 || h->size != MSGSTORE_BYTES ||
+        h->head < STORE_DATA || h->head > h->size || h->tail < STORE_DATA || h->tail > h->size ||
+        h->count > h->size / sizeof(StoreRec) || h->next_id < (uint64_t)h->count + 1)
+        return 0;
+
+    uint32_t off = h->tail;
+    uint64_t id  = h->next_id - h->count;
+    for (uint32_t k = 0; k < h->count; k++, id++) {
+        if (k > 0 && store_wraps(off)) off = STORE_DATA;
+        if (!rec_valid(off, id)) return 0;
+
+        const StoreRec *r  = rec_at(off);
+        const char     *to = r->strs + r->from_len + 1;
+        Thread         *tf, *tt;
+        thread_pair(r->strs, to, &tf, &tt);
+        if (tf) {
+            tf->known = 1;
+            thread_push(tf, id, off);
+        }
+        if (tt && tt != tf) thread_push(tt, id, off);
+        if (tt && (r->flags & REC_PENDING)) tt->pending++;
+        else if (tt)                        tt->known = 1;
+        off += r->len;
+    }
+    return h->count == 0 || off == h->head;
+}
+
+/* ── API ─────────────────────────────────────────────────── */
+
+int msgstore_open(const char *path)
+{
+    pthread_mutex_lock(&store_lock);
+    if (store_map) { pthread_mutex_unlock(&store_lock); return 0; }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        util_log(LOG_ERROR, "msgstore: cannot open %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+    int fresh = st.st_size != MSGSTORE_BYTES;
+    if (fresh && ftruncate(fd, MSGSTORE_BYTES) < 0) {
+        util_log(LOG_ERROR, "msgstore: cannot size %s: %s", path, strerror(errno));
+        close(fd);
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+
+    void *map = mmap(NULL, MSGSTORE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        util_log(LOG_ERROR, "msgstore: mmap %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+    store_map = (char *)map;
+    store_hdr = (StoreHdr *)map;
+
+    if (fresh || !store_rebuild()) {
+        if (!fresh) util_log(LOG_WARN, "msgstore: %s is damaged, starting it over", path);
+        threads_clear();
+        store_reset();
+    }
+    util_log(LOG_INFO, "msgstore: %s holds %u messages for %d names",
+             path, store_hdr->count, thread_count);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+void msgstore_close(void)
+{
+    pthread_mutex_lock(&store_lock);
+    if (store_map) {
+        msync(store_map, MSGSTORE_BYTES, MS_ASYNC);
+        munmap(store_map, MSGSTORE_BYTES);
+    }
+    store_map = NULL;
+    store_hdr = NULL;
+    threads_clear();
+    threads_full_warned = 0;
+    pthread_mutex_unlock(&store_lock);
+}
+
+int msgstore_is_open(void)
+{
+    pthread_mutex_lock(&store_lock);
+    int open = store_map != NULL;
+    pthread_mutex_unlock(&store_lock);
+    return open;
+}
+
+void msgstore_touch(const char *name)
+{
+    pthread_mutex_lock(&store_lock);
+    Thread *t = store_map ? thread_get(name, 1) : NULL;
+    if (t) t->known = 1;
+    pthread_mutex_unlock(&store_lock);
+}
+
+int msgstore_known(const char *name)
+{
+    pthread_mutex_lock(&store_lock);
+    Thread *t = store_map ? thread_get(name, 0) : NULL;
+    int known = t && t->known;
+    pthread_mutex_unlock(&store_lock);
+    return known;
+}
+
+uint64_t msgstore_append(const char *from, const char *to, const char *text,
+                         uint32_t text_len, int pending)
+{
+    if (text_len > MAX_MSG) text_len = MAX_MSG;
+
+    pthread_mutex_lock(&store_lock);
+    Thread *tf = NULL, *tt = NULL;
+    if (store_map) thread_pair(from, to, &tf, &tt);
+    if (!tf || !tt) { pthread_mutex_unlock(&store_lock); return 0; }
+
+    uint32_t fl   = (uint32_t)strlen(from), tl = (uint32_t)strlen(to);
+    uint32_t need = ((uint32_t)sizeof(StoreRec) + fl + tl + 2 + text_len + 7) & ~7u;
+    uint32_t off  = store_reserve(need);
+
+    StoreRec *r = rec_at(off);
+    memset(r, 0, sizeof(StoreRec));
+    r->len      = need;
+    r->text_len = (uint16_t)text_len;
+    r->from_len = (uint8_t)fl;
+    r->to_len   = (uint8_t)tl;
+    r->id       = store_hdr->next_id;
+    r->ts_ms    = util_time_ms();
+    r->flags    = pending ? REC_PENDING : 0;
+    memcpy(r->strs, from, fl + 1);
+    memcpy(r->strs + fl + 1, to, tl + 1);
+    memcpy(r->strs + fl + tl + 2, text, text_len);
+
+    /* The record is whole before the header owns it */
+    uint64_t id = r->id;
+    store_hdr->head = off + need;
+    store_hdr->count++;
+    store_hdr->next_id++;
+
+    thread_push(tf, id, off);
+    if (tt != tf) thread_push(tt, id, off);
+    if (pending) tt->pending++;
+    pthread_mutex_unlock(&store_lock);
+    return id;
+}
+
+int msgstore_replay(const char *name, void (*fn)(const StoredMsg *m, void *arg), void *arg)
+{
+    StoredMsg m;
+    int       n = 0;
+
+    pthread_mutex_lock(&store_lock);
+    Thread *t = store_map ? thread_get(name, 0) : NULL;
+    if (t && t->pending > 0) {
+        uint64_t oldest = store_oldest();
+        for (int i = 0; i < t->count; i++) {
+            StoreRec *r = (StoreRec *)ref_rec(thread_ref(t, i), oldest);
+            if (!r || !(r->flags & REC_PENDING) || strcmp(r->strs + r->from_len + 1, name) != 0)
+                continue;
+            rec_copy(r, &m);
+            fn(&m, arg);
+            r->flags &= ~(uint32_t)REC_PENDING;
+            n++;
+        }
+        t->pending = 0;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return n;
+}
+
+int msgstore_history(const char *name, uint64_t before, StoredMsg *out, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&store_lock);
+    Thread *t = store_map ? thread_get(name, 0) : NULL;
+    if (t) {
+        /* First ref at or past `before`; the page is what precedes it */
+        int lo = before ? 0 : t->count, hi = t->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (thread_ref(t, mid)->id < before) lo = mid + 1;
+            else                                 hi = mid;
+        }
+
+        uint64_t oldest = store_oldest();
+        for (int i = lo - 1; i >= 0 && n < max; i--) {
+            const StoreRec *r = ref_rec(thread_ref(t, i), oldest);
+            if (!r) break;      /* overwritten, and so is everything older */
+            rec_copy(r, &out[n++]);
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+    return n;
+}
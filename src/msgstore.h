@@ -0,0 +1,60 @@
+/* msgstore.h
+ * The server's chat log: direct messages appended to a memory-mapped ring
+ * file, indexed by the names on both ends.  Messages for a client that is
+ * offline wait in it and are replayed when that name says HELLO again.
+ * Called from the server thread; history reads may come from any thread.
+ */
+
+#ifndef MSGSTORE_H
+#define MSGSTORE_H
+
+#include "protocol.h"
+
+#include <stdint.h>
+
+#define MSGSTORE_FILE     "messages.mwlog"  /* in the working directory */
+#define MSGSTORE_BYTES    (8 * 1024 * 1024) /* segment size; the oldest records are overwritten */
+#define MSGSTORE_DEPTH    512               /* newest messages indexed per name */
+#define MSGSTORE_NAMES    4096              /* names indexed; later ones aren't stored */
+#define MSGSTORE_PAGE_MAX 200               /* messages per history page */
+
+typedef struct {
+    uint64_t id;            /* increasing, from 1 */
+    int64_t  ts_ms;         /* wall clock when the server took it */
+    int      pending;       /* not delivered to `to` yet */
+    char     from[MAX_NAME];
+    char     to[MAX_NAME];
+    char     text[MAX_MSG + 1];
+} StoredMsg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Map path, creating it or rebuilding the index from what it holds.
+ * Returns -1 and leaves the store off if it can't. */
+int  msgstore_open(const char *path);
+void msgstore_close(void);
+int  msgstore_is_open(void);
+
+/* A client called `name` connected: later chats to it are kept while it's away */
+void msgstore_touch(const char *name);
+int  msgstore_known(const char *name);
+
+/* Log one chat; pending marks it for replay.  Returns its id, 0 if not stored. */
+uint64_t msgstore_append(const char *from, const char *to, const char *text,
+                         uint32_t text_len, int pending);
+
+/* Hand every pending message for `name` to fn, oldest first, and mark it
+ * delivered.  Returns how many there were. */
+int  msgstore_replay(const char *name, void (*fn)(const StoredMsg *m, void *arg), void *arg);
+
+/* Up to max messages to or from `name` with ids below `before` (0: the
+ * newest), newest first.  Walks the name's index only. */
+int  msgstore_history(const char *name, uint64_t before, StoredMsg *out, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MSGSTORE_H */
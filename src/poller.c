@@ -0,0 +1,230 @@
+/* poller.c
+ * epoll / kqueue backends behind one small interface.
+ * A self-pipe registered in every poller implements poller_wake().
+ */
+
+#include "poller.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define POLLER_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define POLLER_KQUEUE 1
+#else
+#error "poller: no epoll or kqueue on this platform"
+#endif
+
+#define POLLER_BATCH 256
+
+struct Poller {
+    int fd;
+    int wake_rd;
+    int wake_wr;
+};
+
+static void drain_wake(Poller *p)
+{
+    char buf[64];
+    while (read(p->wake_rd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+void poller_wake(Poller *p)
+{
+    char c = 1;
+    ssize_t n = write(p->wake_wr, &c, 1);
+    (void)n;    /* pipe full means a wake is already pending */
+}
+
+/* ── epoll ────────────────────────────────────────────────── */
+#ifdef POLLER_EPOLL
+
+static uint32_t to_epoll(unsigned events)
+{
+    uint32_t ev = EPOLLET | EPOLLRDHUP;
+    if (events & POLL_IN)  ev |= EPOLLIN;
+    if (events & POLL_OUT) ev |= EPOLLOUT;
+    return ev;
+}
+
+static int os_create(void)
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int os_ctl(Poller *p, int op, int fd, unsigned events, void *data)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = to_epoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(p->fd, op, fd, &ev);
+}
+
+int poller_add(Poller *p, int fd, unsigned events, void *data)
+{
+    return os_ctl(p, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int poller_mod(Poller *p, int fd, unsigned events, void *data)
+{
+    return os_ctl(p, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int poller_del(Poller *p, int fd)
+{
+    struct epoll_event ev;
+    return epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int poller_wait(Poller *p, PollEvent *out, int max, int timeout_ms)
+{
+    struct epoll_event evs[POLLER_BATCH];
+    if (max > POLLER_BATCH) max = POLLER_BATCH;
+
+    int n = epoll_wait(p->fd, evs, max, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+
+    int got = 0;
+    for (int i = 0; i < n; i++) {
+        if (evs[i].data.ptr == p) { drain_wake(p); continue; }
+
+        unsigned e = 0;
+        if (evs[i].events & (EPOLLIN | EPOLLRDHUP)) e |= POLL_IN;
+        if (evs[i].events & EPOLLOUT)               e |= POLL_OUT;
+        if (evs[i].events & (EPOLLERR | EPOLLHUP))  e |= POLL_ERR | POLL_IN;
+        out[got].events = e;
+        out[got].data   = evs[i].data.ptr;
+        got++;
+    }
+    return got;
+}
+
+#endif /* POLLER_EPOLL */
+
+/* ── kqueue ───────────────────────────────────────────────── */
+#ifdef POLLER_KQUEUE
+
+static int os_create(void)
+{
+    return kqueue();
+}
+
+/* kqueue tracks read and write as separate filters; EV_CLEAR makes both
+ * edge-triggered.  Deleting a filter that was never added is harmless. */
+static int os_ctl(Poller *p, int fd, unsigned events, void *data, int adding)
+{
+    struct kevent ch[2];
+    int n = 0;
+
+    if (events & POLL_IN)
+        EV_SET(&ch[n++], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, data);
+    else if (!adding)
+        EV_SET(&ch[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    if (events & POLL_OUT)
+        EV_SET(&ch[n++], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, data);
+    else if (!adding)
+        EV_SET(&ch[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    for (int i = 0; i < n; i++) {
+        if (kevent(p->fd, &ch[i], 1, NULL, 0, NULL) < 0 &&
+            !(ch[i].flags & EV_DELETE))
+            return -1;
+    }
+    return 0;
+}
+
+int poller_add(Poller *p, int fd, unsigned events, void *data)
+{
+    return os_ctl(p, fd, events, data, 1);
+}
+
+int poller_mod(Poller *p, int fd, unsigned events, void *data)
+{
+    return os_ctl(p, fd, events, data, 0);
+}
+
+int poller_del(Poller *p, int fd)
+{
+    return os_ctl(p, fd, 0, NULL, 0);
+}
+
+int poller_wait(Poller *p, PollEvent *out, int max, int timeout_ms)
+{
+    struct kevent evs[POLLER_BATCH];
+    if (max > POLLER_BATCH) max = POLLER_BATCH;
+
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    int n = kevent(p->fd, NULL, 0, evs, max, tsp);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+
+    int got = 0;
+    for (int i = 0; i < n; i++) {
+        if (evs[i].udata == (void *)p) { drain_wake(p); continue; }
+
+        unsigned e = 0;
+        if (evs[i].filter == EVFILT_READ)  e |= POLL_IN;
+        if (evs[i].filter == EVFILT_WRITE) e |= POLL_OUT;
+        if (evs[i].flags & EV_ERROR)       e |= POLL_ERR | POLL_IN;
+        if (evs[i].flags & EV_EOF)         e |= POLL_IN;
+        out[got].events = e;
+        out[got].data   = evs[i].udata;
+        got++;
+    }
+    return got;
+}
+
+#endif /* POLLER_KQUEUE */
+
+/* ── common ───────────────────────────────────────────────── */
+
+Poller *poller_create(void)
+{
+    Poller *p = (Poller *)calloc(1, sizeof(Poller));
+    if (!p) return NULL;
+
+    int pipefd[2];
+    p->fd = os_create();
+    if (p->fd < 0 || pipe(pipefd) < 0) {
+        util_log(LOG_ERROR, "poller: create failed: %s", strerror(errno));
+        if (p->fd >= 0) close(p->fd);
+        free(p);
+        return NULL;
+    }
+
+    p->wake_rd = pipefd[0];
+    p->wake_wr = pipefd[1];
+    util_set_nonblocking(p->wake_rd);
+    util_set_nonblocking(p->wake_wr);
+    fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+
+    /* The poller itself is the wake pipe's tag; see poller_wait */
+    poller_add(p, p->wake_rd, POLL_IN, p);
+    return p;
+}
+
+void poller_destroy(Poller *p)
+{
+    if (!p) return;
+    close(p->wake_rd);
+    close(p->wake_wr);
+    close(p->fd);
+    free(p);
+}
@@ -0,0 +1,43 @@
+/* poller.h
+ * Edge-triggered readiness notification: epoll on Linux, kqueue on BSD/macOS.
+ */
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#define POLL_IN   0x1
+#define POLL_OUT  0x2
+#define POLL_ERR  0x4   /* error or hangup; drain reads, then close */
+
+typedef struct Poller Poller;
+
+typedef struct {
+    unsigned  events;   /* POLL_* bits that fired */
+    void     *data;     /* as passed to poller_add */
+} PollEvent;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+Poller *poller_create(void);
+void    poller_destroy(Poller *p);
+
+/* Registration is edge-triggered: an event fires when readiness changes,
+ * so handlers must read/write until EAGAIN before waiting again. */
+int     poller_add(Poller *p, int fd, unsigned events, void *data);
+int     poller_mod(Poller *p, int fd, unsigned events, void *data);
+int     poller_del(Poller *p, int fd);
+
+/* Returns the number of events stored in `out` (0 on timeout or wake),
+ * -1 on error.  timeout_ms < 0 blocks indefinitely. */
+int     poller_wait(Poller *p, PollEvent *out, int max, int timeout_ms);
+
+/* Make a blocked poller_wait return early; safe from any thread. */
+void    poller_wake(Poller *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POLLER_H */
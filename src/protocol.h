@@ -17,7 +17,13 @@ typedef enum {
     MSG_FILE_NACK  = 0x06,
     MSG_PAUSE      = 0x07,
     MSG_RESUME     = 0x08,
-    MSG_BYE        = 0x09
+    MSG_BYE        = 0x09,
+    MSG_FILE_HAVE  = 0x0A,     /* receiver -> sender: chunks kept from before */
+    MSG_FILE_MANIFEST = 0x0B,  /* sender -> receiver: content-defined chunk list */
+    MSG_PEER_JOIN  = 0x0C,     /* server <-> server link: these clients are here */
+    MSG_PEER_LEAVE = 0x0D,     /* server <-> server link: these clients left */
+    MSG_ROOM_JOIN  = 0x0E,     /* client -> server: add me to a room */
+    MSG_ROOM_LEAVE = 0x0F      /* client -> server: take me out of it */
 } MsgType;
 
 typedef enum {
@@ -34,24 +40,76 @@ typedef enum {
     MODE_CLIENT
 } RunMode;
 
+#define PROTO_V1       1
+#define PROTO_V2       2
+#define PROTO_VERSION  PROTO_V2
+
+/* Original 7-byte header, host byte order.  Every connection starts with a
+ * v1-framed MSG_HELLO; see wire.c for the v2 negotiation. */
 typedef struct {
     uint8_t  type;
     uint32_t seq;
     uint16_t payload_len;
+} __attribute__((packed)) PktHeaderV1;
+
+/* Decoded header, host byte order.  On the wire (v2) it is 16 bytes,
+ * big-endian, in this field order. */
+typedef struct {
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint32_t stream_id;    /* transfer ID for file traffic, 0 otherwise */
+    uint32_t seq;
+    uint32_t payload_len;
 } __attribute__((packed)) PktHeader;
 
+/* PktHeader.flags */
+#define PKT_FLAG_META    0x0001 /* ACK/NACK answers MSG_FILE_META, not a chunk */
+#define PKT_FLAG_DIRECT  0x0002 /* META offers a direct listener; META ACK takes it */
+#define PKT_FLAG_CRC     0x0004 /* chunk payload starts with its CRC32C; META ACK asks for it */
+#define PKT_FLAG_DIGEST  0x0008 /* META ends with the file's BLAKE3 digest */
+#define PKT_FLAG_CDC     0x0010 /* META: chunk bounds come in a manifest; META ACK: understood */
+#define PKT_FLAG_DEFLATE 0x0020 /* chunk data is raw deflate; META ACK: receiver inflates */
+#define PKT_FLAG_ROOM    0x0040 /* chat to a client: "room\0sender\0message" */
+#define PKT_FLAG_STORED  0x0080 /* chat kept while the client was away; seq: unix time sent */
+#define PKT_FLAG_SHED    0x0100 /* chunk NACK from the relay: dropped on a full queue */
+
+#define ROOM_PREFIX      '#'    /* chat recipients starting with it name a room */
+#define ROOM_MAX_JOINED  32     /* rooms one client may be in at once */
+
 typedef struct {
     char     name[64];
     char     ip[46];
     uint16_t port;
+    uint16_t load;      /* peers connected, as last announced */
+    uint8_t  version;   /* highest protocol version it speaks */
+    uint8_t  caps;      /* DISC_CAP_* */
+    uint32_t relay_kbps; /* KiB/s relayed over the last beacon gap */
 } ServerInfo;
 
+/* Discovery datagram kinds and server capability bits */
+#define DISC_KIND_BEACON  1     /* server: here I am */
+#define DISC_KIND_PROBE   2     /* client: servers, announce now */
+#define DISC_KIND_BYE     3     /* server: shutting down, forget me */
+#define DISC_CAP_V1       0x01  /* accepts v1 framing */
+#define DISC_CAP_FILES    0x02  /* routes file transfers */
+#define DISC_CAP_LINK     0x04  /* federates: links to other servers */
+
+/* MSG_HELLO trailer bits, after the name and max version */
+#define HELLO_LINK        0x01  /* the dialer is a server opening a link */
+
 typedef struct {
     int      fd;
     char     name[64];
     char     addr[46];
     uint16_t port;
     int      active;
+    int      version;      /* negotiated protocol version */
+    uint64_t queued_bytes; /* relay output waiting on this peer's socket */
+    uint64_t dropped_pkts; /* chunks shed by the slow-peer policy */
+    uint64_t bytes_in;     /* read from this peer's socket */
+    uint64_t bytes_out;    /* written to it */
+    int      link;         /* another server, federated with this one */
 } Peer;
 
 typedef struct {
@@ -59,21 +117,57 @@ typedef struct {
     XferState  state;
     char       filename[256];
     char       peer[64];
+    uint32_t   chunk_size;
     uint32_t   total_chunks;
     uint32_t   done_chunks;
+    uint64_t   file_size;
+    uint64_t   bytes_per_sec;  /* recent throughput, as last reported */
     uint8_t   *chunk_map;
+    uint8_t    direct;     /* chunks flow peer to peer, not through the relay */
+    uint8_t    streams;    /* connections the chunks are spread over */
 } Transfer;
 
-#define CHUNK_SIZE  (64 * 1024)
+#define CHUNK_SIZE       (64 * 1024)        /* default; small files */
+#define CHUNK_SIZE_BULK  (1024 * 1024)      /* files >= CHUNK_BULK_MIN */
+#define CHUNK_SIZE_MAX   (4 * 1024 * 1024)
+#define CHUNK_BULK_MIN   (64LL * 1024 * 1024)
+#define MAX_PAYLOAD      (CHUNK_SIZE_MAX + 256)
 #define MAX_PEERS   32
 #define DISC_PORT   5556
 #define DATA_PORT   5557
 #define HTTP_PORT   5558
 #define MAX_NAME    64
 #define MAX_MSG     4096
-#define DISC_INTERVAL_MS  2000
-#define DISC_EXPIRE_MS    10000
+#define DISC_VERSION      1
+#define DISC_GROUP4       "239.255.77.77"
+#define DISC_GROUP6       "ff02::4d57"
+#define DISC_FAST_MS      250     /* first beacon gap, and again after a change */
+#define DISC_IDLE_MS      10000   /* beacon gap once nothing has changed */
+#define DISC_MISSES       3       /* advertised gaps without a beacon before expiry */
+#define DISC_PROBE_GAP_MS 50      /* server: least time between probe answers */
+#define DISC_PROBES       3       /* client: probes sent at scan start */
+#define DISC_LEGACY_MS    2000    /* gap of the older JSON broadcast beacons */
+#define FED_RETRY_MS      2000    /* server: re-check unlinked servers this often */
+#define FED_DIAL_MS       3000    /* server: give up on a link that hasn't answered */
+#define AUTO_WAIT_MS      1500    /* client auto: longest wait for a first beacon */
+#define AUTO_GRACE_MS     100     /* ... then for the rest to answer the probe */
+#define AUTO_RTT_MS       300     /* ... and for each candidate's TCP connect */
+#define AUTO_KBPS_PER_PEER 1024   /* relay rate that weighs as much as one peer */
+#define PROTO_HELLO_TIMEOUT_MS  1000
 #define XFER_TIMEOUT_S    2
 #define XFER_MAX_RETRIES  3
+#define XFER_RTO_MIN_MS   200
+#define XFER_RTO_MAX_MS   10000
+#define XFER_WINDOW_INIT  8
+#define XFER_WINDOW_MIN   2
+#define XFER_WINDOW_MAX   256
+#define XFER_DIRECT_WAIT_MS     3000    /* sender: await the receiver's choice */
+#define XFER_CDC_WAIT_MS        60000   /* ... while it also copies known chunks */
+#define XFER_DIRECT_CONNECT_MS  1500    /* receiver: give up on the direct dial */
+#define XFER_STREAMS_MAX        8       /* direct connections per transfer */
+#define XFER_HASH_THREADS       4       /* sender: checksum pass before META */
+#define XFER_CRC_LEN            4
+#define XFER_COMP_AHEAD         4       /* chunks deflated ahead of each stream */
+#define XFER_COMP_SAMPLE        8       /* chunks sampled before giving up on it */
 
 #endif /* PROTOCOL_H */
@@ -0,0 +1,62 @@
+/* ratelimit.c
+ * Token bucket arithmetic and rate parsing.
+ */
+
+#include "ratelimit.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void refill(RateBucket *b, long long now_us)
+{
+    if (now_us <= b->last_us) return;
+    double cap = (double)b->rate * RATE_BURST_MS / 1000.0;
+    b->tokens += (double)b->rate * (double)(now_us - b->last_us) / 1e6;
+    if (b->tokens > cap) b->tokens = cap;
+    b->last_us = now_us;
+}
+
+void rate_set(RateBucket *b, uint64_t rate, long long now_us)
+{
+    if (rate != b->rate) {
+        /* Start the new rate out of debt but without saved-up credit */
+        b->rate   = rate;
+        b->tokens = 0;
+    }
+    b->last_us = now_us;
+}
+
+long long rate_wait_us(RateBucket *b, long long now_us)
+{
+    if (b->rate == 0) return 0;
+    refill(b, now_us);
+    if (b->tokens > 0) return 0;
+    return (long long)(-b->tokens * 1e6 / (double)b->rate) + 1;
+}
+
+void rate_take(RateBucket *b, uint32_t bytes)
+{
+    if (b->rate) b->tokens -= bytes;
+}
+
+int rate_parse(const char *s, uint64_t *out)
+{
+    if (!s || !*s) return -1;
+    if (strcmp(s, "off") == 0) { *out = 0; return 0; }
+
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || !isfinite(v) || v < 0) return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': v *= 1024.0;                   end++; break;
+    case 'M': v *= 1024.0 * 1024;            end++; break;
+    case 'G': v *= 1024.0 * 1024 * 1024;     end++; break;
+    default: break;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end || v >= 18446744073709551616.0) return -1;    /* 2^64 */
+    *out = (uint64_t)v;
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* ratelimit.h
+ * Token buckets for shaping outgoing transfers.  Not locked: the caller
+ * serialises access to a bucket.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+#define RATE_BURST_MS  100      /* credit an idle bucket saves up */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* `rate` bytes per second, 0 for no limit.  A send may overdraw the
+ * bucket; the debt is paid off before the next one, so any chunk size
+ * fits under any rate. */
+typedef struct {
+    uint64_t  rate;
+    double    tokens;
+    long long last_us;
+} RateBucket;
+
+void      rate_set(RateBucket *b, uint64_t rate, long long now_us);
+
+/* Microseconds until the bucket has credit, 0 if it has some now */
+long long rate_wait_us(RateBucket *b, long long now_us);
+
+void      rate_take(RateBucket *b, uint32_t bytes);
+
+/* "0", "off", or a byte rate with an optional K, M or G (binary) suffix */
+int       rate_parse(const char *s, uint64_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RATELIMIT_H */
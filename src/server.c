@@ -1,11 +1,28 @@
 /* server.c
  * TCP server: accept loop, peer table, route chat and file messages.
- * Uses select() to multiplex all peer connections.
+ * One thread drives every connection through an edge-triggered poller;
+ * sockets are non-blocking, with a read buffer and a bounded queue of shared
+ * packet buffers per connection.  Bulk chunk payloads bypass the read buffer
+ * and move socket to socket (splice on Linux, one in-place buffer elsewhere).
+ * With federation on, links to other servers are Conns too: rosters are
+ * exchanged over them, and chat and file routes reach remote clients.
+ * Rooms are member lists; a room message is framed once for all of them.
+ * Direct chats go to the message store, which holds them for clients that
+ * are away and replays them at the next HELLO.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* splice, pipe2, F_SETPIPE_SZ */
+#endif
+
 #include "server.h"
 #include "discovery.h"
 #include "transfer.h"
+#include "poller.h"
+#include "bufpool.h"
+#include "wire.h"
+#include "metrics.h"
+#include "msgstore.h"
 #include "util.h"
 
 #include <stdio.h>
@@ -14,135 +31,1295 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <errno.h>
 
-static Peer           peers[MAX_PEERS];
+#define CONN_RBUF_INIT   (16 * 1024)
+#define CONN_RBUF_KEEP   (256 * 1024)   /* shrink back after a big packet */
+#define CONN_IOV_BATCH   64
+#define CONN_BATCH_MAX   POOL_MSG       /* smaller packets wait for the end-of-wakeup flush */
+#define PASS_MIN         (32 * 1024)    /* chunk bytes still to come before bypassing rbuf */
+
+/* A fully framed packet in a pool buffer; len is the bytes to send.  One
+ * buffer is shared by every peer it is queued to and goes back to the
+ * pool when the last queue lets go of it. */
+typedef PoolBuf PktBuf;
+
+typedef enum {
+    PASS_NONE,             /* reading packets into rbuf */
+    PASS_COPY,             /* receiving a chunk payload straight into pass_pkt */
+    PASS_SPLICE,           /* moving a chunk payload through pipe_fd to pass_dst */
+    PASS_DISCARD           /* skipping a chunk nobody can take, or an oversized packet */
+} PassMode;
+
+typedef struct {
+    PktBuf  *buf;
+    uint32_t off;          /* bytes of buf already written */
+} OutEntry;
+
+typedef struct {
+    struct Room *room;
+    int          slot;     /* our index in room->members */
+} RoomRef;
+
+/* Per-connection state.  `peer` is the public part copied out by
+ * server_get_peers(); the rest is owned by the server thread. */
+typedef struct Conn {
+    Peer     peer;
+    int      index;        /* slot in conns[] */
+    int      dead;         /* queued for close at the end of this wakeup */
+    struct Conn *dead_next; /* next on that queue */
+    int      named;        /* client that has sent HELLO */
+    int      listed;       /* holds its name in the directory */
+    int      flush_slot;   /* index in flush_list + 1, 0 when not on it */
+    int      dialed;       /* a link we opened; peer.link once it answers */
+    long     dial_ms;
+
+    char    *rbuf;         /* unparsed input: header + payload */
+    size_t   rlen, rcap;
+
+    OutEntry *outq;        /* ring of packets the socket hasn't taken yet */
+    int       out_head, out_count, out_cap;
+    long long drained_us;  /* last time the socket took bytes or the queue was empty */
+
+    /* Input side of a chunk relayed without going through rbuf */
+    PassMode  pass_mode;
+    uint32_t  pass_left;   /* payload bytes still to read from this socket */
+    uint32_t  pass_id;     /* transfer the chunk belongs to */
+    uint32_t  pass_seq;    /* ... and its seq, to NACK it if it's shed */
+    PktBuf   *pass_pkt;    /* PASS_COPY: packet being filled in place */
+    struct Conn *pass_dst; /* PASS_SPLICE: receiver holding for our payload */
+    int       pipe_fd[2];  /* PASS_SPLICE: lazily created, -1 until then */
+    uint32_t  pipe_len;    /* bytes parked in the pipe */
+
+    /* Output side: while a source splices into this socket, queued packets
+     * wait behind its payload except the first splice_lead entries */
+    struct Conn *splice_src;
+    int       splice_lead;
+
+    RoomRef  *rooms;
+    int       room_count, room_cap;
+} Conn;
+
+typedef struct Room {
+    char   name[MAX_NAME];
+    Conn **members;
+    int    count, cap;
+} Room;
+
+static Conn         **conns = NULL;
 static int            peer_count = 0;
+static int            conn_cap = 0;
 static pthread_mutex_t peer_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static Conn          *dead_head = NULL;  /* killed this wakeup, oldest first */
+static Conn          *dead_tail = NULL;
+
+static Conn         **flush_list = NULL;  /* queued small packets, written before the wakeup ends */
+static int            flush_count = 0;
+static int            flush_cap = 0;
+
+static int            link_count = 0;
+
+/* Name -> pointer tables.  Open addressing like routes; an empty name is a
+ * free slot. */
+typedef struct {
+    char  name[MAX_NAME];
+    void *val;
+} NameSlot;
+
+typedef struct {
+    NameSlot *slots;
+    int       cap, count;
+} NameTable;
+
+static NameTable      directory;           /* named local client -> Conn */
+static int            unlisted = 0;        /* named clients shadowed by an earlier one */
+static NameTable      remotes;             /* client on a linked server -> link Conn */
+static NameTable      rooms;               /* "#room" -> Room */
+
+static size_t         queue_hwm   = PEER_QUEUE_HWM;
+static SlowPeerPolicy slow_policy = SLOW_PEER_DROP;
+
+/* Transfer ID -> (sender, receiver), learned from MSG_FILE_META.  Open
+ * addressing with linear probing; a slot with id 0 is empty. */
+typedef struct {
+    uint32_t id;
+    Conn    *sender;
+    Conn    *receiver;
+    uint32_t total;        /* chunks announced in META */
+    uint32_t acked;        /* distinct chunks the receiver has ACKed */
+    uint8_t *acked_map;
+} Route;
+
+static Route         *routes = NULL;
+static int            route_cap = 0;
+static int            route_count = 0;
+
+#ifdef __linux__
+static int            splice_ok = 1;
+#endif
+
 static int            listen_fd = -1;
+static Poller        *poller = NULL;
 static pthread_t      server_thread;
 static volatile int   running = 0;
 static char           server_name[MAX_NAME];
+static uint16_t       data_port = DATA_PORT;
+static int            federate = 0;
+static int            fed_pending = 0;     /* discovery saw a change */
+static char           history_path[256] = MSGSTORE_FILE;    /* "" keeps no history */
+
+/* Frame a packet announcing `len` payload bytes, of which the first `have`
+ * are copied in now; the caller fills in the rest. */
+static PktBuf *pktbuf_start(int version, const PktHeader *hdr, const void *payload,
+                            uint32_t have, uint32_t len)
+{
+    PktBuf *b = pool_get(WIRE_HDR_MAX + len);
+    if (!b) return NULL;
+
+    PktHeader out = *hdr;
+    out.payload_len = len;
+    int hsize = wire_encode(version, &out, (uint8_t *)b->data);
+    if (have > 0) memcpy(b->data + hsize, payload, have);
+
+    b->len = (uint32_t)hsize + have;
+    return b;
+}
+
+static PktBuf *pktbuf_new(int version, const PktHeader *hdr, const void *payload, uint32_t len)
+{
+    return pktbuf_start(version, hdr, payload, len, len);
+}
 
-static void peer_add(int fd, const char *addr, uint16_t port)
+/* ── Name tables ─────────────────────────────────────────── */
+
+static unsigned names_home(const NameTable *t, const char *name)
+{
+    unsigned h = 2166136261u;
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    return h & (unsigned)(t->cap - 1);
+}
+
+static NameSlot *names_find(const NameTable *t, const char *name)
+{
+    if (t->count == 0 || !name[0]) return NULL;
+    for (unsigned i = names_home(t, name); ; i = (i + 1) & (t->cap - 1)) {
+        if (!t->slots[i].name[0]) return NULL;
+        if (strcmp(t->slots[i].name, name) == 0) return &t->slots[i];
+    }
+}
+
+static void *names_get(const NameTable *t, const char *name)
 {
+    NameSlot *s = names_find(t, name);
+    return s ? s->val : NULL;
+}
+
+static int names_put(NameTable *t, const char *name, void *val)
+{
+    NameSlot *s = names_find(t, name);
+    if (s) { s->val = val; return 0; }
+
+    if ((t->count + 1) * 2 > t->cap) {
+        int       ocap = t->cap;
+        NameSlot *old  = t->slots;
+        int       ncap = ocap ? ocap * 2 : 64;
+        NameSlot *n    = (NameSlot *)calloc(ncap, sizeof(NameSlot));
+        if (!n) return -1;
+
+        t->slots = n;
+        t->cap   = ncap;
+        for (int i = 0; i < ocap; i++) {
+            if (!old[i].name[0]) continue;
+            unsigned j = names_home(t, old[i].name);
+            while (n[j].name[0]) j = (j + 1) & (ncap - 1);
+            n[j] = old[i];
+        }
+        free(old);
+    }
+
+    unsigned i = names_home(t, name);
+    while (t->slots[i].name[0]) i = (i + 1) & (t->cap - 1);
+    snprintf(t->slots[i].name, MAX_NAME, "%s", name);
+    t->slots[i].val = val;
+    t->count++;
+    return 0;
+}
+
+static void names_del(NameTable *t, NameSlot *s)
+{
+    unsigned mask = (unsigned)t->cap - 1;
+    unsigned hole = (unsigned)(s - t->slots);
+
+    t->slots[hole].name[0] = '\0';
+    t->count--;
+
+    for (unsigned i = (hole + 1) & mask; t->slots[i].name[0]; i = (i + 1) & mask) {
+        unsigned home = names_home(t, t->slots[i].name);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            t->slots[i].name[0] = '\0';
+            hole = i;
+        }
+    }
+}
+
+static void route_drop_conn(Conn *c);
+static void remote_drop_link(Conn *link);
+static void dir_unlist(Conn *c);
+static void room_leave_all(Conn *c);
+static void fed_roster_send(Conn *to, uint8_t type, const char *names, uint32_t len);
+static void pass_detach(Conn *src);
+static void pass_abort(Conn *c);
+static void conn_read(Conn *c);
+
+static Conn *peer_add(int fd, const char *addr, uint16_t port)
+{
+    Conn *c = (Conn *)calloc(1, sizeof(Conn));
+    if (!c) return NULL;
+
+    c->peer.fd = fd;
+    snprintf(c->peer.addr, 46, "%s", addr);
+    c->peer.port    = port;
+    c->peer.active  = 1;
+    c->peer.version = PROTO_V1;
+    c->drained_us   = util_time_us();
+    c->pipe_fd[0]   = c->pipe_fd[1] = -1;
+    snprintf(c->peer.name, MAX_NAME, "peer_%d", fd);
+
     pthread_mutex_lock(&peer_lock);
-    if (peer_count < MAX_PEERS) {
-        memset(&peers[peer_count], 0, sizeof(Peer));
-        peers[peer_count].fd = fd;
-        snprintf(peers[peer_count].addr, 46, "%s", addr);
-        peers[peer_count].port = port;
-        peers[peer_count].active = 1;
-        snprintf(peers[peer_count].name, MAX_NAME, "peer_%d", fd);
-        peer_count++;
+    if (peer_count == conn_cap) {
+        int ncap = conn_cap ? conn_cap * 2 : 64;
+        Conn **n = (Conn **)realloc(conns, ncap * sizeof(Conn *));
+        if (!n) { pthread_mutex_unlock(&peer_lock); free(c); return NULL; }
+        conns = n;
+        conn_cap = ncap;
     }
+    c->index = peer_count;
+    conns[peer_count++] = c;
+    int load = peer_count - link_count;
     pthread_mutex_unlock(&peer_lock);
+    discovery_set_load(load);
+    return c;
 }
 
-static void peer_remove(int fd)
+static void peer_remove(Conn *c)
 {
+    util_log(LOG_INFO, "server: peer \"%s\" disconnected", c->peer.name);
+    poller_del(poller, c->peer.fd);
+    close(c->peer.fd);
+
     pthread_mutex_lock(&peer_lock);
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].fd == fd) {
-            util_log(LOG_INFO, "server: peer \"%s\" disconnected", peers[i].name);
-            close(peers[i].fd);
-            peers[i] = peers[peer_count - 1];
-            peer_count--;
+    Conn *last = conns[--peer_count];
+    conns[c->index] = last;
+    last->index = c->index;
+    if (c->peer.link) link_count--;
+    int load = peer_count - link_count;
+    pthread_mutex_unlock(&peer_lock);
+    discovery_set_load(load);
+
+    if (c->peer.link)
+        remote_drop_link(c);
+    else if (c->named && federate && running)
+        fed_roster_send(NULL, MSG_PEER_LEAVE, c->peer.name, (uint32_t)strlen(c->peer.name) + 1);
+
+    dir_unlist(c);
+    room_leave_all(c);
+    if (c->flush_slot) {
+        Conn *moved = flush_list[--flush_count];
+        flush_list[c->flush_slot - 1] = moved;
+        moved->flush_slot = c->flush_slot;
+    }
+    route_drop_conn(c);
+    pass_abort(c);
+    if (c->splice_src) {
+        /* The source still owes payload bytes; let it skip them */
+        Conn *src = c->splice_src;
+        pass_detach(src);
+        conn_read(src);
+    }
+    if (c->pipe_fd[0] >= 0) { close(c->pipe_fd[0]); close(c->pipe_fd[1]); }
+
+    for (int i = 0; i < c->out_count; i++)
+        pool_put(c->outq[(c->out_head + i) & (c->out_cap - 1)].buf);
+    free(c->outq);
+    free(c->rbuf);
+    free(c);
+}
+
+/* Defer the close so pointers held by the current wakeup stay valid.
+ * Queued through the connection itself, so it can't fail. */
+static void conn_kill(Conn *c)
+{
+    if (c->dead) return;
+    c->dead      = 1;
+    c->dead_next = NULL;
+    if (dead_tail) dead_tail->dead_next = c;
+    else           dead_head = c;
+    dead_tail = c;
+}
+
+/* A removal can kill more connections; they join the queue behind it */
+static void reap_dead(void)
+{
+    while (dead_head) {
+        Conn *c   = dead_head;
+        dead_head = c->dead_next;
+        if (!dead_head) dead_tail = NULL;
+        peer_remove(c);
+    }
+}
+
+/* ── Directory ───────────────────────────────────────────── */
+
+/* The first client to take a name owns it; later ones with the same name
+ * wait unlisted and the oldest survivor is listed when the owner goes. */
+static void dir_list(Conn *c)
+{
+    if (!names_get(&directory, c->peer.name) && names_put(&directory, c->peer.name, c) == 0)
+        c->listed = 1;
+    else
+        unlisted++;
+}
+
+static void dir_unlist(Conn *c)
+{
+    if (!c->named) return;
+    c->named = 0;
+    if (!c->listed) {
+        unlisted--;
+        return;
+    }
+
+    c->listed = 0;
+    NameSlot *s = names_find(&directory, c->peer.name);
+    if (s) names_del(&directory, s);
+    for (int i = 0; unlisted > 0 && i < peer_count; i++) {
+        Conn *o = conns[i];
+        if (o->named && !o->listed && !o->dead && strcmp(o->peer.name, c->peer.name) == 0) {
+            unlisted--;
+            dir_list(o);
             break;
         }
     }
-    pthread_mutex_unlock(&peer_lock);
 }
 
 static Peer *peer_find_by_name(const char *name)
 {
-    for (int i = 0; i < peer_count; i++)
-        if (strcmp(peers[i].name, name) == 0)
-            return &peers[i];
-    return NULL;
+    Conn *c = (Conn *)names_get(&directory, name);
+    return c && !c->dead ? &c->peer : NULL;
 }
 
-static int send_all(int fd, const void *buf, int len)
+/* ── Output ──────────────────────────────────────────────── */
+
+void server_set_queue_limit(size_t hwm_bytes, SlowPeerPolicy policy)
 {
-    const char *p = (const char *)buf;
-    while (len > 0) {
-        ssize_t n = send(fd, p, len, 0);
-        if (n <= 0) return -1;
-        p   += n;
-        len -= (int)n;
+    if (hwm_bytes < MAX_PAYLOAD + WIRE_HDR_MAX) hwm_bytes = MAX_PAYLOAD + WIRE_HDR_MAX;
+    queue_hwm   = hwm_bytes;
+    slow_policy = policy;
+}
+
+static int outq_push(Conn *c, PktBuf *b, uint32_t off)
+{
+    if (c->out_count == c->out_cap) {
+        int ncap = c->out_cap ? c->out_cap * 2 : 16;
+        OutEntry *n = (OutEntry *)malloc(ncap * sizeof(OutEntry));
+        if (!n) return -1;
+        for (int i = 0; i < c->out_count; i++)
+            n[i] = c->outq[(c->out_head + i) & (c->out_cap - 1)];
+        free(c->outq);
+        c->outq     = n;
+        c->out_cap  = ncap;
+        c->out_head = 0;
     }
+
+    OutEntry *e = &c->outq[(c->out_head + c->out_count) & (c->out_cap - 1)];
+    e->buf = b;
+    e->off = off;
+    c->out_count++;
+    pool_ref(b);
+    c->peer.queued_bytes += b->len - off;
     return 0;
 }
 
-static void broadcast_to_all(const void *buf, int len, int exclude_fd)
+/* Put a packet at position `pos` in the queue rather than at the tail */
+static int outq_insert(Conn *c, int pos, PktBuf *b)
 {
-    pthread_mutex_lock(&peer_lock);
+    if (outq_push(c, b, 0) < 0) return -1;
+    for (int i = c->out_count - 1; i > pos; i--) {
+        OutEntry *a = &c->outq[(c->out_head + i - 1) & (c->out_cap - 1)];
+        OutEntry *z = &c->outq[(c->out_head + i) & (c->out_cap - 1)];
+        OutEntry  t = *a; *a = *z; *z = t;
+    }
+    return 0;
+}
+
+/* Past the mark, bulk chunks are shed: they are the only packets the
+ * sender retransmits.  Control packets and chat are kept up to twice the
+ * mark.  A peer beyond the hard cap, or (under the disconnect policy) one
+ * over the mark whose socket has taken nothing for PEER_STALL_MS, is cut. */
+static int over_hwm(Conn *c, const PktBuf *b, int droppable)
+{
+    size_t after = c->peer.queued_bytes + b->len;
+    if (after <= queue_hwm) return 0;
+
+    int stalled = util_time_us() - c->drained_us > (long long)PEER_STALL_MS * 1000;
+    if (after > 2 * queue_hwm || (slow_policy == SLOW_PEER_DISCONNECT && stalled)) {
+        util_log(LOG_WARN, "server: disconnecting slow peer \"%s\" (%llu bytes queued)",
+                 c->peer.name, (unsigned long long)c->peer.queued_bytes);
+        conn_kill(c);
+        return 1;
+    }
+    if (!droppable) return 0;
+
+    if (c->peer.dropped_pkts++ % 1000 == 0)
+        util_log(LOG_WARN, "server: peer \"%s\" is slow, dropping chunks (%llu queued)",
+                 c->peer.name, (unsigned long long)c->peer.queued_bytes);
+    return 1;
+}
+
+static void conn_flush(Conn *c);
+
+/* Written out by flush_batched() before this wakeup ends */
+static void flush_later(Conn *c)
+{
+    if (c->flush_slot) return;
+    if (flush_count == flush_cap) {
+        int ncap = flush_cap ? flush_cap * 2 : 64;
+        Conn **n = (Conn **)realloc(flush_list, ncap * sizeof(Conn *));
+        if (!n) { conn_flush(c); return; }
+        flush_list = n;
+        flush_cap  = ncap;
+    }
+    flush_list[flush_count++] = c;
+    c->flush_slot = flush_count;
+}
+
+/* Queue a packet behind whatever the peer has pending.  A large packet to
+ * an idle queue gets one immediate write and only its unsent tail takes a
+ * queue slot; small ones wait, so all the chat and control packets one
+ * wakeup sends a peer leave in a single writev. */
+static int conn_enqueue(Conn *c, PktBuf *b, int droppable)
+{
+    if (c->dead) return -1;
+    if (over_hwm(c, b, droppable)) return -1;
+
+    uint32_t off = 0;
+    if (c->out_count == 0) c->drained_us = util_time_us();
+    if (c->out_count == 0 && !c->splice_src && b->len > CONN_BATCH_MAX) {
+        ssize_t n = send(c->peer.fd, b->data, b->len, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_kill(c);
+            return -1;
+        }
+        if (n > 0) {
+            off = (uint32_t)n;
+            c->peer.bytes_out += (uint64_t)n;
+            metrics_add(MET_RELAY_BYTES, (uint64_t)n);
+        }
+        if (off == b->len) return 0;
+    }
+
+    if (outq_push(c, b, off) < 0) { conn_kill(c); return -1; }
+    if (off == 0) flush_later(c);
+    return 0;
+}
+
+static int pass_pump(Conn *c);
+
+/* Drain the queue with batched writev until the socket pushes back.  While
+ * a source is splicing into this socket only the packets queued ahead of
+ * its payload may go; then the splice itself is driven from here. */
+static void conn_flush(Conn *c)
+{
+    while (!c->dead && c->out_count > 0) {
+        int limit = c->splice_src ? c->splice_lead : c->out_count;
+        if (limit == 0) break;
+
+        struct iovec iov[CONN_IOV_BATCH];
+        int cnt = limit < CONN_IOV_BATCH ? limit : CONN_IOV_BATCH;
+        for (int i = 0; i < cnt; i++) {
+            OutEntry *e = &c->outq[(c->out_head + i) & (c->out_cap - 1)];
+            iov[i].iov_base = e->buf->data + e->off;
+            iov[i].iov_len  = e->buf->len - e->off;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = cnt;
+
+        ssize_t n = sendmsg(c->peer.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { conn_kill(c); return; }
+
+        c->peer.queued_bytes -= (uint64_t)n;
+        c->peer.bytes_out    += (uint64_t)n;
+        metrics_add(MET_RELAY_BYTES, (uint64_t)n);
+        c->drained_us = util_time_us();
+        while (n > 0) {
+            OutEntry *e = &c->outq[c->out_head];
+            uint32_t left = e->buf->len - e->off;
+            if ((size_t)n < left) { e->off += (uint32_t)n; break; }
+
+            n -= left;
+            pool_put(e->buf);
+            c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+            c->out_count--;
+            if (c->splice_src && c->splice_lead > 0) c->splice_lead--;
+        }
+    }
+
+    if (!c->dead && c->splice_src && c->splice_lead == 0) {
+        Conn *src = c->splice_src;
+        if (pass_pump(src) > 0)
+            conn_read(src);     /* it stopped reading while we were full */
+    }
+}
+
+static void flush_batched(void)
+{
+    while (flush_count > 0) {
+        Conn *c = flush_list[--flush_count];
+        c->flush_slot = 0;
+        conn_flush(c);
+    }
+}
+
+static int is_file_msg(uint8_t type)
+{
+    return (type >= MSG_FILE_META && type <= MSG_RESUME) ||
+           type == MSG_FILE_HAVE || type == MSG_FILE_MANIFEST;
+}
+
+static int can_carry(const Peer *p, const PktHeader *hdr, uint32_t len)
+{
+    /* File traffic only flows between v2 peers */
+    if (p->version < PROTO_V2 && is_file_msg(hdr->type)) return 0;
+    if (p->version < PROTO_V2 && len > 0xFFFF) return 0;
+    return 1;
+}
+
+/* Send one packet framed for the peer's protocol version */
+static int peer_send(Peer *p, const PktHeader *hdr, const void *payload, uint32_t len)
+{
+    if (!can_carry(p, hdr, len)) return -1;
+
+    PktBuf *b = pktbuf_new(p->version, hdr, payload, len);
+    if (!b) return -1;
+    int rc = conn_enqueue((Conn *)p, b, hdr->type == MSG_FILE_CHUNK);
+    pool_put(b);
+    return rc;
+}
+
+/* Frame the packet once per protocol version and share that buffer across
+ * every recipient's queue. */
+static void broadcast_to_all(const PktHeader *hdr, const void *payload,
+                             uint32_t len, int exclude_fd)
+{
+    PktBuf *framed[PROTO_VERSION + 1] = { NULL };
+
     for (int i = 0; i < peer_count; i++) {
-        if (peers[i].fd != exclude_fd)
-            send_all(peers[i].fd, buf, len);
+        Peer *p = &conns[i]->peer;
+        if (p->fd == exclude_fd || p->link || !can_carry(p, hdr, len)) continue;
+
+        if (!framed[p->version])
+            framed[p->version] = pktbuf_new(p->version, hdr, payload, len);
+        if (framed[p->version])
+            conn_enqueue(conns[i], framed[p->version], hdr->type == MSG_FILE_CHUNK);
+    }
+
+    for (int v = 0; v <= PROTO_VERSION; v++)
+        pool_put(framed[v]);
+}
+
+/* ── Rooms ───────────────────────────────────────────────── */
+
+static Room *room_get(const char *name, int create)
+{
+    Room *r = (Room *)names_get(&rooms, name);
+    if (r || !create) return r;
+
+    r = (Room *)calloc(1, sizeof(Room));
+    if (!r) return NULL;
+    snprintf(r->name, MAX_NAME, "%s", name);
+    if (names_put(&rooms, name, r) < 0) { free(r); return NULL; }
+    return r;
+}
+
+/* Index of r in c's room list, or -1 */
+static int room_ref(const Conn *c, const Room *r)
+{
+    for (int i = 0; i < c->room_count; i++)
+        if (c->rooms[i].room == r) return i;
+    return -1;
+}
+
+static void room_join(Conn *c, const char *name)
+{
+    Room *r = room_get(name, 0);
+    if (r && room_ref(c, r) >= 0) return;
+    if (c->room_count == ROOM_MAX_JOINED) {
+        util_log(LOG_WARN, "server: \"%s\" is in too many rooms to join \"%s\"", c->peer.name, name);
+        return;
     }
+    if (!r && !(r = room_get(name, 1))) return;
+
+    if (c->room_count == c->room_cap) {
+        int ncap = c->room_cap ? c->room_cap * 2 : 4;
+        RoomRef *n = (RoomRef *)realloc(c->rooms, ncap * sizeof(RoomRef));
+        if (!n) return;
+        c->rooms    = n;
+        c->room_cap = ncap;
+    }
+    if (r->count == r->cap) {
+        int ncap = r->cap ? r->cap * 2 : 16;
+        Conn **n = (Conn **)realloc(r->members, ncap * sizeof(Conn *));
+        if (!n) return;
+        r->members = n;
+        r->cap     = ncap;
+    }
+    if (r->count == 0)
+        util_log(LOG_INFO, "server: room \"%s\" opened", name);
+
+    c->rooms[c->room_count].room = r;
+    c->rooms[c->room_count].slot = r->count;
+    c->room_count++;
+    r->members[r->count++] = c;
+}
+
+/* Swap-remove on both sides; the last member to go closes the room */
+static void room_leave(Conn *c, int ref)
+{
+    Room *r    = c->rooms[ref].room;
+    int   slot = c->rooms[ref].slot;
+
+    Conn *moved = r->members[--r->count];
+    r->members[slot] = moved;
+    if (moved != c) moved->rooms[room_ref(moved, r)].slot = slot;
+    c->rooms[ref] = c->rooms[--c->room_count];
+
+    if (r->count == 0) {
+        util_log(LOG_INFO, "server: room \"%s\" closed", r->name);
+        names_del(&rooms, names_find(&rooms, r->name));
+        free(r->members);
+        free(r);
+    }
+}
+
+static void room_leave_all(Conn *c)
+{
+    while (c->room_count > 0)
+        room_leave(c, c->room_count - 1);
+    free(c->rooms);
+    c->rooms    = NULL;
+    c->room_cap = 0;
+}
+
+/* Members get "room\0sender\0message", framed once per protocol version
+ * and shared by every member's queue */
+static void room_send(Room *r, uint32_t seq, const char *from, const char *text,
+                      uint32_t text_len, const Conn *skip)
+{
+    char     buf[MAX_MSG + 2 * MAX_NAME];
+    uint32_t rl = (uint32_t)strlen(r->name) + 1, fl = (uint32_t)strlen(from) + 1;
+    if (rl > sizeof(buf) || fl > sizeof(buf) - rl || text_len > sizeof(buf) - rl - fl) return;
+    memcpy(buf, r->name, rl);
+    memcpy(buf + rl, from, fl);
+    memcpy(buf + rl + fl, text, text_len);
+
+    PktHeader h;
+    memset(&h, 0, sizeof(h));
+    h.type  = MSG_CHAT;
+    h.flags = PKT_FLAG_ROOM;
+    h.seq   = seq;
+
+    PktBuf *framed[PROTO_VERSION + 1] = { NULL };
+    for (int i = 0; i < r->count; i++) {
+        Conn *m = r->members[i];
+        int   v = m->peer.version;
+        if (m == skip) continue;
+
+        if (!framed[v])
+            framed[v] = pktbuf_new(v, &h, buf, rl + fl + text_len);
+        if (framed[v])
+            conn_enqueue(m, framed[v], 0);
+    }
+
+    for (int v = 0; v <= PROTO_VERSION; v++)
+        pool_put(framed[v]);
+}
+
+/* ── Federation ──────────────────────────────────────────── */
+
+static void remote_drop_link(Conn *link)
+{
+    for (int i = 0; i < remotes.cap; ) {
+        if (remotes.slots[i].name[0] && remotes.slots[i].val == link)
+            names_del(&remotes, &remotes.slots[i]);     /* may shift a later entry into i */
+        else
+            i++;
+    }
+}
+
+/* A link, dialed or accepted, to the server called `name` */
+static Conn *fed_find_link(const char *name)
+{
+    for (int i = 0; i < peer_count; i++) {
+        Conn *c = conns[i];
+        if (!c->dead && (c->peer.link || c->dialed) && strcmp(c->peer.name, name) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+/* payload: NUL-terminated client names back to back.  to == NULL sends it
+ * over every link. */
+static void fed_roster_send(Conn *to, uint8_t type, const char *names, uint32_t len)
+{
+    PktHeader h;
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+
+    if (to) {
+        peer_send(&to->peer, &h, names, len);
+        return;
+    }
+    for (int i = 0; i < peer_count; i++)
+        if (conns[i]->peer.link)
+            peer_send(&conns[i]->peer, &h, names, len);
+}
+
+static void fed_roster_in(Conn *link, const PktHeader *hdr, const char *payload)
+{
+    const char *p = payload, *end = payload + hdr->payload_len;
+    while (p < end) {
+        const char *z = (const char *)memchr(p, '\0', (size_t)(end - p));
+        if (!z) break;
+        if (z > p && z - p < MAX_NAME) {
+            NameSlot *r = names_find(&remotes, p);
+            if (hdr->type == MSG_PEER_JOIN)
+                names_put(&remotes, p, link);
+            else if (r && r->val == link)
+                names_del(&remotes, r);
+        }
+        p = z + 1;
+    }
+}
+
+/* Both ends, once the HELLO exchange is done: count it, send our roster */
+static void fed_link_up(Conn *c)
+{
+    pthread_mutex_lock(&peer_lock);
+    c->peer.link = 1;
+    link_count++;
+    int load = peer_count - link_count;
     pthread_mutex_unlock(&peer_lock);
+    discovery_set_load(load);
+
+    size_t len = 0;
+    char  *names = (char *)malloc((size_t)peer_count * MAX_NAME + 1);
+    if (names) {
+        for (int i = 0; i < peer_count; i++) {
+            Conn *p = conns[i];
+            if (!p->named || p->dead) continue;
+            size_t n = strlen(p->peer.name) + 1;
+            memcpy(names + len, p->peer.name, n);
+            len += n;
+        }
+        if (len) fed_roster_send(c, MSG_PEER_JOIN, names, (uint32_t)len);
+        free(names);
+    }
+    util_log(LOG_INFO, "server: linked with server \"%s\" (%s:%d)",
+             c->peer.name, c->peer.addr, c->peer.port);
+}
+
+/* The dialed server's HELLO reply: "name\0version" */
+static void fed_hello_reply(Conn *c, const PktHeader *hdr, const char *payload)
+{
+    const char *sep = (const char *)memchr(payload, '\0', hdr->payload_len);
+    int version = sep && sep + 1 < payload + hdr->payload_len ? (uint8_t)sep[1] : PROTO_V1;
+    if (version < PROTO_V2) {
+        util_log(LOG_WARN, "server: \"%s\" can't link (protocol v%d)", c->peer.name, version);
+        conn_kill(c);
+        return;
+    }
+    c->peer.version = version > PROTO_VERSION ? PROTO_VERSION : version;
+    c->dialed = 0;
+    fed_link_up(c);
+}
+
+static void fed_dial(const ServerInfo *s)
+{
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port   = htons(s->port);
+    if (inet_pton(AF_INET, s->ip, &sa.sin_addr) != 1) return;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return;
+    util_set_nonblocking(fd);
+    util_set_nodelay(fd);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+
+    Conn *c = peer_add(fd, s->ip, s->port);
+    if (!c || poller_add(poller, fd, POLL_IN | POLL_OUT, c) < 0) {
+        if (c) conn_kill(c); else close(fd);
+        return;
+    }
+    pthread_mutex_lock(&peer_lock);
+    snprintf(c->peer.name, MAX_NAME, "%.*s", MAX_NAME - 1, s->name);
+    pthread_mutex_unlock(&peer_lock);
+    c->dialed  = 1;
+    c->dial_ms = util_time_ms();
+
+    /* A v1-framed HELLO like any client's, with the link bit after the version */
+    char hello[MAX_NAME + 3];
+    int  n = (int)strlen(server_name);
+    memcpy(hello, server_name, n + 1);
+    hello[n + 1] = (char)PROTO_VERSION;
+    hello[n + 2] = (char)HELLO_LINK;
+
+    PktHeader h;
+    memset(&h, 0, sizeof(h));
+    h.type = MSG_HELLO;
+    peer_send(&c->peer, &h, hello, (uint32_t)n + 3);
+    util_log(LOG_INFO, "server: linking to \"%s\" at %s:%d", s->name, s->ip, s->port);
+}
+
+/* Dial every federating server we aren't linked with.  Of each pair, the
+ * one whose name sorts first dials, so a pair ends up with one link. */
+static void fed_tick(void)
+{
+    long now = util_time_ms();
+    for (int i = 0; i < peer_count; i++) {
+        Conn *c = conns[i];
+        if (c->dialed && now - c->dial_ms > FED_DIAL_MS) {
+            util_log(LOG_WARN, "server: link to \"%s\" timed out", c->peer.name);
+            conn_kill(c);
+        }
+    }
+
+    ServerInfo svs[MAX_PEERS];
+    int n = discovery_get_servers(svs, MAX_PEERS);
+    for (int i = 0; i < n; i++) {
+        if (!(svs[i].caps & DISC_CAP_LINK) || strcmp(server_name, svs[i].name) >= 0) continue;
+        if (!fed_find_link(svs[i].name)) fed_dial(&svs[i]);
+    }
+}
+
+/* Scan thread: the discovered set changed */
+static void fed_notify(void)
+{
+    __atomic_store_n(&fed_pending, 1, __ATOMIC_RELEASE);
+    poller_wake(poller);
+}
+
+/* Chat crossing a link keeps its recipient: "to\0from\0text".  link == NULL
+ * sends it over every link. */
+static void fed_chat_out(Conn *link, uint32_t seq, const char *to, const char *from,
+                         const char *text, uint32_t text_len)
+{
+    char     buf[MAX_MSG + 2 * MAX_NAME];
+    uint32_t tl = (uint32_t)strlen(to) + 1, fl = (uint32_t)strlen(from) + 1;
+    if (tl > sizeof(buf) || fl > sizeof(buf) - tl || text_len > sizeof(buf) - tl - fl) return;
+    memcpy(buf, to, tl);
+    memcpy(buf + tl, from, fl);
+    memcpy(buf + tl + fl, text, text_len);
+
+    PktHeader h;
+    memset(&h, 0, sizeof(h));
+    h.type = MSG_CHAT;
+    h.seq  = seq;
+    if (link) {
+        peer_send(&link->peer, &h, buf, tl + fl + text_len);
+        return;
+    }
+    for (int i = 0; i < peer_count; i++)
+        if (conns[i]->peer.link)
+            peer_send(&conns[i]->peer, &h, buf, tl + fl + text_len);
+}
+
+/* Delivered here only: to its recipient, or to every local client */
+static void fed_chat_in(Conn *link, const PktHeader *hdr, const char *payload)
+{
+    const char *to, *rest;
+    uint32_t    rest_len;
+    if (wire_parse_chat(hdr, (const uint8_t *)payload, &to, &rest, &rest_len) < 0) return;
+    const char *z = (const char *)memchr(rest, '\0', rest_len);
+    if (!z || rest_len - (uint32_t)(z - rest) - 1 > MAX_MSG) return;
+    if (strnlen(to, MAX_NAME) >= MAX_NAME || z - rest >= MAX_NAME) return;
+
+    if (to[0] == ROOM_PREFIX) {
+        Room *r = room_get(to, 0);
+        if (r) room_send(r, hdr->seq, rest, z + 1, rest_len - (uint32_t)(z - rest) - 1, NULL);
+        return;
+    }
+
+    PktHeader rh;
+    memset(&rh, 0, sizeof(rh));
+    rh.type = MSG_CHAT;
+    rh.seq  = hdr->seq;
+
+    const char *text     = z + 1;
+    uint32_t    text_len = rest_len - (uint32_t)(z - rest) - 1;
+    Peer       *target   = peer_find_by_name(to);
+    if (target) {
+        peer_send(target, &rh, rest, rest_len);
+        msgstore_append(rest, to, text, text_len, 0);
+    } else if (msgstore_known(to)) {
+        msgstore_append(rest, to, text, text_len, 1);
+    } else {
+        broadcast_to_all(&rh, rest, rest_len, link->peer.fd);
+    }
+    util_log(LOG_INFO, "server: chat from \"%s\" via \"%s\" to \"%s\"", rest, link->peer.name, to);
+}
+
+/* ── Transfer routes ─────────────────────────────────────── */
+
+/* Transfer IDs keep a per-process salt in the high half and a counter in
+ * the low half, so mix before masking */
+static uint32_t route_home(uint32_t id)
+{
+    id ^= id >> 16;
+    id *= 0x45d9f3bu;
+    id ^= id >> 16;
+    return id & (uint32_t)(route_cap - 1);
+}
+
+static Route *route_find(uint32_t id)
+{
+    if (route_count == 0 || id == 0) return NULL;
+    for (uint32_t i = route_home(id); ; i = (i + 1) & (route_cap - 1)) {
+        if (routes[i].id == id) return &routes[i];
+        if (routes[i].id == 0)  return NULL;
+    }
+}
+
+static Route *route_insert(uint32_t id)
+{
+    if ((route_count + 1) * 2 > route_cap) {
+        int    ocap = route_cap;
+        Route *old  = routes;
+        int    ncap = ocap ? ocap * 2 : 64;
+        Route *n    = (Route *)calloc(ncap, sizeof(Route));
+        if (!n) return NULL;
+
+        routes    = n;
+        route_cap = ncap;
+        for (int i = 0; i < ocap; i++) {
+            if (old[i].id == 0) continue;
+            uint32_t j = route_home(old[i].id);
+            while (n[j].id != 0) j = (j + 1) & (ncap - 1);
+            n[j] = old[i];
+        }
+        free(old);
+    }
+
+    uint32_t i = route_home(id);
+    while (routes[i].id != 0) i = (i + 1) & (route_cap - 1);
+    memset(&routes[i], 0, sizeof(Route));
+    routes[i].id = id;
+    route_count++;
+    return &routes[i];
+}
+
+/* Backward-shift deletion keeps probe chains intact without tombstones */
+static void route_remove(Route *r)
+{
+    uint32_t mask = (uint32_t)route_cap - 1;
+    uint32_t hole = (uint32_t)(r - routes);
+
+    free(r->acked_map);
+    routes[hole].id = 0;
+    route_count--;
+
+    for (uint32_t i = (hole + 1) & mask; routes[i].id != 0; i = (i + 1) & mask) {
+        uint32_t home = route_home(routes[i].id);
+        /* Move the entry back if the hole lies between its home and here */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            routes[hole] = routes[i];
+            routes[i].id = 0;
+            hole = i;
+        }
+    }
+}
+
+static void route_drop_conn(Conn *c)
+{
+    for (int i = 0; i < route_cap; ) {
+        if (routes[i].id != 0 && (routes[i].sender == c || routes[i].receiver == c))
+            route_remove(&routes[i]);   /* may shift a later entry into i */
+        else
+            i++;
+    }
+}
+
+/* Returns 1 once the receiver has ACKed every chunk */
+static int route_mark_acked(Route *r, uint32_t seq)
+{
+    if (seq >= r->total) return 0;
+    uint8_t bit = (uint8_t)(1u << (seq & 7));
+    if (!(r->acked_map[seq >> 3] & bit)) {
+        r->acked_map[seq >> 3] |= bit;
+        r->acked++;
+    }
+    return r->acked == r->total;
+}
+
+/* A MSG_FILE_HAVE bitmap: chunks the receiver kept from before, which it
+ * will never ACK.  Counted like ACKs so a resumed transfer still completes. */
+static void route_mark_have(Route *r, const uint8_t *map, uint32_t len)
+{
+    for (uint32_t seq = 0; seq < r->total && seq / 8 < len; seq++)
+        if (map[seq / 8] & (1u << (seq % 8)))
+            route_mark_acked(r, seq);
+}
+
+static void send_meta_nack(Conn *c, uint32_t id)
+{
+    PktHeader nh;
+    memset(&nh, 0, sizeof(nh));
+    nh.type      = MSG_FILE_NACK;
+    nh.flags     = PKT_FLAG_META;
+    nh.stream_id = id;
+    peer_send(&c->peer, &nh, NULL, 0);
 }
 
-static void handle_packet(int fd, PktHeader *hdr, const char *payload)
+/* The receiver's queue shed a chunk: NACK it at once so the sender resends
+ * it without waiting out (and backing off) its retransmit timer */
+static void send_shed_nack(Conn *c, uint32_t id, uint32_t seq)
+{
+    PktHeader nh;
+    memset(&nh, 0, sizeof(nh));
+    nh.type      = MSG_FILE_NACK;
+    nh.flags     = PKT_FLAG_SHED;
+    nh.stream_id = id;
+    nh.seq       = seq;
+    peer_send(&c->peer, &nh, NULL, 0);
+}
+
+/* payload: see WireMeta */
+static void route_meta(Conn *c, PktHeader *hdr, const char *payload)
+{
+    WireMeta m;
+    if (wire_parse_meta(hdr, (const uint8_t *)payload, &m) < 0 || hdr->stream_id == 0) return;
+
+    uint32_t total  = m.total_chunks;
+    Peer    *target = peer_find_by_name(m.recipient);
+    Conn    *far    = target || c->peer.link ? NULL : (Conn *)names_get(&remotes, m.recipient);
+    if (far) target = &far->peer;         /* one hop: links only deliver locally */
+    Route *r      = route_find(hdr->stream_id);
+    if (!target || target->version < PROTO_V2 || (Conn *)target == c ||
+        (r && r->sender != c)) {
+        util_log(LOG_WARN, "server: can't route transfer %u from \"%s\" to \"%s\"",
+                 hdr->stream_id, c->peer.name, m.recipient);
+        send_meta_nack(c, hdr->stream_id);
+        return;
+    }
+
+    if (!r && !(r = route_insert(hdr->stream_id))) { send_meta_nack(c, hdr->stream_id); return; }
+    free(r->acked_map);
+    r->sender    = c;
+    r->receiver  = (Conn *)target;
+    r->total     = total;
+    r->acked     = 0;
+    r->acked_map = (uint8_t *)calloc((total + 7) / 8 + 1, 1);
+    if (!r->acked_map) { route_remove(r); send_meta_nack(c, hdr->stream_id); return; }
+
+    peer_send(target, hdr, payload, hdr->payload_len);
+    util_log(LOG_INFO, "server: routing transfer %u \"%s\" -> \"%s\" (%u chunks)",
+             r->id, c->peer.name, target->name, total);
+}
+
+/* Chunks and pause/resume go sender -> receiver, ACK/NACK/HAVE come back */
+static void route_follow_up(Conn *c, PktHeader *hdr, const char *payload)
+{
+    Route *r = route_find(hdr->stream_id);
+    if (!r || (c != r->sender && c != r->receiver)) return;
+
+    Conn *to = c == r->sender ? r->receiver : r->sender;
+    if (peer_send(&to->peer, hdr, payload, hdr->payload_len) < 0 &&
+        hdr->type == MSG_FILE_CHUNK && c == r->sender && !to->dead)
+        send_shed_nack(c, r->id, hdr->seq);
+
+    if (c != r->receiver) return;
+    if (hdr->type == MSG_FILE_HAVE)
+        route_mark_have(r, (const uint8_t *)payload, hdr->payload_len);
+    else if (hdr->type == MSG_FILE_NACK && (hdr->flags & PKT_FLAG_META))
+        route_remove(r);    /* receiver refused the transfer */
+    else if ((hdr->flags & (PKT_FLAG_META | PKT_FLAG_DIRECT)) == (PKT_FLAG_META | PKT_FLAG_DIRECT)) {
+        util_log(LOG_INFO, "server: transfer %u went peer to peer, route released", r->id);
+        route_remove(r);    /* chunks flow between the peers themselves */
+    }
+    else if (hdr->type == MSG_FILE_ACK && (hdr->flags & PKT_FLAG_META) && r->acked == r->total) {
+        /* The HAVE ahead of this reply covered every chunk: nothing to relay */
+        util_log(LOG_INFO, "server: transfer %u complete, route released", r->id);
+        route_remove(r);
+    }
+    else if (hdr->type == MSG_FILE_ACK && !(hdr->flags & PKT_FLAG_META) &&
+             route_mark_acked(r, hdr->seq)) {
+        util_log(LOG_INFO, "server: transfer %u complete, route released", r->id);
+        route_remove(r);
+    }
+}
+
+/* ── Routing ─────────────────────────────────────────────── */
+
+/* A chat kept while its recipient was away.  Queued like any other, so the
+ * whole backlog leaves in the batched writes at the end of this wakeup. */
+static void replay_chat(const StoredMsg *m, void *arg)
 {
+    Conn    *c  = (Conn *)arg;
+    char     buf[MAX_MSG + MAX_NAME];
+    uint32_t fl = (uint32_t)strlen(m->from) + 1, tl = (uint32_t)strlen(m->text);
+    memcpy(buf, m->from, fl);
+    memcpy(buf + fl, m->text, tl);
+
+    PktHeader h;
+    memset(&h, 0, sizeof(h));
+    h.type  = MSG_CHAT;
+    h.flags = PKT_FLAG_STORED;
+    h.seq   = (uint32_t)(m->ts_ms / 1000);
+    peer_send(&c->peer, &h, buf, fl + tl);
+}
+
+static void handle_packet(Conn *c, PktHeader *hdr, const char *payload)
+{
+    int fd = c->peer.fd;
+
     switch (hdr->type) {
 
     case MSG_HELLO: {
-        pthread_mutex_lock(&peer_lock);
-        for (int i = 0; i < peer_count; i++) {
-            if (peers[i].fd == fd) {
-                snprintf(peers[i].name, MAX_NAME, "%.*s",
-                         hdr->payload_len < MAX_NAME ? hdr->payload_len : MAX_NAME - 1,
-                         payload);
-                util_log(LOG_INFO, "server: peer fd=%d identified as \"%s\"", fd, peers[i].name);
+        if (c->dialed) {
+            fed_hello_reply(c, hdr, payload);
+            break;
+        }
+
+        /* payload: "username" [ "\0" max_version(1B) [ HELLO_* bits(1B) ] ]
+         * — v1 clients send only the name and get no reply */
+        const char *sep = memchr(payload, '\0', hdr->payload_len);
+        int name_len = sep ? (int)(sep - payload) : (int)hdr->payload_len;
+        int offered  = (sep && sep + 1 < payload + hdr->payload_len)
+                       ? (uint8_t)sep[1] : PROTO_V1;
+        int version  = offered > PROTO_VERSION ? PROTO_VERSION : offered;
+        int bits     = (sep && sep + 2 < payload + hdr->payload_len) ? (uint8_t)sep[2] : 0;
+
+        if (bits & HELLO_LINK) {
+            char name[MAX_NAME];
+            snprintf(name, MAX_NAME, "%.*s", name_len < MAX_NAME ? name_len : MAX_NAME - 1, payload);
+            if (!federate || offered < PROTO_V2 || fed_find_link(name)) {
+                util_log(LOG_WARN, "server: refusing link from \"%s\"", name);
+                conn_kill(c);
                 break;
             }
         }
+
+        /* A repeated HELLO renames: linked servers forget the old name */
+        if (c->named && federate)
+            fed_roster_send(NULL, MSG_PEER_LEAVE, c->peer.name, (uint32_t)strlen(c->peer.name) + 1);
+        dir_unlist(c);
+        pthread_mutex_lock(&peer_lock);
+        snprintf(c->peer.name, MAX_NAME, "%.*s",
+                 name_len < MAX_NAME ? name_len : MAX_NAME - 1, payload);
         pthread_mutex_unlock(&peer_lock);
+
+        if (offered >= PROTO_V2) {
+            char reply[MAX_NAME + 1];
+            int  slen = (int)strlen(server_name);
+            memcpy(reply, server_name, slen + 1);
+            reply[slen + 1] = (char)version;
+
+            PktHeader rh;
+            memset(&rh, 0, sizeof(rh));
+            rh.type = MSG_HELLO;
+            peer_send(&c->peer, &rh, reply, (uint32_t)slen + 2);
+        }
+        c->peer.version = version;
+        if (bits & HELLO_LINK) {
+            fed_link_up(c);
+            break;
+        }
+        c->named = 1;
+        dir_list(c);
+        if (federate)
+            fed_roster_send(NULL, MSG_PEER_JOIN, c->peer.name, (uint32_t)strlen(c->peer.name) + 1);
+        util_log(LOG_INFO, "server: peer fd=%d identified as \"%s\" (protocol v%d)",
+                 fd, c->peer.name, version);
+
+        msgstore_touch(c->peer.name);
+        int missed = c->listed ? msgstore_replay(c->peer.name, replay_chat, c) : 0;
+        if (missed)
+            util_log(LOG_INFO, "server: replayed %d chats to \"%s\"", missed, c->peer.name);
         break;
     }
 
     case MSG_CHAT: {
+        if (c->peer.link) {
+            fed_chat_in(c, hdr, payload);
+            break;
+        }
+
         /* payload format: "recipient\0message" */
-        const char *sep = memchr(payload, '\0', hdr->payload_len);
-        if (!sep) break;
+        const char *to, *msg;
+        uint32_t    text_len;
+        if (wire_parse_chat(hdr, (const uint8_t *)payload, &to, &msg, &text_len) < 0 ||
+            text_len > MAX_MSG || strnlen(to, MAX_NAME) >= MAX_NAME)
+            break;
+        int msg_len = (int)text_len;
 
-        const char *to  = payload;
-        const char *msg = sep + 1;
-        int msg_len = hdr->payload_len - (int)(msg - payload);
+        const char *sender = c->peer.name;
 
-        /* Find sender name */
-        char sender[MAX_NAME] = "unknown";
-        pthread_mutex_lock(&peer_lock);
-        for (int i = 0; i < peer_count; i++)
-            if (peers[i].fd == fd) { snprintf(sender, MAX_NAME, "%s", peers[i].name); break; }
-        pthread_mutex_unlock(&peer_lock);
+        if (to[0] == ROOM_PREFIX) {
+            Room *r = room_get(to, 0);
+            if (!r || room_ref(c, r) < 0) {
+                util_log(LOG_WARN, "server: \"%s\" isn't in room \"%s\"", sender, to);
+                break;
+            }
+            room_send(r, hdr->seq, sender, msg, text_len, c);
+            if (link_count) fed_chat_out(NULL, hdr->seq, to, sender, msg, text_len);
+            util_log(LOG_INFO, "server: chat from \"%s\" to \"%s\" (%d bytes, %d members)",
+                     sender, to, msg_len, r->count);
+            break;
+        }
 
-        /* Build routed packet: "sender\0message" */
-        char route_buf[MAX_MSG + MAX_NAME + sizeof(PktHeader)];
-        int route_payload_len = (int)strlen(sender) + 1 + msg_len;
+        /* Build routed payload: "sender\0message" */
+        char route_buf[MAX_MSG + MAX_NAME];
+        int  sender_len = (int)strlen(sender) + 1;
+        memcpy(route_buf, sender, sender_len);
+        memcpy(route_buf + sender_len, msg, msg_len);
 
         PktHeader rh;
-        rh.type        = MSG_CHAT;
-        rh.seq         = hdr->seq;
-        rh.payload_len = (uint16_t)route_payload_len;
+        memset(&rh, 0, sizeof(rh));
+        rh.type = MSG_CHAT;
+        rh.seq  = hdr->seq;
 
-        memcpy(route_buf, &rh, sizeof(PktHeader));
-        memcpy(route_buf + sizeof(PktHeader), sender, strlen(sender) + 1);
-        memcpy(route_buf + sizeof(PktHeader) + strlen(sender) + 1, msg, msg_len);
-
-        pthread_mutex_lock(&peer_lock);
         Peer *target = peer_find_by_name(to);
+        Conn *far    = target ? NULL : (Conn *)names_get(&remotes, to);
         if (target) {
-            send_all(target->fd, route_buf, sizeof(PktHeader) + route_payload_len);
+            peer_send(target, &rh, route_buf, (uint32_t)(sender_len + msg_len));
+            msgstore_append(sender, to, msg, text_len, 0);
+        } else if (far) {
+            fed_chat_out(far, hdr->seq, to, sender, msg, (uint32_t)msg_len);
+            msgstore_append(sender, to, msg, text_len, 0);
+        } else if (msgstore_known(to)) {
+            msgstore_append(sender, to, msg, text_len, 1);
+            util_log(LOG_INFO, "server: \"%s\" is away, keeping chat from \"%s\"", to, sender);
+            break;
         } else {
-            broadcast_to_all(route_buf, sizeof(PktHeader) + route_payload_len, fd);
+            broadcast_to_all(&rh, route_buf, (uint32_t)(sender_len + msg_len), fd);
+            if (link_count) fed_chat_out(NULL, hdr->seq, to, sender, msg, (uint32_t)msg_len);
         }
-        pthread_mutex_unlock(&peer_lock);
 
         util_log(LOG_INFO, "server: chat from \"%s\" to \"%s\" (%d bytes)", sender, to, msg_len);
         break;
@@ -153,41 +1330,54 @@ static void handle_packet(int fd, PktHeader *hdr, const char *payload)
     case MSG_FILE_ACK:
     case MSG_FILE_NACK:
     case MSG_PAUSE:
-    case MSG_RESUME: {
-        /* File messages: payload starts with "recipient\0..." for META,
-         * or xfer_id(4B) for CHUNK/ACK/NACK/PAUSE/RESUME.
-         * Route the entire packet (header + payload) to the target peer. */
-        const char *to = NULL;
-        if (hdr->type == MSG_FILE_META) {
-            to = payload;
-        } else {
-            /* For chunk/ack/nack/pause/resume, we forward to all other peers
-             * since the xfer_id identifies the transfer on both sides */
-            char fwd_buf[CHUNK_SIZE + 256 + sizeof(PktHeader)];
-            memcpy(fwd_buf, hdr, sizeof(PktHeader));
-            memcpy(fwd_buf + sizeof(PktHeader), payload, hdr->payload_len);
-            broadcast_to_all(fwd_buf, sizeof(PktHeader) + hdr->payload_len, fd);
+    case MSG_RESUME:
+    case MSG_FILE_HAVE:
+    case MSG_FILE_MANIFEST: {
+        /* File messages: META payload starts with "recipient\0..." and
+         * sets up the route; the rest follow it by hdr->stream_id. */
+        if (hdr->version < PROTO_V2) {
+            util_log(LOG_WARN, "server: dropping v1 file packet from fd=%d", fd);
             break;
         }
 
-        /* Route META to target peer */
-        char fwd_buf[MAX_MSG + sizeof(PktHeader)];
-        memcpy(fwd_buf, hdr, sizeof(PktHeader));
-        memcpy(fwd_buf + sizeof(PktHeader), payload, hdr->payload_len);
+        if (hdr->type == MSG_FILE_META)
+            route_meta(c, hdr, payload);
+        else
+            route_follow_up(c, hdr, payload);
+        break;
+    }
 
-        pthread_mutex_lock(&peer_lock);
-        Peer *target = peer_find_by_name(to);
-        if (target) {
-            send_all(target->fd, fwd_buf, sizeof(PktHeader) + hdr->payload_len);
+    case MSG_ROOM_JOIN:
+    case MSG_ROOM_LEAVE: {
+        /* payload: "#room", NUL optional; clients on v2 only */
+        const char *z = (const char *)memchr(payload, '\0', hdr->payload_len);
+        uint32_t    n = z ? (uint32_t)(z - payload) : hdr->payload_len;
+        if (!c->named || hdr->version < PROTO_V2 || n < 2 || n >= MAX_NAME ||
+            payload[0] != ROOM_PREFIX) {
+            util_log(LOG_WARN, "server: bad room request from fd=%d", fd);
+            break;
+        }
+
+        char name[MAX_NAME];
+        memcpy(name, payload, n);
+        name[n] = '\0';
+        if (hdr->type == MSG_ROOM_JOIN) {
+            room_join(c, name);
         } else {
-            broadcast_to_all(fwd_buf, sizeof(PktHeader) + hdr->payload_len, fd);
+            Room *r   = room_get(name, 0);
+            int   ref = r ? room_ref(c, r) : -1;
+            if (ref >= 0) room_leave(c, ref);
         }
-        pthread_mutex_unlock(&peer_lock);
         break;
     }
 
+    case MSG_PEER_JOIN:
+    case MSG_PEER_LEAVE:
+        if (c->peer.link) fed_roster_in(c, hdr, payload);
+        break;
+
     case MSG_BYE:
-        peer_remove(fd);
+        conn_kill(c);
         break;
 
     default:
@@ -196,10 +1386,380 @@ static void handle_packet(int fd, PktHeader *hdr, const char *payload)
     }
 }
 
+/* ── Pass-through ────────────────────────────────────────── */
+
+/* A routed chunk whose payload hasn't fully arrived skips rbuf.  With splice
+ * the payload goes socket -> pipe -> socket and never enters userspace; the
+ * receiver is held for the duration so nothing interleaves with it.  When
+ * the receiver is busy (or there is no splice) the payload is received
+ * straight into the packet buffer that will be queued for sending. */
+
+static char pass_scratch[64 * 1024];
+
+#ifdef __linux__
+static int pipe_open(Conn *c)
+{
+    if (c->pipe_fd[0] >= 0) return 0;
+    if (!splice_ok) return -1;
+
+    if (pipe2(c->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        util_log(LOG_WARN, "server: pipe2: %s; relaying chunks by copy", strerror(errno));
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+        splice_ok = 0;
+        return -1;
+    }
+    fcntl(c->pipe_fd[1], F_SETPIPE_SZ, CHUNK_SIZE_BULK);    /* best effort */
+    return 0;
+}
+#endif
+
+/* Give the receiver its queue back; the source skips what's left */
+static void pass_detach(Conn *src)
+{
+    Conn *dst = src->pass_dst;
+    if (dst) {
+        dst->splice_src  = NULL;
+        dst->splice_lead = 0;
+    }
+    src->pass_dst  = NULL;
+    src->pass_mode = PASS_DISCARD;
+}
+
+static void pass_begin(Conn *c, const PktHeader *hdr, const char *payload, uint32_t have)
+{
+    Route *r   = route_find(hdr->stream_id);
+    Conn  *dst = (r && r->sender == c && !r->receiver->dead) ? r->receiver : NULL;
+
+    c->pass_left = hdr->payload_len - have;
+    c->pass_id   = hdr->stream_id;
+    c->pass_seq  = hdr->seq;
+    c->pass_mode = PASS_DISCARD;
+    if (!dst) return;
+
+#ifdef __linux__
+    if (dst->out_count == 0 && !dst->splice_src && pipe_open(c) == 0) {
+        PktBuf *b = pktbuf_start(dst->peer.version, hdr, payload, have, hdr->payload_len);
+        if (b && conn_enqueue(dst, b, 1) == 0) {
+            dst->splice_src  = c;
+            dst->splice_lead = dst->out_count;  /* header tail the socket didn't take */
+            c->pass_dst  = dst;
+            c->pass_mode = PASS_SPLICE;
+        } else if (b && !dst->dead) {
+            send_shed_nack(c, hdr->stream_id, hdr->seq);
+        }
+        pool_put(b);
+        return;
+    }
+#endif
+    c->pass_pkt = pktbuf_start(dst->peer.version, hdr, payload, have, hdr->payload_len);
+    if (c->pass_pkt) c->pass_mode = PASS_COPY;
+}
+
+static int copy_pump(Conn *c)
+{
+    PktBuf *b = c->pass_pkt;
+    while (c->pass_left > 0) {
+        ssize_t n = recv(c->peer.fd, b->data + b->len, c->pass_left, 0);
+        if (n > 0) {
+            b->len += (uint32_t)n;
+            c->pass_left -= (uint32_t)n;
+            c->peer.bytes_in += (uint64_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        conn_kill(c);
+        return -1;
+    }
+
+    /* Look the route up again: the receiver may have left meanwhile */
+    Route *r = route_find(c->pass_id);
+    if (r && r->sender == c && conn_enqueue(r->receiver, b, 1) < 0 && !r->receiver->dead)
+        send_shed_nack(c, c->pass_id, c->pass_seq);
+    pool_put(b);
+    c->pass_pkt  = NULL;
+    c->pass_mode = PASS_NONE;
+    return 1;
+}
+
+static int discard_pump(Conn *c)
+{
+    while (c->pipe_len > 0) {
+        size_t  want = c->pipe_len < sizeof(pass_scratch) ? c->pipe_len : sizeof(pass_scratch);
+        ssize_t n    = read(c->pipe_fd[0], pass_scratch, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { conn_kill(c); return -1; }
+        c->pipe_len -= (uint32_t)n;
+    }
+    while (c->pass_left > 0) {
+        size_t  want = c->pass_left < sizeof(pass_scratch) ? c->pass_left : sizeof(pass_scratch);
+        ssize_t n    = recv(c->peer.fd, pass_scratch, want, 0);
+        if (n > 0) { c->pass_left -= (uint32_t)n; c->peer.bytes_in += (uint64_t)n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        conn_kill(c);
+        return -1;
+    }
+    c->pass_mode = PASS_NONE;
+    return 1;
+}
+
+#ifdef __linux__
+static int splice_pump(Conn *c)
+{
+    Conn *dst = c->pass_dst;
+
+    for (;;) {
+        if (dst->dead) { pass_detach(c); return discard_pump(c); }
+        if (dst->splice_lead > 0) return 0;     /* conn_flush(dst) calls back */
+
+        while (c->pipe_len > 0) {
+            unsigned fl = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (c->pass_left ? SPLICE_F_MORE : 0);
+            ssize_t  n  = splice(c->pipe_fd[0], NULL, dst->peer.fd, NULL, c->pipe_len, fl);
+            if (n > 0) {
+                c->pipe_len -= (uint32_t)n;
+                dst->peer.bytes_out += (uint64_t)n;
+                metrics_add(MET_RELAY_BYTES, (uint64_t)n);
+                dst->drained_us = util_time_us();
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            conn_kill(dst);
+            pass_detach(c);
+            return discard_pump(c);
+        }
+
+        if (c->pass_left == 0) {
+            /* Release the receiver and send what queued up behind us */
+            c->pass_mode = PASS_NONE;
+            c->pass_dst  = NULL;
+            dst->splice_src = NULL;
+            conn_flush(dst);
+            return 1;
+        }
+
+        /* The pipe is empty here, so EAGAIN can only mean the socket is */
+        ssize_t n = splice(c->peer.fd, NULL, c->pipe_fd[1], NULL, c->pass_left,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            c->pass_left -= (uint32_t)n;
+            c->pipe_len  += (uint32_t)n;
+            c->peer.bytes_in += (uint64_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            util_log(LOG_WARN, "server: splice unsupported (%s); relaying chunks by copy",
+                     strerror(errno));
+            splice_ok = 0;
+        }
+        conn_kill(c);
+        return -1;
+    }
+}
+#endif
+
+/* Returns 1 once the payload is through, 0 while waiting on either socket,
+ * -1 if the source is gone */
+static int pass_pump(Conn *c)
+{
+    if (c->dead) return -1;
+
+    switch (c->pass_mode) {
+    case PASS_COPY:    return copy_pump(c);
+#ifdef __linux__
+    case PASS_SPLICE:  return splice_pump(c);
+#endif
+    case PASS_DISCARD: return discard_pump(c);
+    default:           return 1;
+    }
+}
+
+/* A source that leaves mid-splice strands its receiver inside a packet.
+ * Whatever reached the pipe is still delivered and the rest zero-filled so
+ * the receiver keeps its framing; the transfer is dead with its sender. */
+static void pass_abort(Conn *c)
+{
+    if (c->pass_mode == PASS_SPLICE && c->pass_dst) {
+        Conn    *dst = c->pass_dst;
+        int      pos = dst->splice_lead;
+        uint32_t pad = c->pipe_len + c->pass_left;
+        PktBuf  *b   = pool_get(pad);
+
+        pass_detach(c);
+        util_log(LOG_WARN, "server: transfer %u lost its sender mid-chunk, padding %u bytes to \"%s\"",
+                 c->pass_id, pad, dst->peer.name);
+
+        if (b) {
+            ssize_t n = c->pipe_len ? read(c->pipe_fd[0], b->data, c->pipe_len) : 0;
+            if (n < 0) n = 0;
+            memset(b->data + n, 0, pad - (uint32_t)n);
+            b->len = pad;
+        }
+        if (!b || outq_insert(dst, pos, b) < 0)
+            conn_kill(dst);
+        pool_put(b);
+        conn_flush(dst);
+    }
+
+    pool_put(c->pass_pkt);
+    c->pass_pkt  = NULL;
+    c->pass_mode = PASS_NONE;
+}
+
+/* ── Input ───────────────────────────────────────────────── */
+
+static int rbuf_reserve(Conn *c, size_t need)
+{
+    if (need <= c->rcap) return 0;
+
+    size_t ncap = c->rcap ? c->rcap : CONN_RBUF_INIT;
+    while (ncap < need) ncap *= 2;
+    char *n = (char *)realloc(c->rbuf, ncap);
+    if (!n) return -1;
+    c->rbuf = n;
+    c->rcap = ncap;
+    return 0;
+}
+
+/* Dispatch every complete packet in rbuf, keep the partial tail */
+static void conn_parse(Conn *c)
+{
+    size_t off = 0;
+
+    while (!c->dead) {
+        int       hsize = wire_hdr_size(c->peer.version);
+        PktHeader hdr;
+        long      total = wire_frame(c->peer.version, (const uint8_t *)c->rbuf + off,
+                                     c->rlen - off, &hdr);
+
+        /* Still framed: skip what we can't hold instead of hanging up */
+        if (total == WIRE_ERR_SIZE) {
+            uint32_t have = (uint32_t)(c->rlen - off - hsize);
+            util_log(LOG_WARN, "server: skipping a %u-byte packet from fd=%d",
+                     hdr.payload_len, c->peer.fd);
+            if (have >= hdr.payload_len) {
+                off += (size_t)hsize + hdr.payload_len;
+                continue;
+            }
+            c->pass_left = hdr.payload_len - have;
+            c->pass_mode = PASS_DISCARD;
+            off = c->rlen;
+            break;
+        }
+        if (total < 0) {
+            util_log(LOG_WARN, "server: malformed header from fd=%d", c->peer.fd);
+            conn_kill(c);
+            return;
+        }
+
+        if (total == 0) {
+            if (c->rlen - off < (size_t)hsize) break;
+            uint32_t have = (uint32_t)(c->rlen - off - hsize);
+            if (hdr.type == MSG_FILE_CHUNK && hdr.version >= PROTO_V2 &&
+                hdr.payload_len - have >= PASS_MIN) {
+                metrics_add(MET_RELAY_PACKETS, 1);
+                pass_begin(c, &hdr, c->rbuf + off + hsize, have);
+                off = c->rlen;
+                break;
+            }
+
+            /* Make room for the whole packet so the next reads land in place */
+            if (off > 0) break;
+            if (rbuf_reserve(c, (size_t)hsize + hdr.payload_len) < 0) conn_kill(c);
+            return;
+        }
+
+        metrics_add(MET_RELAY_PACKETS, 1);
+        handle_packet(c, &hdr, c->rbuf + off + hsize);
+        off += (size_t)total;
+    }
+
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+    if (c->rlen == 0 && c->rcap > CONN_RBUF_KEEP) {
+        free(c->rbuf);
+        c->rbuf = NULL;
+        c->rcap = 0;
+    }
+}
+
+/* Edge-triggered: keep reading until the socket says EAGAIN */
+static void conn_read(Conn *c)
+{
+    while (!c->dead) {
+        if (c->pass_mode != PASS_NONE) {
+            if (pass_pump(c) <= 0) return;
+            continue;
+        }
+
+        if (c->rlen == c->rcap && rbuf_reserve(c, c->rcap ? c->rcap * 2 : CONN_RBUF_INIT) < 0) {
+            conn_kill(c);
+            return;
+        }
+
+        ssize_t n = recv(c->peer.fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+        if (n > 0) {
+            c->rlen += (size_t)n;
+            c->peer.bytes_in += (uint64_t)n;
+            conn_parse(c);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        conn_kill(c);   /* EOF or hard error */
+        return;
+    }
+}
+
+static void accept_all(void)
+{
+    for (;;) {
+        struct sockaddr_in cli;
+        socklen_t clen = sizeof(cli);
+        int cfd = accept(listen_fd, (struct sockaddr *)&cli, &clen);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                util_log(LOG_WARN, "server accept: %s", strerror(errno));
+            return;
+        }
+
+        util_set_nonblocking(cfd);
+        util_set_nodelay(cfd);
+        char ip[46];
+        inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip));
+
+        Conn *c = peer_add(cfd, ip, ntohs(cli.sin_port));
+        if (!c || poller_add(poller, cfd, POLL_IN | POLL_OUT, c) < 0) {
+            util_log(LOG_ERROR, "server: cannot track fd=%d", cfd);
+            if (c) conn_kill(c); else close(cfd);
+            continue;
+        }
+        util_log(LOG_INFO, "server: new connection from %s:%d (fd=%d)", ip, ntohs(cli.sin_port), cfd);
+    }
+}
+
+/* Hundreds of peers need more descriptors than the usual soft limit */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
 static void *server_loop(void *arg)
 {
     (void)arg;
 
+    raise_fd_limit();
+
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) { util_log(LOG_ERROR, "server socket: %s", strerror(errno)); return NULL; }
 
@@ -209,7 +1769,7 @@ static void *server_loop(void *arg)
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family      = AF_INET;
-    addr.sin_port        = htons(DATA_PORT);
+    addr.sin_port        = htons(data_port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
@@ -218,81 +1778,70 @@ static void *server_loop(void *arg)
         return NULL;
     }
 
-    if (listen(listen_fd, 8) < 0) {
+    if (listen(listen_fd, SOMAXCONN) < 0) {
         util_log(LOG_ERROR, "server listen: %s", strerror(errno));
         close(listen_fd); listen_fd = -1;
         return NULL;
     }
 
-    util_log(LOG_INFO, "server: listening on port %d as \"%s\"", DATA_PORT, server_name);
-    discovery_start_announce(server_name, DATA_PORT);
-
-    while (running) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(listen_fd, &rfds);
-        int maxfd = listen_fd;
+    util_set_nonblocking(listen_fd);
+    if (poller_add(poller, listen_fd, POLL_IN, &listen_fd) < 0) {
+        util_log(LOG_ERROR, "server: poller_add: %s", strerror(errno));
+        close(listen_fd); listen_fd = -1;
+        return NULL;
+    }
 
-        pthread_mutex_lock(&peer_lock);
-        for (int i = 0; i < peer_count; i++) {
-            FD_SET(peers[i].fd, &rfds);
-            if (peers[i].fd > maxfd) maxfd = peers[i].fd;
-        }
-        pthread_mutex_unlock(&peer_lock);
+    util_log(LOG_INFO, "server: listening on port %d as \"%s\"%s", data_port, server_name,
+             federate ? ", federating" : "");
+    if (history_path[0]) msgstore_open(history_path);
+    discovery_start_announce(server_name, data_port,
+                             DISC_CAP_V1 | DISC_CAP_FILES | (federate ? DISC_CAP_LINK : 0));
+    if (federate) {
+        discovery_set_notify(fed_notify);
+        discovery_start_scan();
+    }
 
-        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-        int ready = select(maxfd + 1, &rfds, NULL, NULL, &tv);
-        if (ready < 0) { if (errno == EINTR) continue; break; }
-        if (ready == 0) continue;
-
-        if (FD_ISSET(listen_fd, &rfds)) {
-            struct sockaddr_in cli;
-            socklen_t clen = sizeof(cli);
-            int cfd = accept(listen_fd, (struct sockaddr *)&cli, &clen);
-            if (cfd >= 0) {
-                char ip[46];
-                inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip));
-                util_log(LOG_INFO, "server: new connection from %s:%d (fd=%d)", ip, ntohs(cli.sin_port), cfd);
-                peer_add(cfd, ip, ntohs(cli.sin_port));
-            }
+    long next_fed = 0;
+    while (running) {
+        PollEvent evs[256];
+        int timeout = -1;
+        if (federate) {
+            long left = next_fed - util_time_ms();
+            timeout = left > 0 ? (int)left : 0;
         }
+        int n = poller_wait(poller, evs, 256, timeout);
+        if (n < 0) break;
 
-        pthread_mutex_lock(&peer_lock);
-        int snapshot_count = peer_count;
-        int snapshot_fds[MAX_PEERS];
-        for (int i = 0; i < snapshot_count; i++)
-            snapshot_fds[i] = peers[i].fd;
-        pthread_mutex_unlock(&peer_lock);
-
-        for (int i = 0; i < snapshot_count; i++) {
-            int fd = snapshot_fds[i];
-            if (!FD_ISSET(fd, &rfds)) continue;
-
-            PktHeader hdr;
-            ssize_t n = recv(fd, &hdr, sizeof(hdr), MSG_WAITALL);
-            if (n <= 0) { peer_remove(fd); continue; }
-
-            char payload[CHUNK_SIZE + 256];
-            int max_payload = (int)sizeof(payload);
-            if (hdr.payload_len > 0 && hdr.payload_len <= max_payload) {
-                n = recv(fd, payload, hdr.payload_len, MSG_WAITALL);
-                if (n <= 0) { peer_remove(fd); continue; }
-            } else if (hdr.payload_len > 0) {
-                peer_remove(fd); continue;
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data == &listen_fd) {
+                accept_all();
+                continue;
             }
 
-            handle_packet(fd, &hdr, payload);
+            Conn *c = (Conn *)evs[i].data;
+            if (evs[i].events & POLL_OUT) conn_flush(c);
+            if (evs[i].events & POLL_IN)  conn_read(c);
         }
+        if (federate && (__atomic_exchange_n(&fed_pending, 0, __ATOMIC_ACQUIRE) ||
+                         util_time_ms() >= next_fed)) {
+            fed_tick();
+            next_fed = util_time_ms() + FED_RETRY_MS;
+        }
+        do {
+            flush_batched();
+            reap_dead();    /* a close can restart a held chunk's source */
+        } while (flush_count > 0 || dead_head);
     }
 
     discovery_stop_announce();
+    if (federate) discovery_set_notify(NULL);
 
-    pthread_mutex_lock(&peer_lock);
-    for (int i = 0; i < peer_count; i++)
-        close(peers[i].fd);
-    peer_count = 0;
-    pthread_mutex_unlock(&peer_lock);
+    while (peer_count > 0)
+        peer_remove(conns[peer_count - 1]);
+    dead_head = dead_tail = NULL;   /* all freed above */
 
+    msgstore_close();
+    poller_del(poller, listen_fd);
     close(listen_fd);
     listen_fd = -1;
     return NULL;
@@ -301,16 +1850,38 @@ static void *server_loop(void *arg)
 void server_start(const char *name)
 {
     if (running) return;
+
+    poller = poller_create();
+    if (!poller) return;
+
     running = 1;
     snprintf(server_name, MAX_NAME, "%s", name);
     pthread_create(&server_thread, NULL, server_loop, NULL);
 }
 
+void server_set_data_port(uint16_t port)
+{
+    data_port = port;
+}
+
+void server_set_federate(int on)
+{
+    federate = on;
+}
+
+void server_set_history(const char *path)
+{
+    snprintf(history_path, sizeof(history_path), "%s", path ? path : "");
+}
+
 void server_stop(void)
 {
     if (!running) return;
     running = 0;
+    poller_wake(poller);
     pthread_join(server_thread, NULL);
+    poller_destroy(poller);
+    poller = NULL;
 }
 
 int server_get_peers(Peer *out, int max)
@@ -318,11 +1889,17 @@ int server_get_peers(Peer *out, int max)
     int count;
     pthread_mutex_lock(&peer_lock);
     count = peer_count < max ? peer_count : max;
-    memcpy(out, peers, count * sizeof(Peer));
+    for (int i = 0; i < count; i++)
+        out[i] = conns[i]->peer;
     pthread_mutex_unlock(&peer_lock);
     return count;
 }
 
+int server_peer_count(void)
+{
+    return peer_count;
+}
+
 int server_is_running(void)
 {
     return running;
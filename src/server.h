@@ -7,13 +7,34 @@
 
 #include "protocol.h"
 
+#include <stddef.h>
+
+/* Outbound bytes a peer may have queued before the slow-peer policy applies */
+#define PEER_QUEUE_HWM  (16 * 1024 * 1024)
+/* How long a peer over the mark may go without draining before it is cut */
+#define PEER_STALL_MS   5000
+
+typedef enum {
+    SLOW_PEER_DROP,         /* shed file chunks past the mark, NACKing each */
+    SLOW_PEER_DISCONNECT    /* also close peers that stall over the mark */
+} SlowPeerPolicy;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void server_start(const char *name);
 void server_stop(void);
+void server_set_queue_limit(size_t hwm_bytes, SlowPeerPolicy policy);
+void server_set_data_port(uint16_t port);   /* before server_start; DATA_PORT by default */
+/* Link with other servers that federate, so chat and transfers reach
+ * clients connected to them; before server_start */
+void server_set_federate(int on);
+/* Message store file (MSGSTORE_FILE by default); NULL or "" keeps none.
+ * Before server_start. */
+void server_set_history(const char *path);
 int  server_get_peers(Peer *out, int max);
+int  server_peer_count(void);
 int  server_is_running(void);
 
 #ifdef __cplusplus
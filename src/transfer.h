@@ -1,5 +1,6 @@
 /* transfer.h
- * Chunked file transfer with pause, resume, and per-chunk retry.
+ * Chunked file transfer with a sliding send window, pause, resume,
+ * and per-chunk retry.
  */
 
 #ifndef TRANSFER_H
@@ -7,10 +8,52 @@
 
 #include "protocol.h"
 
-#define MAX_TRANSFERS 16
+#include <stddef.h>
 
-typedef void (*TransferEventCb)(int xfer_id, XferState state,
-                                 uint32_t done, uint32_t total);
+#define XFER_HISTORY      64          /* finished transfers listed before reuse */
+#define XFER_SEND_WORKERS 4           /* outgoing transfers running at once */
+#define XFER_SMALL_MAX    (1 << 20)   /* files below this jump the queue */
+#define XFER_RATE_POLL_MS 50          /* a rate-limited stream rechecks pause */
+#define XFER_PROGRESS_MS  250         /* default gap between progress reports */
+#define XFER_SPEED_SAMPLES   8        /* throughput is a moving window of ... */
+#define XFER_SPEED_SAMPLE_MS 250      /* ... samples this far apart */
+
+/* Sidecar next to a partial download holding its chunk bitmap */
+#define XFER_JOURNAL_EXT ".mwpart"
+
+/* A deduplicated download is built here and renamed over the old file */
+#define XFER_TEMP_EXT    ".mwnew"
+
+/* Queued outgoing transfers start in this order, FIFO within each */
+typedef enum {
+    XFER_PRIO_HIGH,     /* files under XFER_SMALL_MAX */
+    XFER_PRIO_NORMAL,
+    XFER_PRIO_BULK,     /* CHUNK_BULK_MIN and up */
+    XFER_PRIO_COUNT
+} XferPriority;
+
+/* How the sender gets chunk bytes from the file to the socket */
+typedef enum {
+    XFER_IO_PREAD,      /* pread into a buffer, then send */
+    XFER_IO_MMAP,       /* send straight from a read-only mapping */
+    XFER_IO_SENDFILE    /* kernel copies page cache to socket (Linux) */
+} XferSendIo;
+
+/* A state change or progress report for the UI */
+typedef struct {
+    int         xfer_id;
+    XferState   state;
+    const char *filename;
+    const char *peer;
+    uint32_t    done_chunks;
+    uint32_t    total_chunks;
+    uint64_t    bytes_per_sec;  /* over the last couple of seconds */
+    int64_t     eta_s;          /* -1 until there is a rate */
+} XferProgress;
+
+/* Called with a lock held that orders the reports of one transfer; must
+ * not call back into the transfer engine */
+typedef void (*TransferEventCb)(const XferProgress *p);
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,22 +61,126 @@ extern "C" {
 
 void transfer_init(TransferEventCb cb);
 
+/* State changes are always reported.  Progress is reported once
+ * interval_ms have passed since the last report, or once another `pct`
+ * percent of the chunks are done, whichever comes first; 0 turns either
+ * test off, and both 0 report every chunk. */
+void transfer_set_progress(int interval_ms, int pct);
+
+/* Chunks kept in flight per transfer: start at `initial`, adapt to RTT,
+ * never exceed `max` (clamped to XFER_WINDOW_MIN..XFER_WINDOW_MAX). */
+void transfer_set_window(int initial, int max);
+
+/* Bytes per chunk for new outgoing transfers; 0 picks CHUNK_SIZE or
+ * CHUNK_SIZE_BULK from the file size. */
+void transfer_set_chunk_size(uint32_t bytes);
+
+/* Default is XFER_IO_SENDFILE on Linux, XFER_IO_PREAD elsewhere; modes the
+ * platform lacks fall back to pread. */
+void transfer_set_send_io(XferSendIo mode);
+
+/* Receiver durability: fdatasync an incoming file after every `bytes`
+ * written, and always once it is complete.  0 (default) syncs only at
+ * completion. */
+void transfer_set_sync_every(uint64_t bytes);
+
+/* Connections a direct transfer is split across when the caller passes 0
+ * (clamped to 1..XFER_STREAMS_MAX). */
+void transfer_set_streams(int streams);
+
+/* Cut outgoing files at content-defined boundaries and let the receiver
+ * skip chunks it already has from earlier downloads (default off). */
+void transfer_set_dedup(int on);
+
+/* Deflate outgoing chunks for receivers that can inflate them, until the
+ * first chunks show the data doesn't shrink (default off; needs zlib). */
+void transfer_set_compress(int on);
+
+/* Outgoing transfers are queued for XFER_SEND_WORKERS workers, by priority
+ * from the file size.  A paused one gives up its worker until resumed.
+ * With `direct`, META advertises a listener on this host and chunks go
+ * straight to the receiver if it can connect; otherwise via sock_fd.
+ * `streams` > 1 splits the chunk range across that many direct
+ * connections (0 uses the transfer_set_streams default).  `dedup` and
+ * `compress` are 1 or -1 to force deduplication or compression on or off,
+ * 0 for the transfer_set_dedup / transfer_set_compress defaults. */
 int  transfer_send_file(int sock_fd, const char *filepath,
-                        const char *peer_name);
+                        const char *peer_name, int direct, int streams,
+                        int dedup, int compress);
 
+/* `digest` is the BLAKE3 digest from a PKT_FLAG_DIGEST META, checked once
+ * the file is complete, or NULL from senders that don't send one.  With
+ * `cdc` (PKT_FLAG_CDC) the chunk bounds follow in a manifest. */
 int  transfer_recv_meta(int xfer_id, const char *sender,
                         const char *filename, uint32_t total_chunks,
-                        uint64_t file_size, const char *save_dir);
+                        uint64_t file_size, uint32_t chunk_size,
+                        const uint8_t *digest, int cdc, const char *save_dir);
+
+/* Feed one MSG_FILE_MANIFEST, entries for chunks first.. onward.  Returns 1
+ * once the manifest is complete, 0 while more is due, -1 on a bad one
+ * (the transfer is failed). */
+int  transfer_recv_manifest(int xfer_id, uint32_t first,
+                            const uint8_t *data, uint32_t len);
 
-int  transfer_recv_chunk(int xfer_id, uint32_t chunk_seq,
+/* Copy the chunks of a complete manifest that earlier downloads already
+ * hold into place, before the META is answered.  Returns how many. */
+int  transfer_dedup(int xfer_id);
+
+/* `flags` are the chunk's header flags; with PKT_FLAG_CRC the payload
+ * starts with a CRC32C of the chunk data, and a mismatch fails the chunk.
+ * With PKT_FLAG_DEFLATE the rest is inflated first. */
+int  transfer_recv_chunk(int xfer_id, uint32_t chunk_seq, uint16_t flags,
                          const uint8_t *data, int data_len);
 
+/* Feed an ACK (ok=1) or NACK (ok=0) for an outgoing chunk to its sender.
+ * ok=-1 is a relay's PKT_FLAG_SHED NACK: the chunk never reached the
+ * receiver, so its resend doesn't count toward XFER_MAX_RETRIES. */
+void transfer_on_ack(int xfer_id, uint32_t seq, int ok);
+
+/* Feed a MSG_FILE_HAVE bitmap (chunks a resuming receiver already holds)
+ * to its sender, which then skips them */
+void transfer_on_have(int xfer_id, const uint8_t *map, uint32_t len);
+
+/* Feed the receiver's answer to META (PKT_FLAG_META ACK/NACK) to its sender.
+ * PKT_FLAG_DIRECT in `flags` means the receiver has dialled the advertised
+ * listener, with `conns` connections; PKT_FLAG_CRC asks for chunk CRCs,
+ * PKT_FLAG_DEFLATE allows deflated chunks. */
+void transfer_on_meta_reply(int xfer_id, int ok, uint16_t flags, int conns);
+
+/* Outgoing rate caps in bytes per second, 0 for none.  The global cap
+ * is shared by every transfer, a peer's by the transfers to it; `peer`
+ * NULL sets the cap each peer without its own gets.  xfer_id 0 sets the
+ * cap new transfers start with, otherwise that transfer's (-1 if it is
+ * not sending).  All take effect on the next chunk. */
+void transfer_set_limit(uint64_t bps);
+int  transfer_set_peer_limit(const char *peer, uint64_t bps);
+int  transfer_set_xfer_limit(int xfer_id, uint64_t bps);
+
+/* Fair queuing: transfers held back by the same global or peer cap take
+ * turns by bytes sent, instead of whichever stream wakes first */
+void transfer_set_fair(int on);
+
+/* Move an outgoing transfer to another queue; takes effect if it is still
+ * waiting, or when it is resumed after a pause */
+int  transfer_set_priority(int xfer_id, XferPriority prio);
+
+/* The outgoing file is a spool copy: once the transfer is done with it,
+ * delete it, and its directory if that leaves it empty.  -1 if the
+ * transfer is already over. */
+int  transfer_set_spool(int xfer_id);
+
 int  transfer_pause(int xfer_id);
 int  transfer_resume(int xfer_id);
 
+/* Copies of the listed transfers, at most transfer_count() of them */
+int  transfer_count(void);
 int  transfer_get_all(Transfer *out, int max);
 Transfer *transfer_find(int xfer_id);
 
+/* Path of a file this side received in full; -1 for sends and unfinished
+ * or unknown transfers */
+int  transfer_saved_path(int xfer_id, char *out, size_t len);
+
 int  transfer_next_id(void);
 
 #ifdef __cplusplus
@@ -1,38 +1,32 @@
 /* util.c
- * Logging, time helpers, and socket utilities.
+ * Time helpers and socket utilities.  Logging lives in logger.c.
  */
 
 #include "util.h"
 #include <stdio.h>
-#include <stdarg.h>
+#include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
-void util_log(LogLevel level, const char *fmt, ...)
-{
-    const char *tag;
-    switch (level) {
-        case LOG_INFO:  tag = "INFO";  break;
-        case LOG_WARN:  tag = "WARN";  break;
-        case LOG_ERROR: tag = "ERROR"; break;
-        default:        tag = "???";   break;
-    }
-
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    struct tm *tm = localtime(&tv.tv_sec);
-
-    fprintf(stderr, "[%02d:%02d:%02d.%03d] [%s] ",
-            tm->tm_hour, tm->tm_min, tm->tm_sec,
-            (int)(tv.tv_usec / 1000), tag);
+/* Striped write locks: fds hash onto a small fixed set of mutexes. */
+#define SEND_LOCKS 64
+static pthread_mutex_t send_locks[SEND_LOCKS];
+static pthread_once_t  send_locks_once = PTHREAD_ONCE_INIT;
 
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-
-    fprintf(stderr, "\n");
+static void send_locks_init(void)
+{
+    for (int i = 0; i < SEND_LOCKS; i++)
+        pthread_mutex_init(&send_locks[i], NULL);
 }
 
 long util_time_ms(void)
@@ -42,9 +36,92 @@ long util_time_ms(void)
     return (long)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
 }
 
+long long util_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 void util_set_nonblocking(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags >= 0)
         fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
+
+void util_set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int util_sendv_all(int fd, struct iovec *iov, int iovcnt)
+{
+    pthread_once(&send_locks_once, send_locks_init);
+    pthread_mutex_t *lk = &send_locks[(unsigned)fd % SEND_LOCKS];
+
+    int rc = 0;
+    pthread_mutex_lock(lk);
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { rc = -1; break; }
+
+        /* Advance past fully written vectors, trim a partial one */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    pthread_mutex_unlock(lk);
+    return rc;
+}
+
+#ifdef __linux__
+int util_sendfile_all(int fd, const void *head, int head_len,
+                      int file_fd, uint64_t offset, uint32_t len)
+{
+    pthread_once(&send_locks_once, send_locks_init);
+    pthread_mutex_t *lk = &send_locks[(unsigned)fd % SEND_LOCKS];
+
+    int rc = 0;
+    pthread_mutex_lock(lk);
+
+    /* MSG_MORE holds the header back so it leaves in the payload's first segment */
+    const char *p = (const char *)head;
+    while (head_len > 0) {
+        ssize_t n = send(fd, p, (size_t)head_len, MSG_NOSIGNAL | MSG_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { rc = -1; break; }
+        p += n;
+        head_len -= (int)n;
+    }
+
+    off_t off = (off_t)offset;
+    while (rc == 0 && len > 0) {
+        ssize_t n = sendfile(fd, file_fd, &off, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { rc = -1; break; }     /* 0: the file shrank under us */
+        len -= (uint32_t)n;
+    }
+    pthread_mutex_unlock(lk);
+    return rc;
+}
+#endif
+
+int util_send_all(int fd, const void *buf, int len)
+{
+    struct iovec iov = { (void *)buf, (size_t)len };
+    return util_sendv_all(fd, &iov, 1);
+}
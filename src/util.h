@@ -5,19 +5,75 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      /* macOS: SIGPIPE is ignored process-wide instead */
+#endif
+
 typedef enum {
+    LOG_DEBUG,
     LOG_INFO,
     LOG_WARN,
     LOG_ERROR
 } LogLevel;
 
+#define LOG_RING_SLOTS  256     /* lines a thread can have waiting */
+#define LOG_LINE_MAX    512     /* message bytes kept per line */
+#define LOG_FLUSH_MS    50      /* INFO lines may wait this long to be written */
+
+/* Levels below this are compiled out (cmake -DMESHWAVE_LOG_MIN=WARN) */
+#ifndef LOG_COMPILED_MIN
+#define LOG_COMPILED_MIN LOG_DEBUG
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void util_log(LogLevel level, const char *fmt, ...);
+struct iovec;
+
+/* util_log formats the message into the calling thread's ring and returns;
+ * a logger thread adds the time and writes lines out in order.  Filtered
+ * levels cost one comparison. */
+extern int util_log_min;     /* runtime threshold, LOG_INFO by default */
+
+#define util_log(level, ...)                                                 \
+    do {                                                                     \
+        if ((level) >= LOG_COMPILED_MIN && (int)(level) >= util_log_min)     \
+            util_log_write((level), __VA_ARGS__);                            \
+    } while (0)
+
+void util_log_write(LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Send lines to `path` (appended) instead of stderr, and/or as one JSON
+ * object each.  Call before logging starts in earnest. */
+int  util_log_open(const char *path, int json);
+int  util_log_parse_level(const char *name, LogLevel *out);
+
+/* Write out what is queued and stop the logger thread; later lines are
+ * written synchronously.  Also runs at exit. */
+void util_log_close(void);
 long util_time_ms(void);
+long long util_time_us(void);
 void util_set_nonblocking(int fd);
+/* Small packets go out at once; senders batch them into one write instead */
+void util_set_nodelay(int fd);
+
+/* Blocking writes that deliver the whole buffer or fail.  Each call is
+ * serialized per fd, so one call per packet keeps framing intact when
+ * several threads write to the same socket. */
+int  util_send_all(int fd, const void *buf, int len);
+int  util_sendv_all(int fd, struct iovec *iov, int iovcnt);
+
+#ifdef __linux__
+/* Same, for `head` followed by `len` bytes of file_fd at `offset`, which the
+ * kernel copies straight from the page cache (sendfile). */
+int  util_sendfile_all(int fd, const void *head, int head_len,
+                       int file_fd, uint64_t offset, uint32_t len);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,206 @@
+/* wire.c
+ * Header codec.  v1 is the original 7-byte struct sent in host byte order
+ * (kept bit-for-bit so old peers can still say HELLO and chat); v2 is a
+ * 16-byte big-endian header with a 32-bit length and an explicit stream ID.
+ * Framing and payload decoding follow; bench/ and fuzz/ drive them alone.
+ */
+
+#include "wire.h"
+#include "hash.h"
+#include "util.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int wire_hdr_size(int version)
+{
+    return version >= PROTO_V2 ? WIRE_HDR_V2 : WIRE_HDR_V1;
+}
+
+static void put32(uint8_t *p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+static void put16(uint8_t *p, uint16_t v) { v = htons(v); memcpy(p, &v, 2); }
+static uint32_t get32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+static uint16_t get16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return ntohs(v); }
+static uint64_t get64(const uint8_t *p) { return (uint64_t)get32(p) << 32 | get32(p + 4); }
+
+int wire_encode(int version, const PktHeader *hdr, uint8_t *out)
+{
+    if (version < PROTO_V2) {
+        PktHeaderV1 v1;
+        v1.type        = hdr->type;
+        v1.seq         = hdr->seq;
+        v1.payload_len = (uint16_t)hdr->payload_len;
+        memcpy(out, &v1, sizeof(v1));
+        return WIRE_HDR_V1;
+    }
+
+    out[0] = PROTO_V2;
+    out[1] = hdr->type;
+    put16(out + 2,  hdr->flags);
+    put32(out + 4,  hdr->stream_id);
+    put32(out + 8,  hdr->seq);
+    put32(out + 12, hdr->payload_len);
+    return WIRE_HDR_V2;
+}
+
+int wire_decode(int version, const uint8_t *in, PktHeader *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+
+    if (version < PROTO_V2) {
+        PktHeaderV1 v1;
+        memcpy(&v1, in, sizeof(v1));
+        hdr->version     = PROTO_V1;
+        hdr->type        = v1.type;
+        hdr->seq         = v1.seq;
+        hdr->payload_len = v1.payload_len;
+        return 0;
+    }
+
+    if (in[0] != PROTO_V2) return WIRE_ERR_BAD;
+    hdr->version     = in[0];
+    hdr->type        = in[1];
+    hdr->flags       = get16(in + 2);
+    hdr->stream_id   = get32(in + 4);
+    hdr->seq         = get32(in + 8);
+    hdr->payload_len = get32(in + 12);
+    return hdr->payload_len > MAX_PAYLOAD ? WIRE_ERR_SIZE : 0;
+}
+
+/* ── Framing and payloads ───────────────────────────────── */
+
+long wire_frame(int version, const uint8_t *buf, size_t len, PktHeader *hdr)
+{
+    size_t hsize = (size_t)wire_hdr_size(version);
+    if (len < hsize) {
+        memset(hdr, 0, sizeof(*hdr));
+        return 0;
+    }
+    int rc = wire_decode(version, buf, hdr);
+    if (rc < 0) return rc;
+    size_t total = hsize + hdr->payload_len;
+    return len < total ? 0 : (long)total;
+}
+
+int wire_parse_meta(const PktHeader *hdr, const uint8_t *payload, WireMeta *out)
+{
+    const uint8_t *end = payload + hdr->payload_len;
+
+    memset(out, 0, sizeof(*out));
+    if (hdr->flags & PKT_FLAG_DIGEST) {
+        if (hdr->payload_len < HASH_DIGEST_LEN) return -1;
+        end        -= HASH_DIGEST_LEN;
+        out->digest = end;
+    }
+
+    const uint8_t *sep1 = memchr(payload, '\0', (size_t)(end - payload));
+    if (!sep1) return -1;
+    const uint8_t *sep2 = memchr(sep1 + 1, '\0', (size_t)(end - sep1 - 1));
+    if (!sep2) return -1;
+
+    const uint8_t *bin = sep2 + 1;
+    if (end - bin < 16) return -1;
+    out->recipient    = (const char *)payload;
+    out->filename     = (const char *)sep1 + 1;
+    out->total_chunks = get32(bin);
+    out->file_size    = get64(bin + 4);
+    out->chunk_size   = get32(bin + 12);
+    bin += 16;
+
+    /* Senders from before multi-stream stop at the port */
+    if (end - bin >= 6) {
+        out->direct = bin;
+        if (end - bin >= 7) out->streams = bin[6];
+    }
+    return 0;
+}
+
+int wire_parse_chunk(uint16_t flags, const uint8_t *payload, uint32_t len, WireChunk *out)
+{
+    out->crc = 0;
+    if (flags & PKT_FLAG_CRC) {
+        if (len < XFER_CRC_LEN) return -1;
+        out->crc = get32(payload);
+        payload += XFER_CRC_LEN;
+        len     -= XFER_CRC_LEN;
+    }
+    out->data = payload;
+    out->len  = len;
+    return 0;
+}
+
+int wire_parse_chat(const PktHeader *hdr, const uint8_t *payload,
+                    const char **name, const char **text, uint32_t *text_len)
+{
+    const uint8_t *sep = memchr(payload, '\0', hdr->payload_len);
+    if (!sep) return -1;
+    *name     = (const char *)payload;
+    *text     = (const char *)sep + 1;
+    *text_len = hdr->payload_len - (uint32_t)(sep + 1 - payload);
+    return 0;
+}
+
+int wire_recv_header(int fd, int version, PktHeader *hdr)
+{
+    uint8_t raw[WIRE_HDR_MAX];
+    int     need = wire_hdr_size(version);
+
+    ssize_t n = recv(fd, raw, need, MSG_WAITALL);
+    if (n != need) return WIRE_ERR_BAD;
+    return wire_decode(version, raw, hdr);
+}
+
+int wire_skip(int fd, uint32_t len)
+{
+    char buf[16384];
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len < sizeof(buf) ? len : sizeof(buf), 0);
+        if (n <= 0) return -1;
+        len -= (uint32_t)n;
+    }
+    return 0;
+}
+
+int wire_sendv(int fd, int version, PktHeader *hdr, struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[8];
+    uint8_t      raw[WIRE_HDR_MAX];
+
+    if (iovcnt > 7) return -1;
+
+    uint32_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += (uint32_t)iov[i].iov_len;
+        vec[i + 1] = iov[i];
+    }
+    if (version < PROTO_V2 && len > 0xFFFF) return -1;
+    hdr->payload_len = len;
+
+    vec[0].iov_base = raw;
+    vec[0].iov_len  = (size_t)wire_encode(version, hdr, raw);
+    return util_sendv_all(fd, vec, iovcnt + 1);
+}
+
+int wire_send(int fd, int version, PktHeader *hdr, const void *payload, uint32_t len)
+{
+    struct iovec iov = { (void *)payload, len };
+    return wire_sendv(fd, version, hdr, &iov, len > 0 ? 1 : 0);
+}
+
+#ifdef __linux__
+int wire_send_file(int fd, int version, PktHeader *hdr, const void *prefix,
+                   uint32_t prefix_len, int file_fd, uint64_t offset, uint32_t len)
+{
+    uint8_t raw[WIRE_HDR_MAX + WIRE_PREFIX_MAX];
+
+    if (prefix_len > WIRE_PREFIX_MAX) return -1;
+    if (version < PROTO_V2 && prefix_len + len > 0xFFFF) return -1;
+    hdr->payload_len = prefix_len + len;
+
+    int head_len = wire_encode(version, hdr, raw);
+    if (prefix_len > 0) memcpy(raw + head_len, prefix, prefix_len);
+    return util_sendfile_all(fd, raw, head_len + (int)prefix_len, file_fd, offset, len);
+}
+#endif
@@ -0,0 +1,96 @@
+/* wire.h
+ * Packet header encoding for protocol v1 (legacy) and v2, framing and
+ * payload decoding shared by the server and client, and whole-packet
+ * socket I/O on top of it.  The parsers never allocate or copy: decoded
+ * fields point into the caller's buffer.
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "protocol.h"
+
+#include <stddef.h>
+
+struct iovec;
+
+#define WIRE_HDR_V1  7
+#define WIRE_HDR_V2  16
+#define WIRE_HDR_MAX WIRE_HDR_V2
+#define WIRE_PREFIX_MAX 16     /* payload bytes wire_send_file can put ahead of the file */
+
+#define WIRE_ERR_BAD    -1     /* not a header: framing is lost */
+#define WIRE_ERR_SIZE   -2     /* valid header, payload over MAX_PAYLOAD: skip it */
+
+/* MSG_FILE_META payload:
+ *   "recipient\0filename\0" total_chunks(4B) file_size(8B) chunk_size(4B)
+ *   [ direct_ip(4B) direct_port(2B) [ streams(1B) ] ] [ digest(32B) ] */
+typedef struct {
+    const char    *recipient;
+    const char    *filename;
+    uint32_t       total_chunks;
+    uint64_t       file_size;
+    uint32_t       chunk_size;
+    const uint8_t *direct;      /* ip and port, network order; NULL if absent */
+    int            streams;     /* connections offered; 0 if not given */
+    const uint8_t *digest;      /* HASH_DIGEST_LEN bytes with PKT_FLAG_DIGEST, else NULL */
+} WireMeta;
+
+/* MSG_FILE_CHUNK payload: [ crc32c(4B) with PKT_FLAG_CRC ] data */
+typedef struct {
+    uint32_t       crc;
+    const uint8_t *data;
+    uint32_t       len;
+} WireChunk;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  wire_hdr_size(int version);
+
+/* Serialize `hdr` in the framing of `version`; returns bytes written. */
+int  wire_encode(int version, const PktHeader *hdr, uint8_t *out);
+
+/* Parse a header of `version`.  Returns 0, WIRE_ERR_BAD for a bad version
+ * tag, or WIRE_ERR_SIZE (hdr still filled) for a payload over MAX_PAYLOAD. */
+int  wire_decode(int version, const uint8_t *in, PktHeader *hdr);
+
+/* Frame the next packet of buf[0..len).  Returns its total length once
+ * all of it is in buf, 0 if more bytes are needed (hdr is filled as soon
+ * as the header is in, else zeroed), or a WIRE_ERR_* */
+long wire_frame(int version, const uint8_t *buf, size_t len, PktHeader *hdr);
+
+/* Payload decoders; 0, or -1 if the payload is malformed */
+int  wire_parse_meta(const PktHeader *hdr, const uint8_t *payload, WireMeta *out);
+int  wire_parse_chunk(uint16_t flags, const uint8_t *payload, uint32_t len, WireChunk *out);
+
+/* MSG_CHAT: "name\0text" (name is the recipient going to the server, the
+ * sender coming back).  *name is terminated in place; text is not. */
+int  wire_parse_chat(const PktHeader *hdr, const uint8_t *payload,
+                     const char **name, const char **text, uint32_t *text_len);
+
+/* Blocking read of exactly one header.  On WIRE_ERR_SIZE the header was
+ * consumed and hdr is filled, so the caller can wire_skip the payload. */
+int  wire_recv_header(int fd, int version, PktHeader *hdr);
+
+/* Read and throw away `len` bytes */
+int  wire_skip(int fd, uint32_t len);
+
+/* Send one packet atomically.  hdr->payload_len is set from the payload. */
+int  wire_send(int fd, int version, PktHeader *hdr, const void *payload, uint32_t len);
+int  wire_sendv(int fd, int version, PktHeader *hdr, struct iovec *iov, int iovcnt);
+
+#ifdef __linux__
+/* Send one packet whose payload is `prefix` (up to WIRE_PREFIX_MAX bytes)
+ * followed by `len` bytes of file_fd at `offset`, without copying the file
+ * bytes through userspace. */
+int  wire_send_file(int fd, int version, PktHeader *hdr, const void *prefix,
+                    uint32_t prefix_len, int file_fd, uint64_t offset, uint32_t len);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WIRE_H */